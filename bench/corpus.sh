@@ -0,0 +1,69 @@
+#!/bin/sh
+# Generates the replay corpus for `make bench` into the given directory.
+set -e
+out=${1:-bench/corpus}
+mkdir -p "$out"
+
+# Dense ASCII: long lines of printable text, like a build log or cat(1)
+awk 'BEGIN {
+  for (i = 0; i < 200000; i++) {
+    line = sprintf("%06d ", i)
+    for (j = 0; j < 12; j++) line = line "lorem ipsum "
+    print line
+  }
+}' > "$out/dense_ascii.txt"
+
+# Heavy SGR: every word gets its own colors and attributes
+awk 'BEGIN {
+  for (i = 0; i < 100000; i++) {
+    line = ""
+    for (j = 0; j < 16; j++)
+      line = line sprintf("\033[%d;%d;%dmword\033[0m ", j % 8, 30 + (i + j) % 8, 40 + j % 8)
+    print line
+  }
+}' > "$out/sgr.txt"
+
+# Full-screen TUI redraws: alternate screen, absolute cursor moves, 
+# erases and a status line, like top(1) or an editor
+awk 'BEGIN {
+  printf "\033[?1049h"
+  for (f = 0; f < 2000; f++) {
+    printf "\033[H\033[2J"
+    for (r = 1; r <= 48; r++)
+      printf "\033[%d;1H\033[K%5d %-40s %8.2f %%", r, f * 48 + r, "process", (f * r) % 1000 / 10
+    printf "\033[50;1H\033[7m frame %d \033[0m", f
+  }
+  printf "\033[?1049l"
+}' > "$out/tui.txt"
+
+# Scroll region: a pager or editor scrolling below a fixed header, with
+# lines inserted and deleted in the middle
+awk 'BEGIN {
+  printf "\033[2;49r\033[49;1H"
+  for (i = 0; i < 300000; i++) {
+    printf "line %d of a scrolling region like less or vim\r\n", i
+    if (i % 7 == 0) printf "\033[5;1H\033[3L\033[49;1H"
+    if (i % 11 == 0) printf "\033[10;1H\033[2M\033[49;1H"
+  }
+  printf "\033[r"
+}' > "$out/region.txt"
+
+# CJK: three-byte, double width characters
+awk 'BEGIN {
+  cjk = "\346\274\242\345\255\227\346\227\245\346\234\254\350\252\236\344\270\255\346\226\207"
+  for (i = 0; i < 100000; i++) {
+    line = ""
+    for (j = 0; j < 10; j++) line = line cjk
+    print line
+  }
+}' > "$out/cjk.txt"
+
+# Emoji: four-byte sequences, some with a variation selector
+awk 'BEGIN {
+  emoji = "\360\237\230\200\360\237\232\200\342\235\244\357\270\217\360\237\221\215\360\237\216\211"
+  for (i = 0; i < 100000; i++) {
+    line = ""
+    for (j = 0; j < 8; j++) line = line emoji " "
+    print line
+  }
+}' > "$out/emoji.txt"
@@ -0,0 +1,56 @@
+#pragma once
+
+// Frame scheduling, in milliseconds. After pty output arrives, drawing 
+// waits until the output has been idle for up to minlatency, but never
+// longer than maxlatency after the first change that is not on screen yet.
+static const double minlatency = 8;
+static const double maxlatency = 33;
+
+// Lines of history kept as cells above the main screen. Older lines are
+// kept in compact form, up to SCROLLBACK_LINES lines of history in total.
+#define SCROLLBACK_HOT_LINES 1000
+#define SCROLLBACK_LINES 1000000
+
+// Bytes of compact history kept in memory, older blocks are moved to a
+// temporary file and mapped back when scrolled to. 0 keeps everything
+// in memory.
+#define SCROLLBACK_MEMORY (64 << 20)
+
+// Screen size and minimum amount of bytes parsed for --headless --replay
+#define HEADLESS_COLS 200
+#define HEADLESS_ROWS 50
+#define HEADLESS_MIN_BYTES (64 << 20)
+
+// Font the screen is drawn with by --headless --gl and --soft
+#define HEADLESS_FONT "monospace"
+#define HEADLESS_FONT_SIZE 16
+
+// Text and background without SGR colors, as 0xRRGGBB
+#define TERM_FOREGROUND 0xffffff
+#define TERM_BACKGROUND 0x000000
+
+// The 16 colors of SGR 30-37 and 90-97, also the first 16 of the 256 
+// color palette. The rest of it is the usual 6x6x6 cube and gray ramp.
+#define TERM_PALETTE { \
+  0x000000, 0xcd0000, 0x00cd00, 0xcdcd00, 0x0000ee, 0xcd00cd, 0x00cdcd, 0xe5e5e5, \
+  0x7f7f7f, 0xff0000, 0x00ff00, 0xffff00, 0x5c5cff, 0xff00ff, 0x00ffff, 0xffffff, \
+}
+
+// Background of search matches, and of the matches on the line jumped to
+#define SEARCH_MATCH_COLOR ((RnColor){ 110, 90, 20, 255 })
+#define SEARCH_CURRENT_COLOR ((RnColor){ 200, 120, 30, 255 })
+
+// Distinct SGR styles stored at most. Past that, 24-bit colors of new 
+// styles are reduced to the 256 color palette.
+#define STYLE_TABLE_MAX (1 << 20)
+
+// Bytes of shaped text kept to be drawn again without shaping it
+#define SHAPE_CACHE_MEMORY (4 << 20)
+
+// Fallback fonts found for each Unicode block are remembered in this 
+// file under $XDG_CACHE_HOME, or ~/.cache
+#define FALLBACK_CACHE_FILE "tyr/fallback"
+
+// Bytes of glyph bitmaps the CPU renderer keeps, past that they are 
+// rasterized again as they are drawn
+#define SOFT_GLYPH_MEMORY (8 << 20)
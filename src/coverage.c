@@ -0,0 +1,71 @@
+#include "coverage.h"
+
+#include <stdlib.h>
+
+#include "../vendor/stb_ds.h"
+
+static uint16_t pageof(font_coverage_t* c, uint32_t page) {
+  uint16_t* idx;
+  if (page < 256) {
+    idx = &c->bmp[page];
+  } else {
+    ptrdiff_t i = hmgeti(c->astral, page);
+    if (i < 0) {
+      hmput(c->astral, page, 0);
+      i = hmgeti(c->astral, page);
+    }
+    idx = &c->astral[i].value;
+  }
+  if (!*idx) {
+    *idx = arrlen(c->pages);
+    arrput(c->pages, (coverage_page_t){0});
+  }
+  return *idx;
+}
+
+static font_coverage_t* build(FT_Face face) {
+  font_coverage_t* c = calloc(1, sizeof(*c));
+  arrput(c->pages, (coverage_page_t){0});
+  FT_UInt gid;
+  FT_ULong cp = FT_Get_First_Char(face, &gid);
+  while (gid) {
+    if (cp < 0x110000) {
+      uint16_t idx = pageof(c, cp >> 8);
+      c->pages[idx].bits[(cp & 0xff) >> 5] |= 1u << (cp & 31);
+    }
+    cp = FT_Get_Next_Char(face, cp, &gid);
+  }
+  return c;
+}
+
+// Text is mostly in one font, that one is asked for over and over
+static FT_Face lastface;
+static font_coverage_t* last;
+
+const font_coverage_t* fontcoverage(FT_Face face) {
+  if (face == lastface) return last;
+  ptrdiff_t i = hmgeti(s.coverage, face);
+  if (i < 0) {
+    hmput(s.coverage, face, build(face));
+    i = hmgeti(s.coverage, face);
+  }
+  lastface = face;
+  last = s.coverage[i].value;
+  return last;
+}
+
+uint16_t coverageastral(const font_coverage_t* c, uint32_t page) {
+  ptrdiff_t i = hmgeti(((font_coverage_t*)c)->astral, page);
+  return i < 0 ? 0 : c->astral[i].value;
+}
+
+void coveragefree(void) {
+  for (ptrdiff_t i = 0; i < hmlen(s.coverage); i++) {
+    hmfree(s.coverage[i].value->astral);
+    arrfree(s.coverage[i].value->pages);
+    free(s.coverage[i].value);
+  }
+  hmfree(s.coverage);
+  lastface = NULL;
+  last = NULL;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tyr.h"
+
+// Coverage of face, worked out from its character map the first time
+const font_coverage_t* fontcoverage(FT_Face face);
+
+// Page of codepoints page << 8 and up outside the BMP, 0 if empty
+uint16_t coverageastral(const font_coverage_t* c, uint32_t page);
+
+// Whether the font has a glyph for codepoint, like a nonzero 
+// FT_Get_Char_Index but without going through the character map
+static inline bool coveragehas(const font_coverage_t* c, uint32_t codepoint) {
+  uint32_t page = codepoint >> 8;
+  uint16_t idx = page < 256 ? c->bmp[page] : coverageastral(c, page);
+  return (c->pages[idx].bits[(codepoint & 0xff) >> 5] >> (codepoint & 31)) & 1;
+}
+
+static inline bool fonthas(FT_Face face, uint32_t codepoint) {
+  return coveragehas(fontcoverage(face), codepoint);
+}
+
+void coveragefree(void);
@@ -0,0 +1,315 @@
+#include "fallback.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fontconfig/fontconfig.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "coverage.h"
+#include "shapecache.h"
+#include "../vendor/stb_ds.h"
+
+// Family of the font fontconfig picks for codepoint, NULL if no 
+// installed font has it
+static char* matchfamily(uint32_t codepoint) {
+  FcPattern *pattern = FcPatternCreate();
+  FcCharSet *charset = FcCharSetCreate();
+
+  FcCharSetAddChar(charset, codepoint);
+  FcPatternAddCharSet(pattern, FC_CHARSET, charset);
+
+  FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+  FcDefaultSubstitute(pattern);
+
+  FcResult result;
+  FcPattern *match = FcFontMatch(NULL, pattern, &result);
+
+  char *font_family = NULL;
+
+  if (match) {
+    // The best match is not guaranteed to have it
+    FcCharSet *has = NULL;
+    FcChar8 *family = NULL;
+    if (FcPatternGetCharSet(match, FC_CHARSET, 0, &has) == FcResultMatch &&
+      FcCharSetHasChar(has, codepoint) &&
+      FcPatternGetString(match, FC_FAMILY, 0, &family) == FcResultMatch) {
+      font_family = strdup((char*)family); 
+    }
+    FcPatternDestroy(match);
+  }
+
+  FcPatternDestroy(pattern);
+  FcCharSetDestroy(charset);
+
+  return font_family; 
+}
+
+static void* fallbackworker(void* data) {
+  fallback_t* fb = (fallback_t*)data;
+  while (true) {
+    pthread_mutex_lock(&fb->lock);
+    while (!arrlen(fb->requests) && !fb->quit)
+      pthread_cond_wait(&fb->cond, &fb->lock);
+    if (fb->quit) {
+      pthread_mutex_unlock(&fb->lock);
+      break;
+    }
+    // Newest first, that is what is on screen
+    fallback_request_t req = arrpop(fb->requests);
+    pthread_mutex_unlock(&fb->lock);
+
+    char* family = matchfamily(req.codepoint);
+
+    pthread_mutex_lock(&fb->lock);
+    arrput(fb->results, ((fallback_entry_t){ 
+      .key = req.key, 
+      .status = family ? FALLBACK_FOUND : FALLBACK_NONE, 
+      .family = family,
+    }));
+    pthread_mutex_unlock(&fb->lock);
+    char dummy = 1;
+    write(fb->notify_pipe[1], &dummy, 1);
+  }
+  return NULL;
+}
+
+static uint64_t hashbytes(uint64_t h, const void* data, size_t n) {
+  const uint8_t* p = data;
+  for (size_t i = 0; i < n; i++) 
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+// Changes when a configuration file is edited or fonts are installed, 
+// which changes the font directories
+static uint64_t fontconfigkey(void) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  FcStrList* lists[2] = { FcConfigGetConfigFiles(NULL), FcConfigGetFontDirs(NULL) };
+  for (uint32_t i = 0; i < 2; i++) {
+    if (!lists[i]) continue;
+    FcChar8* path;
+    while ((path = FcStrListNext(lists[i]))) {
+      struct stat st;
+      h = hashbytes(h, path, strlen((char*)path));
+      if (stat((char*)path, &st) == 0) 
+        h = hashbytes(h, &st.st_mtim, sizeof(st.st_mtim));
+    }
+    FcStrListDone(lists[i]);
+  }
+  return h;
+}
+
+static bool cachepath(char* path, size_t size) {
+  const char* dir = getenv("XDG_CACHE_HOME");
+  if (dir && *dir) {
+    snprintf(path, size, "%s/%s", dir, FALLBACK_CACHE_FILE);
+    return true;
+  }
+  const char* home = getenv("HOME");
+  if (!home) return false;
+  snprintf(path, size, "%s/.cache/%s", home, FALLBACK_CACHE_FILE);
+  return true;
+}
+
+// The file starts with the fontconfig key it is for, then has one 
+// "key family" line per lookup, with an empty family if none was found
+static void readcache(void) {
+  fallback_t* fb = &s.fallback;
+  char path[4096];
+  if (!cachepath(path, sizeof(path))) return;
+  FILE* f = fopen(path, "r");
+  if (!f) return;
+  char line[512];
+  unsigned long long key;
+  if (!fgets(line, sizeof(line), f) || 
+    sscanf(line, "tyr-fallback %llx", &key) != 1 || key != fb->configkey) {
+    // Made for other fonts, it is rewritten at exit
+    fclose(f);
+    return;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    char* end;
+    unsigned long k = strtoul(line, &end, 16);
+    if (end == line || *end != ' ') continue;
+    char* family = end + 1;
+    family[strcspn(family, "\n")] = '\0';
+    fallback_entry_t e = { .key = k, .status = FALLBACK_NONE };
+    if (*family) {
+      e.status = FALLBACK_FOUND;
+      e.family = strdup(family);
+    }
+    hmputs(fb->table, e);
+  }
+  fclose(f);
+}
+
+static void writecache(void) {
+  fallback_t* fb = &s.fallback;
+  char path[4096], tmp[4096 + 16];
+  if (!cachepath(path, sizeof(path))) return;
+  // The cache directory and the one for tyr in it may not exist yet
+  char* slash = strrchr(path, '/');
+  *slash = '\0';
+  char* parent = strrchr(path, '/');
+  if (parent) {
+    *parent = '\0';
+    mkdir(path, 0700);
+    *parent = '/';
+  }
+  mkdir(path, 0700);
+  *slash = '/';
+
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    fprintf(stderr, "tyr: cannot write %s: %s\n", path, strerror(errno));
+    return;
+  }
+  FILE* f = fdopen(fd, "w");
+  fprintf(f, "tyr-fallback %llx\n", (unsigned long long)fb->configkey);
+  for (ptrdiff_t i = 0; i < hmlen(fb->table); i++) {
+    fallback_entry_t* e = &fb->table[i];
+    if (e->status == FALLBACK_PENDING) continue;
+    fprintf(f, "%x %s\n", e->key, e->status == FALLBACK_FOUND ? e->family : "");
+  }
+  // Replaced at once, other windows may read it at the same time
+  if (fclose(f) != 0 || rename(tmp, path) != 0) {
+    fprintf(stderr, "tyr: cannot write %s: %s\n", path, strerror(errno));
+    unlink(tmp);
+  }
+}
+
+static bool fallbackinit(void) {
+  fallback_t* fb = &s.fallback;
+  if (fb->started) return true;
+  if (pipe(fb->notify_pipe) == -1) {
+    perror("pipe");
+    return false;
+  }
+  fcntl(fb->notify_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(fb->notify_pipe[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&fb->lock, NULL);
+  pthread_cond_init(&fb->cond, NULL);
+  fb->quit = false;
+  if (pthread_create(&fb->thread, NULL, fallbackworker, fb) != 0) {
+    perror("pthread_create");
+    close(fb->notify_pipe[0]);
+    close(fb->notify_pipe[1]);
+    return false;
+  }
+  fb->configkey = fontconfigkey();
+  readcache();
+  fb->started = true;
+  return true;
+}
+
+// Entry of key, posting a lookup of codepoint if it is new
+static fallback_entry_t* lookup(uint32_t key, uint32_t codepoint) {
+  fallback_t* fb = &s.fallback;
+  fallback_entry_t* e = hmgetp_null(fb->table, key);
+  if (e) return e;
+  hmputs(fb->table, ((fallback_entry_t){ .key = key, .status = FALLBACK_PENDING }));
+  pthread_mutex_lock(&fb->lock);
+  arrput(fb->requests, ((fallback_request_t){ .key = key, .codepoint = codepoint }));
+  pthread_cond_signal(&fb->cond);
+  pthread_mutex_unlock(&fb->lock);
+  return hmgetp_null(fb->table, key);
+}
+
+// Fallbacks are loaded in the style and size of the terminal font
+static bool loadfont(fallback_entry_t* e) {
+  if (e->font.font) return true;
+  e->font = lf_asset_manager_request_font(s.ui, e->family, s.font.style.style, 
+                                          s.font.pixel_size);
+  if (!e->font.font) {
+    fprintf(stderr, "tyr: failed to load fallback font %s.\n", e->family);
+    e->status = FALLBACK_NONE;
+    return false;
+  }
+  // Along with the font, which is loaded outside of a frame if it can be
+  fontcoverage(e->font.font->face);
+  return true;
+}
+
+const lf_mapped_font_t* fallbackfont(uint32_t codepoint) {
+  if (!s.fallback.started && !fallbackinit()) return NULL;
+  fallback_entry_t* e = lookup(FALLBACK_BLOCK(codepoint), codepoint);
+  if (e->status == FALLBACK_PENDING) return NULL;
+  if (e->status == FALLBACK_FOUND && loadfont(e) && fonthas(e->font.font->face, codepoint))
+    return &e->font;
+  // The block has no font, its font failed to load or does not have this 
+  // one. The block was looked up for one of its codepoints, this one can
+  // still have a font of its own.
+  e = lookup(FALLBACK_CODEPOINT(codepoint), codepoint);
+  if (e->status == FALLBACK_FOUND && loadfont(e)) return &e->font;
+  return NULL;
+}
+
+bool fallbackpending(uint32_t codepoint) {
+  fallback_t* fb = &s.fallback;
+  fallback_entry_t* e = hmgetp_null(fb->table, FALLBACK_BLOCK(codepoint));
+  if (!e) return false;
+  if (e->status == FALLBACK_PENDING) return true;
+  e = hmgetp_null(fb->table, FALLBACK_CODEPOINT(codepoint));
+  return e && e->status == FALLBACK_PENDING;
+}
+
+// Moves finished lookups into the table, loading the fonts found
+static bool takeresults(bool load) {
+  fallback_t* fb = &s.fallback;
+  pthread_mutex_lock(&fb->lock);
+  fallback_entry_t* results = fb->results;
+  fb->results = NULL;
+  pthread_mutex_unlock(&fb->lock);
+  if (!arrlen(results)) return false;
+
+  for (ptrdiff_t i = 0; i < arrlen(results); i++) {
+    fallback_entry_t* e = hmgetp_null(fb->table, results[i].key);
+    e->status = results[i].status;
+    e->family = results[i].family;
+    if (load && e->status == FALLBACK_FOUND) loadfont(e);
+  }
+  arrfree(results);
+  fb->dirty = true;
+  return true;
+}
+
+bool fallbackpoll(void) {
+  fallback_t* fb = &s.fallback;
+  if (!fb->started) return false;
+  char dummy[64];
+  while (read(fb->notify_pipe[0], dummy, sizeof(dummy)) > 0);
+  // Fonts are loaded here rather than in the middle of the next frame
+  if (!takeresults(true)) return false;
+  // Text shaped with placeholders is shaped again
+  shapecacheclear();
+  s.fullrerender = true;
+  return true;
+}
+
+void fallbackshutdown(void) {
+  fallback_t* fb = &s.fallback;
+  if (!fb->started) return;
+  pthread_mutex_lock(&fb->lock);
+  fb->quit = true;
+  pthread_cond_signal(&fb->cond);
+  pthread_mutex_unlock(&fb->lock);
+  pthread_join(fb->thread, NULL);
+  takeresults(false);
+  if (fb->dirty) writecache();
+  close(fb->notify_pipe[0]);
+  close(fb->notify_pipe[1]);
+  for (ptrdiff_t i = 0; i < hmlen(fb->table); i++) 
+    free(fb->table[i].family);
+  hmfree(fb->table);
+  arrfree(fb->requests);
+  pthread_mutex_destroy(&fb->lock);
+  pthread_cond_destroy(&fb->cond);
+  fb->started = false;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "tyr.h"
+
+// Font to draw codepoint with when the terminal font does not have it.
+// NULL if no font has it or while it is still being looked up. The 
+// first call starts the lookup thread and reads the cache file.
+const lf_mapped_font_t* fallbackfont(uint32_t codepoint);
+
+// Whether codepoint waits for its fallback font to be looked up
+bool fallbackpending(uint32_t codepoint);
+
+// Takes the lookups the worker finished, returns true if there were any
+bool fallbackpoll(void);
+
+// Stops the worker and writes new lookups to the cache file
+void fallbackshutdown(void);
@@ -0,0 +1,468 @@
+#include "gridgl.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "render.h"
+#include "search.h"
+#include "style.h"
+#include "term.h"
+#include "../vendor/stb_ds.h"
+
+#define ATLAS_SIZE 2048
+
+// Cells are two words: the glyph slot, then the style id with flags
+// for search matches in the top bits
+#define CELL_STYLE_MASK 0xffffffu
+#define CELL_MATCH      (1u << 24)
+#define CELL_CURRENT    (1u << 25)
+
+// Styles are four words: fg, bg and underline color as 0xRRGGBB, then
+// the underline kind with these bits
+#define DECO_STRIKE   (1u << 8)
+#define DECO_OVERLINE (1u << 9)
+#define DECO_HIDDEN   (1u << 10)
+
+// Instances [0, cells) draw the backgrounds and decorations of the
+// cells, instances [cells, 2 * cells) their glyphs on top. A quad is
+// made of six vertices from gl_VertexID, there are no vertex buffers.
+// Quads with nothing to draw collapse to a point off screen, plain
+// backgrounds are left to glClear().
+static const char* vertexshader =
+  "#version 330 core\n"
+  "uniform usamplerBuffer cells;\n"
+  "uniform usamplerBuffer styles;\n"
+  "uniform isamplerBuffer glyphs;\n"
+  "uniform ivec2 grid;\n"
+  "uniform vec2 cellsize;\n"
+  "uniform float baseline;\n"
+  "uniform vec2 viewport;\n"
+  "uniform int cursor;\n"
+  "uniform uint background;\n"
+  "uniform vec3 cursorcolor, matchcolor, currentcolor;\n"
+  "flat out vec3 fg, bg, ul;\n"
+  "flat out uint deco;\n"
+  "flat out int glyphpass;\n"
+  "out vec2 local;\n"
+  "out vec2 uv;\n"
+  "const vec2 corners[6] = vec2[](vec2(0, 0), vec2(1, 0), vec2(0, 1),\n"
+  "                               vec2(1, 0), vec2(1, 1), vec2(0, 1));\n"
+  "vec3 rgb(uint c) {\n"
+  "  return vec3((c >> 16) & 0xffu, (c >> 8) & 0xffu, c & 0xffu) / 255.0;\n"
+  "}\n"
+  "void main() {\n"
+  "  int ncells = grid.x * grid.y;\n"
+  "  glyphpass = gl_InstanceID >= ncells ? 1 : 0;\n"
+  "  int c = gl_InstanceID - glyphpass * ncells;\n"
+  "  uvec2 cell = texelFetch(cells, c).rg;\n"
+  "  uvec4 st = texelFetch(styles, int(cell.y & 0xffffffu));\n"
+  "  fg = rgb(st.x);\n"
+  "  bg = rgb(st.y);\n"
+  "  ul = rgb(st.z);\n"
+  "  deco = st.w;\n"
+  "  bool plain = glyphpass == 0 ? st.y == background && (deco & 0x3ffu) == 0u &&\n"
+  "    (cell.y >> 24) == 0u && c != cursor : cell.x == 0u || (deco & 0x400u) != 0u;\n"
+  "  if (plain) {\n"
+  "    gl_Position = vec4(-2.0, -2.0, 0.0, 1.0);\n"
+  "    return;\n"
+  "  }\n"
+  "  if ((cell.y & (1u << 24)) != 0u) bg = matchcolor;\n"
+  "  if ((cell.y & (1u << 25)) != 0u) bg = currentcolor;\n"
+  "  if (c == cursor) bg = cursorcolor;\n"
+  "  vec2 corner = corners[gl_VertexID];\n"
+  "  vec2 origin = vec2(c % grid.x, c / grid.x) * cellsize;\n"
+  "  local = corner * cellsize;\n"
+  "  uv = vec2(0.0);\n"
+  "  vec2 pos = origin + local;\n"
+  "  if (glyphpass == 1) {\n"
+  "    ivec4 g = texelFetch(glyphs, int(cell.x));\n"
+  "    vec2 at = vec2(g.x & 0xffff, g.x >> 16);\n"
+  "    vec2 size = vec2(g.y & 0xffff, g.y >> 16);\n"
+  "    pos = origin + vec2(g.z, baseline - float(g.w)) + corner * size;\n"
+  "    uv = at + corner * size;\n"
+  "  }\n"
+  "  gl_Position = vec4(pos.x / viewport.x * 2.0 - 1.0, 1.0 - pos.y / viewport.y * 2.0, 0.0, 1.0);\n"
+  "}\n";
+
+// Decorations are drawn like renderdecorations() does
+static const char* fragmentshader =
+  "#version 330 core\n"
+  "uniform sampler2D atlas;\n"
+  "uniform vec2 cellsize;\n"
+  "uniform float baseline;\n"
+  "flat in vec3 fg, bg, ul;\n"
+  "flat in uint deco;\n"
+  "flat in int glyphpass;\n"
+  "in vec2 local;\n"
+  "in vec2 uv;\n"
+  "out vec4 color;\n"
+  "void main() {\n"
+  "  if (glyphpass == 1) {\n"
+  "    color = vec4(fg, texelFetch(atlas, ivec2(uv), 0).r);\n"
+  "    return;\n"
+  "  }\n"
+  "  float thick = max(floor(cellsize.y / 16.0), 1.0);\n"
+  "  float y = floor(local.y);\n"
+  "  uint underline = deco & 0xffu;\n"
+  "  vec3 c = bg;\n"
+  "  if (underline != 0u && (y >= baseline + thick && y < baseline + 2.0 * thick ||\n"
+  "      underline == 2u && y >= baseline + 3.0 * thick && y < baseline + 4.0 * thick))\n"
+  "    c = ul;\n"
+  "  float middle = floor(cellsize.y / 2.0);\n"
+  "  if ((deco & 0x100u) != 0u && y >= middle && y < middle + thick) c = fg;\n"
+  "  if ((deco & 0x200u) != 0u && y < thick) c = fg;\n"
+  "  color = vec4(c, 1.0);\n"
+  "}\n";
+
+typedef struct {
+  uint32_t key;   // codepoint
+  uint32_t value; // glyph slot, 0 if nothing is drawn for it
+} glyph_slot_t;
+
+static struct {
+  bool ready;
+  FT_Face face;
+  int32_t cw, ch, baseline;
+  GLuint program, vao;
+  GLint ugrid, ucellsize, ubaseline, uviewport, ucursor;
+
+  // Cells of the view, row after row
+  GLuint cellbuf, celltex;
+  int32_t cols, rows;
+  uint32_t* row; // one row of cells being put together
+
+  // Resolved colors of styles, uploaded as new ones show up
+  GLuint stylebuf, styletex;
+  uint32_t nstyles, stylecap;
+
+  // Glyphs packed into shelves of the atlas. Slot 0 is no glyph.
+  GLuint atlas;
+  int32_t shelfx, shelfy, shelfh;
+  int32_t* slots;        // stb_ds array, four words per slot
+  uint32_t uploadedslots, slotcap;
+  GLuint glyphbuf, glyphtex;
+  glyph_slot_t* bycodepoint; // stb_ds hash map
+  uint32_t notdef;           // slot of the missing glyph box
+  bool full;                 // the atlas ran out of space this frame
+
+  size_t uploaded;
+} g;
+
+static GLuint compile(GLenum type, const char* src) {
+  GLuint sh = glCreateShader(type);
+  glShaderSource(sh, 1, &src, NULL);
+  glCompileShader(sh);
+  GLint ok;
+  glGetShaderiv(sh, GL_COMPILE_STATUS, &ok);
+  if (!ok) {
+    char log[1024];
+    glGetShaderInfoLog(sh, sizeof(log), NULL, log);
+    fprintf(stderr, "tyr: grid shader: %s\n", log);
+    glDeleteShader(sh);
+    return 0;
+  }
+  return sh;
+}
+
+static GLuint texbuffer(GLuint* buf, GLenum format) {
+  GLuint tex;
+  glGenBuffers(1, buf);
+  glBindBuffer(GL_TEXTURE_BUFFER, *buf);
+  glBufferData(GL_TEXTURE_BUFFER, 16, NULL, GL_DYNAMIC_DRAW);
+  glGenTextures(1, &tex);
+  glBindTexture(GL_TEXTURE_BUFFER, tex);
+  glTexBuffer(GL_TEXTURE_BUFFER, format, *buf);
+  return tex;
+}
+
+// Empties the atlas, every glyph is rasterized again when next drawn
+static void resetatlas(void) {
+  arrsetlen(g.slots, 0);
+  for (uint32_t i = 0; i < 4; i++) arrput(g.slots, 0);
+  g.uploadedslots = g.slotcap = 0;
+  hmfree(g.bycodepoint);
+  g.notdef = 0;
+  g.shelfx = g.shelfy = g.shelfh = 0;
+  g.full = false;
+}
+
+// Rasterizes glyph gid of face into the atlas. Returns its slot, 0 if
+// it is empty or does not fit.
+static uint32_t rasterize(FT_Face face, uint32_t gid) {
+  if (FT_Load_Glyph(face, gid, FT_LOAD_RENDER | FT_LOAD_COLOR) != 0) return 0;
+  FT_GlyphSlot gs = face->glyph;
+  const FT_Bitmap* bm = &gs->bitmap;
+  if (!bm->width || !bm->rows) return 0;
+  if (g.shelfx + (int32_t)bm->width > ATLAS_SIZE) {
+    g.shelfy += g.shelfh;
+    g.shelfx = g.shelfh = 0;
+  }
+  if (g.shelfy + (int32_t)bm->rows > ATLAS_SIZE || bm->width > ATLAS_SIZE) {
+    g.full = true;
+    return 0;
+  }
+  uint8_t* alpha = malloc((size_t)bm->width * bm->rows);
+  glyphalpha(bm, alpha);
+  glBindTexture(GL_TEXTURE_2D, g.atlas);
+  glTexSubImage2D(GL_TEXTURE_2D, 0, g.shelfx, g.shelfy, bm->width, bm->rows,
+                  GL_RED, GL_UNSIGNED_BYTE, alpha);
+  free(alpha);
+  g.uploaded += (size_t)bm->width * bm->rows;
+
+  uint32_t slot = arrlen(g.slots) / 4;
+  arrput(g.slots, g.shelfx | g.shelfy << 16);
+  arrput(g.slots, (int32_t)(bm->width | bm->rows << 16));
+  arrput(g.slots, gs->bitmap_left);
+  arrput(g.slots, gs->bitmap_top);
+  g.shelfx += bm->width + 1;
+  g.shelfh = MAX(g.shelfh, (int32_t)bm->rows + 1);
+  return slot;
+}
+
+// Slot of the glyph drawn for codepoint, from the terminal font or its
+// fallback
+static uint32_t glyphslot(uint32_t cp) {
+  if (cp <= ' ') return 0;
+  ptrdiff_t i = hmgeti(g.bycodepoint, cp);
+  if (i >= 0) return g.bycodepoint[i].value;
+  bool pending;
+  FT_Face face = glyphface(g.face, cp, &pending);
+  // The missing glyph box stands in until the fallback is known
+  if (pending) {
+    if (!g.notdef) g.notdef = rasterize(g.face, 0);
+    return g.notdef;
+  }
+  uint32_t slot = face ? rasterize(face, FT_Get_Char_Index(face, cp)) : 0;
+  if (!g.full) hmput(g.bycodepoint, cp, slot);
+  return slot;
+}
+
+// Uploads what was added to an array that a texture buffer shows,
+// growing the buffer to twice the size if it is full
+static void uploadtail(GLuint buf, const void* data, size_t stride,
+                       uint32_t* uploaded, uint32_t* cap, uint32_t count) {
+  if (count == *uploaded) return;
+  glBindBuffer(GL_TEXTURE_BUFFER, buf);
+  if (count > *cap) {
+    *cap = MAX(count, *cap * 2);
+    glBufferData(GL_TEXTURE_BUFFER, *cap * stride, NULL, GL_DYNAMIC_DRAW);
+    *uploaded = 0;
+  }
+  glBufferSubData(GL_TEXTURE_BUFFER, *uploaded * stride, (count - *uploaded) * stride,
+                  (const char*)data + *uploaded * stride);
+  g.uploaded += (count - *uploaded) * stride;
+  *uploaded = count;
+}
+
+static void uploadstyles(void) {
+  uint32_t n = arrlenu(s.styles.items);
+  // The table was reset, ids mean other styles now
+  if (n < g.nstyles) g.nstyles = 0;
+  if (n == g.nstyles) return;
+  uint32_t first = g.nstyles;
+  uint32_t* words = malloc((size_t)(n - first) * 16);
+  for (uint32_t id = first; id < n; id++) {
+    const style_t* st = getstyle(id);
+    run_colors_t c = stylecolors(st);
+    uint32_t* w = &words[(id - first) * 4];
+    w[0] = c.fg;
+    w[1] = c.bg;
+    w[2] = c.ul;
+    w[3] = st->underline | (st->attrs & FONT_STRIKETHROUGH ? DECO_STRIKE : 0) |
+      (st->attrs & FONT_OVERLINED ? DECO_OVERLINE : 0) | (c.hidden ? DECO_HIDDEN : 0);
+  }
+  glBindBuffer(GL_TEXTURE_BUFFER, g.stylebuf);
+  if (n > g.stylecap) {
+    // Grown to twice the size, everything goes up again
+    g.stylecap = MAX(n, g.stylecap * 2);
+    glBufferData(GL_TEXTURE_BUFFER, (size_t)g.stylecap * 16, NULL, GL_DYNAMIC_DRAW);
+    free(words);
+    g.nstyles = 0;
+    uploadstyles();
+    return;
+  }
+  glBufferSubData(GL_TEXTURE_BUFFER, (size_t)first * 16, (size_t)(n - first) * 16, words);
+  g.uploaded += (size_t)(n - first) * 16;
+  g.nstyles = n;
+  free(words);
+}
+
+static void uploadrow(int32_t y) {
+  const cell_t* cells = getviewrow(y);
+  for (int32_t x = 0; x < s.cols; x++) {
+    g.row[x * 2] = cells[x].widedummy ? 0 : glyphslot(cells[x].codepoint);
+    g.row[x * 2 + 1] = cells[x].style & CELL_STYLE_MASK;
+  }
+  search_match_t matches[64];
+  size_t n = searchlinematches(searchlineofrow(y), matches, 64);
+  for (size_t i = 0; i < n; i++) {
+    uint32_t flag = matches[i].line == s.search.current ? CELL_CURRENT : CELL_MATCH;
+    for (int32_t x = matches[i].col; x < MIN(matches[i].col + matches[i].len, s.cols); x++)
+      g.row[x * 2 + 1] |= flag;
+  }
+  glBufferSubData(GL_TEXTURE_BUFFER, (size_t)y * s.cols * 8, (size_t)s.cols * 8, g.row);
+  g.uploaded += (size_t)s.cols * 8;
+}
+
+// The search prompt takes the place of the last row while typing
+static void uploadprompt(int32_t y) {
+  char prompt[SEARCH_QUERY_SIZE * 2];
+  searchprompt(prompt, sizeof(prompt));
+  size_t len = strlen(prompt);
+  uint32_t cps[len + 1];
+  utf8_decoder_t dec;
+  utf8reset(&dec);
+  size_t n = utf8decodechunk(&dec, (const uint8_t*)prompt, len, cps);
+  memset(g.row, 0, (size_t)s.cols * 8);
+  for (int32_t x = 0; x < s.cols && (size_t)x < n; x++) 
+    g.row[x * 2] = glyphslot(cps[x]);
+  glBufferSubData(GL_TEXTURE_BUFFER, (size_t)y * s.cols * 8, (size_t)s.cols * 8, g.row);
+  g.uploaded += (size_t)s.cols * 8;
+}
+
+static void uploadrows(bool all) {
+  glBindBuffer(GL_TEXTURE_BUFFER, g.cellbuf);
+  for (int32_t y = 0; y < s.rows; y++) {
+    damage_t d = s.damage[y];
+    if (!all && d.maxcol < d.mincol) continue;
+    setdirty(y, false);
+    if (s.search.editing && y == s.rows - 1)
+      uploadprompt(y);
+    else
+      uploadrow(y);
+  }
+}
+
+bool gridglinit(FT_Face face) {
+  GLuint vs = compile(GL_VERTEX_SHADER, vertexshader);
+  GLuint fs = compile(GL_FRAGMENT_SHADER, fragmentshader);
+  if (!vs || !fs) return false;
+  g.program = glCreateProgram();
+  glAttachShader(g.program, vs);
+  glAttachShader(g.program, fs);
+  glLinkProgram(g.program);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+  GLint ok;
+  glGetProgramiv(g.program, GL_LINK_STATUS, &ok);
+  if (!ok) {
+    fprintf(stderr, "tyr: grid shaders do not link.\n");
+    glDeleteProgram(g.program);
+    return false;
+  }
+
+  g.face = face;
+  g.cw = face->size->metrics.max_advance >> 6;
+  g.ch = face->size->metrics.height >> 6;
+  // Where runara puts the baseline too
+  g.baseline = face->size->metrics.y_ppem;
+
+  glGenVertexArrays(1, &g.vao);
+  g.celltex = texbuffer(&g.cellbuf, GL_RG32UI);
+  g.styletex = texbuffer(&g.stylebuf, GL_RGBA32UI);
+  g.glyphtex = texbuffer(&g.glyphbuf, GL_RGBA32I);
+  glGenTextures(1, &g.atlas);
+  glBindTexture(GL_TEXTURE_2D, g.atlas);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, ATLAS_SIZE, ATLAS_SIZE, 0, GL_RED, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+  glUseProgram(g.program);
+  glUniform1i(glGetUniformLocation(g.program, "atlas"), 0);
+  glUniform1i(glGetUniformLocation(g.program, "cells"), 1);
+  glUniform1i(glGetUniformLocation(g.program, "styles"), 2);
+  glUniform1i(glGetUniformLocation(g.program, "glyphs"), 3);
+  glUniform1ui(glGetUniformLocation(g.program, "background"), TERM_BACKGROUND);
+  RnColor colors[3] = { RN_WHITE, SEARCH_MATCH_COLOR, SEARCH_CURRENT_COLOR };
+  const char* names[3] = { "cursorcolor", "matchcolor", "currentcolor" };
+  for (uint32_t i = 0; i < 3; i++)
+    glUniform3f(glGetUniformLocation(g.program, names[i]),
+                colors[i].r / 255.0f, colors[i].g / 255.0f, colors[i].b / 255.0f);
+  g.ugrid = glGetUniformLocation(g.program, "grid");
+  g.ucellsize = glGetUniformLocation(g.program, "cellsize");
+  g.ubaseline = glGetUniformLocation(g.program, "baseline");
+  g.uviewport = glGetUniformLocation(g.program, "viewport");
+  g.ucursor = glGetUniformLocation(g.program, "cursor");
+  glUseProgram(0);
+
+  resetatlas();
+  g.nstyles = g.stylecap = 0;
+  g.cols = g.rows = 0;
+  g.ready = true;
+  return true;
+}
+
+void gridglframe(int32_t width, int32_t height) {
+  if (!g.ready || !s.rows || !s.cols) return;
+  bool all = s.fullrerender;
+  if (g.cols != s.cols || g.rows != s.rows) {
+    g.cols = s.cols;
+    g.rows = s.rows;
+    free(g.row);
+    g.row = malloc((size_t)s.cols * 8);
+    glBindBuffer(GL_TEXTURE_BUFFER, g.cellbuf);
+    glBufferData(GL_TEXTURE_BUFFER, (size_t)s.cols * s.rows * 8, NULL, GL_DYNAMIC_DRAW);
+    all = true;
+  }
+  uploadstyles();
+  uploadrows(all);
+  if (g.full) {
+    // Rows that are up already point at glyphs of the old atlas
+    resetatlas();
+    uploadrows(true);
+  }
+  s.fullrerender = false;
+  uint32_t nslots = arrlenu(g.slots) / 4;
+  uploadtail(g.glyphbuf, g.slots, 16, &g.uploadedslots, &g.slotcap, nslots);
+
+  // Past the last column and row is background
+  glViewport(0, 0, width, height);
+  glClearColor((TERM_BACKGROUND >> 16) / 255.0f, ((TERM_BACKGROUND >> 8) & 0xff) / 255.0f,
+               (TERM_BACKGROUND & 0xff) / 255.0f, 1.0f);
+  glClear(GL_COLOR_BUFFER_BIT);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glUseProgram(g.program);
+  glBindVertexArray(g.vao);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, g.atlas);
+  GLuint texs[3] = { g.celltex, g.styletex, g.glyphtex };
+  for (uint32_t i = 0; i < 3; i++) {
+    glActiveTexture(GL_TEXTURE1 + i);
+    glBindTexture(GL_TEXTURE_BUFFER, texs[i]);
+  }
+  glActiveTexture(GL_TEXTURE0);
+  glUniform2i(g.ugrid, s.cols, s.rows);
+  glUniform2f(g.ucellsize, g.cw, g.ch);
+  glUniform1f(g.ubaseline, g.baseline);
+  glUniform2f(g.uviewport, width, height);
+  int32_t cursorrow = s.cursor.y + s.viewoffset;
+  glUniform1i(g.ucursor, cursorrow >= 0 && cursorrow < s.rows ? cursorrow * s.cols + s.cursor.x : -1);
+  glDrawArraysInstanced(GL_TRIANGLES, 0, 6, 2 * s.cols * s.rows);
+  glBindVertexArray(0);
+  glUseProgram(0);
+}
+
+size_t gridgluploaded(void) {
+  return g.uploaded;
+}
+
+void gridglshutdown(void) {
+  if (!g.ready) return;
+  GLuint bufs[3] = { g.cellbuf, g.stylebuf, g.glyphbuf };
+  GLuint texs[4] = { g.celltex, g.styletex, g.glyphtex, g.atlas };
+  glDeleteBuffers(3, bufs);
+  glDeleteTextures(4, texs);
+  glDeleteVertexArrays(1, &g.vao);
+  glDeleteProgram(g.program);
+  arrfree(g.slots);
+  hmfree(g.bycodepoint);
+  free(g.row);
+  memset(&g, 0, sizeof(g));
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tyr.h"
+
+// Draws the screen with one instanced draw call instead of a call per 
+// glyph. The cells live in a buffer on the GPU and only rows that 
+// changed are uploaded, glyphs are rasterized once into an atlas. 
+// Needs an OpenGL 3.3 context to be current.
+
+// Sets up to draw glyphs of face at its current pixel size. Returns 
+// false if the context cannot do it.
+bool gridglinit(FT_Face face);
+
+// Uploads the damaged rows and draws the screen into the bound 
+// framebuffer of width x height pixels
+void gridglframe(int32_t width, int32_t height);
+
+// Bytes of cells, styles and glyphs uploaded so far
+size_t gridgluploaded(void);
+
+void gridglshutdown(void);
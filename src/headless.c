@@ -0,0 +1,862 @@
+#include "headless.h"
+
+#define GL_GLEXT_PROTOTYPES
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <GL/gl.h>
+#include <GL/glext.h>
+#include <errno.h>
+#include <fontconfig/fontconfig.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tyr.h"
+#include "term.h"
+#include "parser.h"
+#include "config.h"
+#include "coverage.h"
+#include "gridgl.h"
+#include "record.h"
+#include "scrollback.h"
+#include "search.h"
+#include "soft.h"
+#include "style.h"
+#include "../vendor/stb_ds.h"
+
+#ifdef TYR_ALLOC_COUNT
+// Calls to the allocator from tyr's own code. Only the bench build of 
+// the Makefile defines TYR_ALLOC_COUNT and links with --wrap for each
+// of them.
+static atomic_size_t allocations;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void* __real_aligned_alloc(size_t alignment, size_t size);
+
+void* __wrap_malloc(size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* ptr, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __real_realloc(ptr, size);
+}
+
+void* __wrap_aligned_alloc(size_t alignment, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __real_aligned_alloc(alignment, size);
+}
+#endif
+
+static char* readfile(const char* path, size_t* len) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return NULL;
+  }
+  char* buf = NULL;
+  size_t cap = 0;
+  *len = 0;
+  while (true) {
+    if (*len == cap) {
+      cap = cap ? cap * 2 : BUF_SIZE;
+      buf = realloc(buf, cap);
+    }
+    size_t n = fread(buf + *len, 1, cap - *len, f);
+    if (n == 0) break;
+    *len += n;
+  }
+  if (ferror(f)) {
+    perror(path);
+    free(buf);
+    buf = NULL;
+  }
+  fclose(f);
+  return buf;
+}
+
+// Feeds the stream in the same chunk size the pty reader produces
+static void replayraw(const char* buf, size_t len) {
+  for (size_t off = 0; off < len; off += BUF_SIZE)
+    termparse(buf + off, MIN(len - off, (size_t)BUF_SIZE));
+}
+
+// Plays back pty output and resizes. Input went to the shell, whose 
+// answer is already part of the output. Returns the bytes of frames
+// the recording left out.
+static uint64_t replaysession(const char* buf, size_t len, size_t off, bool realtime) {
+  uint64_t lost = 0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  record_frame_t frame;
+  const char* data;
+  while ((data = nextframe(buf, len, &off, &frame))) {
+    if (realtime) {
+      struct timespec due = {
+        .tv_sec = start.tv_sec + frame.time / 1000000000ULL,
+        .tv_nsec = start.tv_nsec + frame.time % 1000000000ULL,
+      };
+      if (due.tv_nsec >= 1000000000L) {
+        due.tv_sec++;
+        due.tv_nsec -= 1000000000L;
+      }
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR);
+    }
+    switch (frame.kind) {
+      case RECORD_OUTPUT:
+        termparse(data, frame.len);
+        break;
+      case RECORD_DROPPED: {
+        uint64_t bytes = 0;
+        memcpy(&bytes, data, MIN(frame.len, sizeof(bytes)));
+        lost += bytes;
+        break;
+      }
+      case RECORD_RESIZE: {
+        if (frame.len < 2 * sizeof(uint32_t)) break;
+        uint32_t size[2];
+        memcpy(size, data, sizeof(size));
+        resizeterm(size[0], size[1], 1, 1);
+        break;
+      }
+      default:
+        break;
+    }
+  }
+  if (off != len)
+    fprintf(stderr, "tyr: recording is truncated after %zu bytes.\n", off);
+  return lost;
+}
+
+// FNV-1a over what is visible: codepoints, colors and font styles
+static uint64_t screenhash(void) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int32_t y = 0; y < s.rows; y++) {
+    cell_t* row = getphysrow(y);
+    for (int32_t x = 0; x < s.cols; x++) {
+      const style_t* st = getstyle(row[x].style);
+      uint32_t v[4] = { 
+        row[x].codepoint, st->fg, st->bg, st->attrs | st->underline << 16 
+      };
+      const uint8_t* p = (const uint8_t*)v;
+      for (size_t i = 0; i < sizeof(v); i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+      }
+    }
+  }
+  h ^= (uint64_t)s.cursor.y << 32 | (uint32_t)s.cursor.x;
+  return h;
+}
+
+// Passes if no hash is expected
+static bool checkhash(const char* what, uint64_t hash, uint64_t expect) {
+  if (!expect || hash == expect) return true;
+  fprintf(stderr, "tyr: %s %016llx, expected %016llx.\n", what, 
+          (unsigned long long)hash, (unsigned long long)expect);
+  return false;
+}
+
+// Puts the terminal back into its startup state between passes
+static void resetterm(void) {
+  if (s.cols != HEADLESS_COLS || s.rows != HEADLESS_ROWS)
+    resizeterm(HEADLESS_COLS, HEADLESS_ROWS, 1, 1);
+  if (s.termmode & TERM_MODE_ALTSCREEN) togglealtscreen();
+  s.grid.head = s.altgrid.head = 0;
+  for (int32_t y = 0; y < s.rows; y++) {
+    for (int32_t x = 0; x < s.cols; x++)
+      s.grid.lines[y][x] = s.altgrid.lines[y][x] = (cell_t){ .codepoint = ' ' };
+  }
+  s.grid.histlen = s.altgrid.histlen = 0;
+  s.viewoffset = 0;
+  scrollbackclear();
+  stylereset();
+  s.cursor = s.altcursor = s.saved_cursor = (cursor_t){0};
+  s.cursorstate = CURSOR_STATE_NORMAL;
+  s.termmode = 0;
+  s.charset = CHARSET_ASCII;
+  s.parserstate = PARSER_STATE_GROUND;
+  s.recentcodepoint = 0;
+  s.scrolltop = s.saved_scrolltop = 0;
+  s.scrollbottom = s.saved_scrollbottom = s.rows - 1;
+  memset(&s.csiseq, 0, sizeof(s.csiseq));
+  utf8reset(&s.utf8);
+}
+
+static void searchhistory(const char* pattern, bool regex) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  searchstart(pattern, regex);
+  while (s.search.active && !s.search.done) {
+    struct pollfd pfd = { .fd = s.search.notify_pipe[0], .events = POLLIN };
+    poll(&pfd, 1, -1);
+    searchpoll();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double ms = (end.tv_sec - start.tv_sec) * 1E3 + (end.tv_nsec - start.tv_nsec) / 1E6;
+  printf("  search: %zu matches for \"%s\" in %.2f ms\n", searchcount(), pattern, ms);
+  searchshutdown();
+}
+
+int headlessreplay(const char* path, bool realtime, const char* search, bool regex, 
+                   uint64_t expect) {
+  size_t len;
+  char* buf = readfile(path, &len);
+  if (!buf) return 1;
+  if (!len) {
+    fprintf(stderr, "tyr: %s is empty.\n", path);
+    free(buf);
+    return 1;
+  }
+
+  size_t sessionoff = 0;
+  bool session = isrecording(buf, len, &sessionoff);
+  if (realtime && !session) {
+    fprintf(stderr, "tyr: %s has no timestamps, it was not made with --record.\n", path);
+    free(buf);
+    return 1;
+  }
+
+  // The first pass produces the screen that is hashed, the others only
+  // make short recordings long enough to time.
+  resizeterm(HEADLESS_COLS, HEADLESS_ROWS, 1, 1);
+
+  struct timespec start, end;
+  uint64_t hash = 0, lost = 0;
+  size_t passes = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    resetterm();
+    if (session)
+      lost = replaysession(buf, len, sessionoff, realtime);
+    else
+      replayraw(buf, len);
+    if (!passes++) hash = screenhash();
+  } while (!realtime && passes * len < HEADLESS_MIN_BYTES);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1E9;
+  double bytes = (double)passes * len;
+  printf("%s: %zu bytes x %zu, %.1f MB/s, %.2f ns/byte, screen %016llx\n",
+         path, len, passes, bytes / secs / 1E6, secs * 1E9 / bytes, 
+         (unsigned long long)hash);
+  // Every pass leaves the same history behind
+  size_t coldlines = scrollbacklines();
+  printf("  history: %d hot lines at %zu bytes/line, %zu compact lines at %.1f bytes/line, "
+         "%.1f MiB spilled to disk\n",
+         s.grid.histlen, s.cols * sizeof(cell_t), coldlines, 
+         coldlines ? (double)(scrollbackmemory() + scrollbackspilled()) / coldlines : 0.0,
+         scrollbackspilled() / (double)(1 << 20));
+  if (lost)
+    fprintf(stderr, "tyr: the recording lost %llu bytes, the screen may differ from the session.\n",
+            (unsigned long long)lost);
+  if (search)
+    searchhistory(search, regex);
+
+  free(buf);
+  return checkhash("screen", hash, expect) ? 0 : 1;
+}
+
+int headlessresizes(int32_t count) {
+  static const int32_t sizes[][2] = { 
+    { 80, 24 }, { HEADLESS_COLS, HEADLESS_ROWS }, { 132, 43 }, { 37, 9 },
+  };
+  const int32_t nsizes = sizeof(sizes) / sizeof(sizes[0]);
+  resizeterm(HEADLESS_COLS, HEADLESS_ROWS, 1, 1);
+  resetterm();
+  // Short lines and ones that wrap at every size
+  char line[512];
+  termparse("\033[?7h", 5);
+  for (int32_t y = 0; y < HEADLESS_ROWS / 2; y++) {
+    int32_t n = snprintf(line, sizeof(line), "line %d ", y);
+    for (int32_t x = 0; x < (y % 3) * 60 && n < (int32_t)sizeof(line) - 3; x++) 
+      line[n++] = 'a' + x % 26;
+    line[n++] = '\r';
+    line[n++] = '\n';
+    termparse(line, n);
+  }
+
+  // Going through the sizes twice leaves both halves of the arena at 
+  // the largest one
+  for (int32_t i = 0; i < 2 * nsizes; i++) 
+    resizeterm(sizes[i % nsizes][0], sizes[i % nsizes][1], 1, 1);
+
+  struct timespec start, end;
+#ifdef TYR_ALLOC_COUNT
+  size_t calls = atomic_load(&allocations);
+#endif
+  uint32_t grows = s.arena.grows;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int32_t i = 0; i < count; i++) 
+    resizeterm(sizes[i % nsizes][0], sizes[i % nsizes][1], 1, 1);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  grows = s.arena.grows - grows;
+
+  double us = ((end.tv_sec - start.tv_sec) * 1E6 + (end.tv_nsec - start.tv_nsec) / 1E3) / count;
+#ifdef TYR_ALLOC_COUNT
+  calls = atomic_load(&allocations) - calls;
+  printf("resize: %d resizes, %.2f us/resize, %u arena allocations, %zu allocator calls\n",
+         count, us, grows, calls);
+  return grows || calls ? 1 : 0;
+#else
+  printf("resize: %d resizes, %.2f us/resize, %u arena allocations, "
+         "allocator calls are only counted by make bench\n", count, us, grows);
+  return grows ? 1 : 0;
+#endif
+}
+
+// Codepoints in the proportions of text that mixes scripts: mostly 
+// ASCII, some Latin, Greek, Cyrillic and box drawing, CJK, Hangul and
+// emoji. Always the same ones.
+static void mixedscript(uint32_t* cps, size_t n) {
+  static const struct { uint32_t first, last, weight; } scripts[] = {
+    { 0x20, 0x7e, 50 }, { 0xa0, 0x24f, 8 }, { 0x370, 0x3ff, 4 }, { 0x400, 0x4ff, 6 },
+    { 0x2500, 0x257f, 6 }, { 0x4e00, 0x9fff, 12 }, { 0xac00, 0xd7a3, 6 },
+    { 0x1f300, 0x1f64f, 6 }, { 0x1d400, 0x1d7ff, 2 },
+  };
+  const uint32_t nscripts = sizeof(scripts) / sizeof(scripts[0]);
+  uint32_t total = 0;
+  for (uint32_t i = 0; i < nscripts; i++) total += scripts[i].weight;
+  uint64_t x = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = 0; i < n; i++) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    uint32_t r = (x >> 33) % total, k = 0;
+    while (r >= scripts[k].weight) r -= scripts[k++].weight;
+    cps[i] = scripts[k].first + (x >> 13) % (scripts[k].last - scripts[k].first + 1);
+  }
+}
+
+static double elapsedns(struct timespec start, struct timespec end) {
+  return (end.tv_sec - start.tv_sec) * 1E9 + (end.tv_nsec - start.tv_nsec);
+}
+
+static uint64_t nextrand(uint64_t* x) {
+  *x = *x * 6364136223846793005ULL + 1442695040888963407ULL;
+  return *x >> 33;
+}
+
+// Random terminal output: bytes of any value, pieces of escape 
+// sequences, parameters, controls and UTF-8 sequences that may be cut
+// short. Returns the number of bytes written, at most size.
+static size_t fuzzbytes(uint64_t* x, uint8_t* buf, size_t size) {
+  static const char* pieces[] = {
+    "\033[", "\033]", "\033[?", "\033P", "\033(0", "\033(B", "\033\\", "\033",
+    "\a", "\b", "\t", "\r", "\n", "\r\n", ";", ":", "?", "m", "H", "J", "K",
+    "r", "h", "l", "A", "B", "C", "D", "L", "M", "P", "S", "T", "X", "@", "d",
+    "G", "n", "c", "s", "u", "q", "t", "\033[?1049h", "\033[?1049l", "\033[?7l",
+    "\033[?7h", "\033[?6h", "\033]0;", "\033]52;c;", "\033[38;2;", "\033[48;5;",
+  };
+  const size_t npieces = sizeof(pieces) / sizeof(pieces[0]);
+  size_t n = 0;
+  while (n + 16 <= size) {
+    uint32_t r = nextrand(x);
+    switch (r % 7) {
+      case 0:
+        buf[n++] = r >> 8;
+        break;
+      case 1: {
+        const char* p = pieces[(r >> 8) % npieces];
+        size_t len = strlen(p);
+        memcpy(buf + n, p, len);
+        n += len;
+        break;
+      }
+      case 2:
+        n += snprintf((char*)buf + n, 8, "%u", (r >> 8) % ((r & 8) ? 10000 : 10));
+        break;
+      case 3:
+      case 4: {
+        // A scalar value of any length, sometimes missing its last byte
+        uint32_t cp = nextrand(x) % 0x110000;
+        if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD;
+        int32_t len = utf8encode(cp, (char*)buf + n);
+        n += len > 1 && (r & 0x300) == 0 ? len - 1 : len;
+        break;
+      }
+      case 5:
+        // A run of scalar values long enough for the vector decoder,
+        // with one byte of it replaced now and then
+        for (uint32_t i = 0, len = 4 + (r >> 8) % 40; i < len && n + 16 <= size; i++) {
+          uint32_t limit = (uint32_t[]){ 0x80, 0x800, 0x10000, 0x110000 }[nextrand(x) % 4];
+          uint32_t cp = nextrand(x) % limit;
+          if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD;
+          n += utf8encode(cp, (char*)buf + n);
+          if (nextrand(x) % 64 == 0) buf[n - 1] = nextrand(x);
+        }
+        break;
+      default:
+        for (uint32_t i = 0, len = (r >> 8) % 12; i < len; i++)
+          buf[n++] = ' ' + nextrand(x) % 95;
+        break;
+    }
+  }
+  return n;
+}
+
+static bool validcodepoints(const uint32_t* cps, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    if (cps[i] > 0x10FFFF || (cps[i] >= 0xD800 && cps[i] <= 0xDFFF)) return false;
+  return true;
+}
+
+static bool samedecoder(const utf8_decoder_t* a, const utf8_decoder_t* b) {
+  return a->codepoint == b->codepoint && a->needed == b->needed && 
+    a->seen == b->seen && a->lower == b->lower && a->upper == b->upper;
+}
+
+// Decodes buf at once, with the state machine alone, in random pieces
+// and byte by byte, which never takes the fast paths. All four have to
+// agree.
+static bool fuzzdecoder(uint64_t* x, const uint8_t* buf, size_t len, uint32_t* out) {
+  utf8_decoder_t whole, scalar, split, bytes;
+  utf8reset(&whole);
+  utf8reset(&scalar);
+  utf8reset(&split);
+  utf8reset(&bytes);
+  uint32_t* ref = out, *plain = out + len + 1, *pieces = plain + len + 1;
+  uint32_t* single = pieces + len + 1;
+  size_t nwhole = utf8decodechunk(&whole, buf, len, ref);
+  if (nwhole > len + 1 || !validcodepoints(ref, nwhole)) return false;
+  size_t nplain = utf8decodescalar(&scalar, buf, len, plain);
+
+  size_t nsplit = 0;
+  for (size_t off = 0; off < len;) {
+    size_t n = 1 + nextrand(x) % 8;
+    n = MIN(n, len - off);
+    size_t got = utf8decodechunk(&split, buf + off, n, pieces + nsplit);
+    if (got > n + 1) return false;
+    nsplit += got;
+    off += n;
+  }
+  size_t nsingle = 0;
+  for (size_t i = 0; i < len; i++)
+    nsingle += utf8decodechunk(&bytes, buf + i, 1, single + nsingle);
+
+  return nplain == nwhole && nsplit == nwhole && nsingle == nwhole &&
+    !memcmp(ref, plain, nwhole * sizeof(*ref)) &&
+    !memcmp(ref, pieces, nwhole * sizeof(*ref)) &&
+    !memcmp(ref, single, nwhole * sizeof(*ref)) &&
+    samedecoder(&whole, &scalar) && samedecoder(&whole, &split) &&
+    samedecoder(&whole, &bytes);
+}
+
+// Random scalar values have to come back out of the decoder unchanged
+static bool fuzzroundtrip(uint64_t* x, uint32_t* cps, size_t n, uint32_t* out) {
+  uint8_t buf[n * UTF_SIZE];
+  size_t len = 0;
+  for (size_t i = 0; i < n; i++) {
+    // Weighted towards shorter encodings, as text is
+    uint32_t limit = (uint32_t[]){ 0x80, 0x800, 0x10000, 0x110000 }[nextrand(x) % 4];
+    do cps[i] = nextrand(x) % limit; while (cps[i] >= 0xD800 && cps[i] <= 0xDFFF);
+    len += utf8encode(cps[i], (char*)buf + len);
+  }
+  utf8_decoder_t dec;
+  utf8reset(&dec);
+  return utf8decodechunk(&dec, buf, len, out) == n && dec.needed == 0 &&
+    !memcmp(cps, out, n * sizeof(*cps));
+}
+
+static const char* checkscreen(void) {
+  if (s.cursor.x < 0 || s.cursor.x >= s.cols || s.cursor.y < 0 || s.cursor.y >= s.rows)
+    return "cursor outside the screen";
+  if (s.scrolltop < 0 || s.scrolltop > s.scrollbottom || s.scrollbottom >= s.rows)
+    return "scroll region outside the screen";
+  for (int32_t y = 0; y < s.rows; y++) {
+    cell_t* row = getphysrow(y);
+    for (int32_t x = 0; x < s.cols; x++)
+      if (!validcodepoints(&(uint32_t){ row[x].codepoint }, 1)) 
+        return "invalid codepoint on screen";
+  }
+  return NULL;
+}
+
+int headlessfuzz(int32_t iterations) {
+  enum { FUZZ_BYTES = 4096, FUZZ_SCALARS = 256 };
+  uint8_t* buf = malloc(FUZZ_BYTES);
+  uint32_t* out = malloc(4 * (FUZZ_BYTES + 1) * sizeof(*out));
+  uint32_t cps[FUZZ_SCALARS];
+  resizeterm(HEADLESS_COLS, HEADLESS_ROWS, 1, 1);
+  resetterm();
+
+  uint64_t x = 0x9e3779b97f4a7c15ULL;
+  size_t bytes = 0;
+  const char* failed = NULL;
+  int32_t i;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < iterations && !failed; i++) {
+    size_t len = fuzzbytes(&x, buf, 16 + nextrand(&x) % (FUZZ_BYTES - 16));
+    bytes += len;
+    if (!fuzzdecoder(&x, buf, len, out)) {
+      failed = "chunked decoding differs from decoding at once";
+      break;
+    }
+    if (!fuzzroundtrip(&x, cps, FUZZ_SCALARS, out)) {
+      failed = "scalar values do not survive encoding and decoding";
+      break;
+    }
+    // The parser gets the same bytes in pieces of any size, with the 
+    // terminal resized in between now and then
+    for (size_t off = 0; off < len && !failed;) {
+      size_t n = 1 + nextrand(&x) % 512;
+      n = MIN(n, len - off);
+      termparse((const char*)buf + off, n);
+      off += n;
+      if (nextrand(&x) % 64 == 0)
+        resizeterm(2 + nextrand(&x) % 240, 1 + nextrand(&x) % 80, 1, 1);
+      failed = checkscreen();
+    }
+    if (i % 256 == 255) resetterm();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (failed)
+    fprintf(stderr, "tyr: fuzz iteration %d: %s.\n", i, failed);
+  else
+    printf("fuzz: %d iterations, %.1f MB in %.2f s, screen %016llx\n", iterations, 
+           bytes / 1E6, elapsedns(start, end) / 1E9, (unsigned long long)screenhash());
+  free(buf);
+  free(out);
+  return failed ? 1 : 0;
+}
+
+typedef size_t (*utf8_decode_fn)(utf8_decoder_t*, const uint8_t*, size_t, uint32_t*);
+
+// Decodes buf until enough bytes went through to time, in chunks of the
+// size the pty reader produces so sequences are cut at their ends as
+// they are when reading. The first pass is hashed so decoders can be
+// compared. Returns the nanoseconds taken.
+static double timedecode(utf8_decode_fn decode, const char* buf, size_t len, uint32_t* out,
+                         size_t* passes, size_t* codepoints, size_t* replaced, uint64_t* hash) {
+  utf8_decoder_t dec;
+  utf8reset(&dec);
+  *passes = *codepoints = *replaced = 0;
+  *hash = 0xcbf29ce484222325ULL;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    for (size_t off = 0; off < len; off += BUF_SIZE) {
+      size_t n = decode(&dec, (const uint8_t*)buf + off, MIN(len - off, (size_t)BUF_SIZE), out);
+      if (!*passes) {
+        for (size_t i = 0; i < n; i++) {
+          *replaced += out[i] == UTF8_REPLACEMENT_CHAR;
+          *hash = (*hash ^ out[i]) * 0x100000001b3ULL;
+        }
+      }
+      *codepoints += n;
+    }
+    ++*passes;
+  } while (len && *passes * len < HEADLESS_MIN_BYTES);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return elapsedns(start, end);
+}
+
+int headlessutf8(const char* path) {
+  size_t len;
+  char* buf = readfile(path, &len);
+  if (!buf) return 1;
+  uint32_t* out = malloc((BUF_SIZE + 1) * sizeof(*out));
+
+  size_t passes, codepoints, replaced, spasses, scodepoints, sreplaced;
+  uint64_t hash, shash;
+  double ns = timedecode(utf8decodechunk, buf, len, out, &passes, &codepoints,
+                         &replaced, &hash);
+  double sns = timedecode(utf8decodescalar, buf, len, out, &spasses, &scodepoints,
+                          &sreplaced, &shash);
+
+  double bytes = (double)passes * len, sbytes = (double)spasses * len;
+  printf("utf8: %s, %zu bytes x %zu, %.1f MB/s, %.2f ns/codepoint, %zu codepoints, %zu replaced\n",
+         path, len, passes, bytes / ns * 1E3, codepoints ? ns / codepoints : 0.0,
+         codepoints / passes, replaced);
+  printf("  %s: %.1f MB/s, state machine alone: %.1f MB/s, %.2fx\n", utf8decodepath(),
+         bytes / ns * 1E3, sbytes / sns * 1E3, (bytes / ns) / (sbytes / sns));
+  free(out);
+  free(buf);
+  if (hash != shash || codepoints / passes != scodepoints / spasses) {
+    fprintf(stderr, "tyr: the %s decoder and the state machine disagree on %s.\n",
+            utf8decodepath(), path);
+    return 1;
+  }
+  return 0;
+}
+
+// Loads the font fontconfig matches for family, its file goes to path
+static FT_Face openfont(const char* family, FT_Library* ft, char* path, size_t size) {
+  FcPattern* pattern = FcNameParse((const FcChar8*)family);
+  FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+  FcDefaultSubstitute(pattern);
+  FcResult result;
+  FcPattern* match = FcFontMatch(NULL, pattern, &result);
+  FcPatternDestroy(pattern);
+  FcChar8* file = NULL;
+  int index = 0;
+  if (!match || FcPatternGetString(match, FC_FILE, 0, &file) != FcResultMatch) {
+    fprintf(stderr, "tyr: no font found for %s.\n", family);
+    if (match) FcPatternDestroy(match);
+    return NULL;
+  }
+  FcPatternGetInteger(match, FC_INDEX, 0, &index);
+  snprintf(path, size, "%s", file);
+  FcPatternDestroy(match);
+  FT_Face face;
+  if (FT_Init_FreeType(ft)) return NULL;
+  if (FT_New_Face(*ft, path, index, &face)) {
+    fprintf(stderr, "tyr: cannot load %s.\n", path);
+    FT_Done_FreeType(*ft);
+    return NULL;
+  }
+  return face;
+}
+
+int headlesscoverage(const char* family) {
+  char file[4096];
+  FT_Library ft;
+  FT_Face face = openfont(family, &ft, file, sizeof(file));
+  if (!face) return 1;
+
+  const size_t n = 1 << 20;
+  uint32_t* cps = malloc(n * sizeof(*cps));
+  bool* has = malloc(n);
+  mixedscript(cps, n);
+
+  struct timespec t0, t1, t2, t3;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  const font_coverage_t* c = fontcoverage(face);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  size_t found = 0;
+  for (size_t i = 0; i < n; i++) 
+    found += has[i] = FT_Get_Char_Index(face, cps[i]) != 0;
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+  size_t mismatches = 0;
+  for (size_t i = 0; i < n; i++) 
+    mismatches += coveragehas(c, cps[i]) != has[i];
+  clock_gettime(CLOCK_MONOTONIC, &t3);
+
+  size_t bytes = sizeof(*c) + arrlenu(c->pages) * sizeof(coverage_page_t) + 
+    hmlenu(c->astral) * sizeof(coverage_astral_t);
+  printf("coverage: %s, %zu mixed-script codepoints, %.1f%% in the font\n"
+         "  FT_Get_Char_Index %.2f ns/lookup, bitmap %.2f ns/lookup, built in %.0f us, %zu bytes\n",
+         file, n, 100.0 * found / n, elapsedns(t1, t2) / n, elapsedns(t2, t3) / n,
+         elapsedns(t0, t1) / 1E3, bytes);
+  if (mismatches)
+    fprintf(stderr, "tyr: coverage disagrees with FT_Get_Char_Index for %zu codepoints.\n", 
+            mismatches);
+
+  free(cps);
+  free(has);
+  coveragefree();
+  FT_Done_Face(face);
+  FT_Done_FreeType(ft);
+  return mismatches ? 1 : 0;
+}
+
+static EGLDisplay egldisplay = EGL_NO_DISPLAY;
+static EGLContext eglctx = EGL_NO_CONTEXT;
+
+// Hash of the colors of pixels, so images of both renderers compare
+static uint64_t imagehash(const uint32_t* pixels, size_t n) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < n; i++) {
+    for (uint32_t shift = 0; shift < 24; shift += 8)
+      hash = (hash ^ ((pixels[i] >> shift) & 0xff)) * 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+// Loads HEADLESS_FONT and sizes a screen of HEADLESS_COLS x HEADLESS_ROWS
+// cells in pixels
+static FT_Face screenfont(FT_Library* ft, int32_t* width, int32_t* height) {
+  char file[4096];
+  FT_Face face = openfont(HEADLESS_FONT, ft, file, sizeof(file));
+  if (!face) return NULL;
+  FT_Set_Pixel_Sizes(face, 0, HEADLESS_FONT_SIZE);
+  *width = HEADLESS_COLS * (face->size->metrics.max_advance >> 6);
+  *height = HEADLESS_ROWS * (face->size->metrics.height >> 6);
+  return face;
+}
+
+// Like a clock in a status line
+static void changerow(int32_t frame) {
+  char line[64];
+  int n = snprintf(line, sizeof(line), "\033[%d;1Hframe %d", HEADLESS_ROWS / 2, frame);
+  termparse(line, n);
+}
+
+// An OpenGL 3.3 context without a window or a display server. Mesa 
+// gives one on llvmpipe when there is no GPU, or when asked with
+// LIBGL_ALWAYS_SOFTWARE=1.
+static bool eglcontext(void) {
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getdisplay = 
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (getdisplay)
+    egldisplay = getdisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if (egldisplay == EGL_NO_DISPLAY) 
+    egldisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  if (egldisplay == EGL_NO_DISPLAY || !eglInitialize(egldisplay, NULL, NULL) ||
+    !eglBindAPI(EGL_OPENGL_API)) {
+    fprintf(stderr, "tyr: no EGL display for OpenGL.\n");
+    return false;
+  }
+  static const EGLint configattribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+  static const EGLint ctxattribs[] = {
+    EGL_CONTEXT_MAJOR_VERSION, 3,
+    EGL_CONTEXT_MINOR_VERSION, 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  EGLConfig config = NULL;
+  EGLint nconfigs = 0;
+  eglChooseConfig(egldisplay, configattribs, &config, 1, &nconfigs);
+  eglctx = eglCreateContext(egldisplay, nconfigs ? config : NULL, EGL_NO_CONTEXT, ctxattribs);
+  if (eglctx == EGL_NO_CONTEXT || 
+    !eglMakeCurrent(egldisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglctx)) {
+    fprintf(stderr, "tyr: cannot create an OpenGL 3.3 context: EGL error %x.\n", eglGetError());
+    eglTerminate(egldisplay);
+    return false;
+  }
+  return true;
+}
+
+int headlessgl(const char* path, const char* snapshot, uint64_t expect) {
+  const int32_t frames = 200;
+  size_t len;
+  char* buf = readfile(path, &len);
+  if (!buf) return 1;
+  FT_Library ft;
+  FT_Face face = NULL;
+  int32_t width, height;
+  if (!eglcontext() || !(face = screenfont(&ft, &width, &height))) {
+    free(buf);
+    return 1;
+  }
+
+  GLuint fbo, rb;
+  glGenFramebuffers(1, &fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glGenRenderbuffers(1, &rb);
+  glBindRenderbuffer(GL_RENDERBUFFER, rb);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, rb);
+
+  int status = 1;
+  if (!gridglinit(face)) goto done;
+  resizeterm(HEADLESS_COLS, HEADLESS_ROWS, 1, 1);
+  resetterm();
+  replayraw(buf, len);
+
+  // The first frame rasterizes the glyphs, its image is hashed
+  struct timespec t0, t1, t2, t3;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  s.fullrerender = true;
+  gridglframe(width, height);
+  glFinish();
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  // In the pixel format of soft.c, GL has the bottom row first
+  uint32_t* pixels = malloc((size_t)width * height * 4);
+  for (int32_t y = 0; y < height; y++) 
+    glReadPixels(0, height - 1 - y, width, 1, GL_BGRA, GL_UNSIGNED_INT_8_8_8_8_REV,
+                 pixels + (size_t)y * width);
+  uint64_t hash = imagehash(pixels, (size_t)width * height);
+  bool written = !snapshot || writeppm(snapshot, pixels, width, height);
+  free(pixels);
+
+  size_t before = gridgluploaded();
+  for (int32_t i = 0; i < frames; i++) {
+    s.fullrerender = true;
+    gridglframe(width, height);
+    glFinish();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+  size_t full = gridgluploaded() - before;
+
+  before = gridgluploaded();
+  for (int32_t i = 0; i < frames; i++) {
+    changerow(i);
+    gridglframe(width, height);
+    glFinish();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t3);
+  size_t row = gridgluploaded() - before;
+
+  printf("%s: %s, %dx%d cells, first frame %.2f ms\n"
+         "  full frame %.2f ms, %.1f KiB uploaded, one row changed %.2f ms, %.1f KiB uploaded, "
+         "image %016llx\n",
+         path, glGetString(GL_RENDERER), HEADLESS_COLS, HEADLESS_ROWS, 
+         elapsedns(t0, t1) / 1E6, elapsedns(t1, t2) / 1E6 / frames, full / 1024.0 / frames, 
+         elapsedns(t2, t3) / 1E6 / frames, row / 1024.0 / frames, (unsigned long long)hash);
+  status = written && checkhash("image", hash, expect) ? 0 : 1;
+  gridglshutdown();
+
+done:
+  glDeleteRenderbuffers(1, &rb);
+  glDeleteFramebuffers(1, &fbo);
+  FT_Done_Face(face);
+  FT_Done_FreeType(ft);
+  eglMakeCurrent(egldisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(egldisplay, eglctx);
+  eglTerminate(egldisplay);
+  free(buf);
+  return status;
+}
+
+int headlesssoft(const char* path, const char* snapshot, uint64_t expect) {
+  const int32_t frames = 200;
+  size_t len;
+  char* buf = readfile(path, &len);
+  if (!buf) return 1;
+  FT_Library ft;
+  int32_t width, height;
+  FT_Face face = screenfont(&ft, &width, &height);
+  if (!face) {
+    free(buf);
+    return 1;
+  }
+  softinit(face);
+  resizeterm(HEADLESS_COLS, HEADLESS_ROWS, 1, 1);
+  resetterm();
+  replayraw(buf, len);
+
+  // The first frame rasterizes the glyphs, its image is hashed
+  struct timespec t0, t1, t2, t3;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  s.fullrerender = true;
+  const uint32_t* pixels = softframe(width, height);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  uint64_t hash = imagehash(pixels, (size_t)width * height);
+  bool written = !snapshot || writeppm(snapshot, pixels, width, height);
+
+  for (int32_t i = 0; i < frames; i++) {
+    s.fullrerender = true;
+    softframe(width, height);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+  for (int32_t i = 0; i < frames; i++) {
+    changerow(i);
+    softframe(width, height);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t3);
+
+  double full = elapsedns(t1, t2) / frames, row = elapsedns(t2, t3) / frames;
+  printf("%s: %dx%d cells, %dx%d pixels, first frame %.2f ms\n"
+         "  full frame %.2f ms, %.0f frames/s, one row changed %.3f ms, %.0f frames/s, "
+         "image %016llx\n",
+         path, HEADLESS_COLS, HEADLESS_ROWS, width, height, elapsedns(t0, t1) / 1E6,
+         full / 1E6, 1E9 / full, row / 1E6, 1E9 / row, (unsigned long long)hash);
+  softshutdown();
+  FT_Done_Face(face);
+  FT_Done_FreeType(ft);
+  free(buf);
+  return written && checkhash("image", hash, expect) ? 0 : 1;
+}
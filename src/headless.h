@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Replays a raw pty stream or a --record session through the parser 
+// without a window or a shell and prints throughput and a hash of the 
+// final screen. With realtime set, a session is played once at its 
+// original speed. With a search pattern, the final screen and history
+// are searched afterwards and the matches are counted and timed. Fails
+// if expect is not 0 and the screen hash differs from it.
+// Returns the process exit status.
+int headlessreplay(const char* path, bool realtime, const char* search, bool regex, 
+                   uint64_t expect);
+
+// Resizes a screen of text count times through a few sizes, after a 
+// round that sizes the grid arena. Prints the time per resize and fails
+// if any of them grew the arena or, in a build with TYR_ALLOC_COUNT, 
+// called malloc(), calloc(), realloc() or aligned_alloc().
+int headlessresizes(int32_t count);
+
+// Feeds random bytes, escape sequences and cut off UTF-8 through the
+// decoder and the parser in pieces of random size, resizing now and 
+// then. Fails if decoding in pieces differs from decoding at once, if
+// valid text does not decode to what was encoded, or if the cursor or
+// the scroll region leave the screen. Always the same input.
+int headlessfuzz(int32_t iterations);
+
+// Times decoding the UTF-8 of a file in the chunk size the pty reader
+// produces
+int headlessutf8(const char* path);
+
+// Times looking codepoints of mixed-script text up in the font fontconfig
+// matches for family, with FT_Get_Char_Index and with its coverage 
+// bitmap. Fails if they disagree.
+int headlesscoverage(const char* family);
+
+// Replays a raw pty stream and draws the final screen with the grid 
+// renderer into an offscreen framebuffer of an EGL context, which works
+// on Mesa's software rasterizer. Prints the time of a first frame, of
+// frames that upload every row and of frames where one row changed,
+// and a hash of the image. With snapshot set, the image is written 
+// there as a PPM. Fails if expect is not 0 and the image hash differs
+// from it.
+int headlessgl(const char* path, const char* snapshot, uint64_t expect);
+
+// Like headlessgl(), drawn on the CPU by soft.c. The images of both
+// renderers have the same hash when they match.
+int headlesssoft(const char* path, const char* snapshot, uint64_t expect);
@@ -0,0 +1,411 @@
+#include "parser.h"
+
+#include <stdint.h>
+#include <string.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+#include "term.h"
+
+// Table driven VT parser after the DEC ANSI parser state diagram
+// (https://vt100.net/emu/dec_ansi_parser). Every 7-bit byte is looked up
+// in transitions[state][byte], which packs the next state in the high
+// nibble and the action to run in the low nibble. Bytes >= 0x80 are UTF-8
+// and decoded in runs by utf8decodechunk().
+
+#define ESC_PARAM_MAX 65535
+#define UTF8_RUN_MAX  512
+
+typedef enum {
+  ACTION_NONE         = 0,
+  ACTION_PRINT        = 1,
+  ACTION_EXECUTE      = 2,
+  ACTION_COLLECT      = 3,
+  ACTION_PARAM        = 4,
+  ACTION_ESC_DISPATCH = 5,
+  ACTION_CSI_DISPATCH = 6,
+  ACTION_OSC_PUT      = 7,
+} parser_action_t;
+
+#define TR(state, action) (uint8_t)(((state) << 4) | (action))
+
+// Transitions that apply in every state
+#define ANYWHERE \
+  [0x18] = TR(PARSER_STATE_GROUND, ACTION_EXECUTE), \
+  [0x1a] = TR(PARSER_STATE_GROUND, ACTION_EXECUTE), \
+  [0x1b] = TR(PARSER_STATE_ESCAPE, ACTION_NONE)
+
+// C0 controls that are not covered by ANYWHERE
+#define C0(state, action) \
+  [0x00 ... 0x17] = TR(state, action), \
+  [0x19]          = TR(state, action), \
+  [0x1c ... 0x1f] = TR(state, action)
+
+static const uint8_t transitions[PARSER_STATE_COUNT][128] = {
+  [PARSER_STATE_GROUND] = {
+    ANYWHERE,
+    C0(PARSER_STATE_GROUND, ACTION_EXECUTE),
+    [0x20 ... 0x7e] = TR(PARSER_STATE_GROUND, ACTION_PRINT),
+    [0x7f]          = TR(PARSER_STATE_GROUND, ACTION_NONE),
+  },
+  [PARSER_STATE_ESCAPE] = {
+    ANYWHERE,
+    C0(PARSER_STATE_ESCAPE, ACTION_EXECUTE),
+    [0x20 ... 0x2f] = TR(PARSER_STATE_ESCAPE_INTERMEDIATE, ACTION_COLLECT),
+    [0x30 ... 0x4f] = TR(PARSER_STATE_GROUND, ACTION_ESC_DISPATCH),
+    [0x50]          = TR(PARSER_STATE_DCS_ENTRY, ACTION_NONE),
+    [0x51 ... 0x57] = TR(PARSER_STATE_GROUND, ACTION_ESC_DISPATCH),
+    [0x58]          = TR(PARSER_STATE_SOS_PM_APC_STRING, ACTION_NONE),
+    [0x59 ... 0x5a] = TR(PARSER_STATE_GROUND, ACTION_ESC_DISPATCH),
+    [0x5b]          = TR(PARSER_STATE_CSI_ENTRY, ACTION_NONE),
+    [0x5c]          = TR(PARSER_STATE_GROUND, ACTION_ESC_DISPATCH),
+    [0x5d]          = TR(PARSER_STATE_OSC_STRING, ACTION_NONE),
+    [0x5e ... 0x5f] = TR(PARSER_STATE_SOS_PM_APC_STRING, ACTION_NONE),
+    [0x60 ... 0x7e] = TR(PARSER_STATE_GROUND, ACTION_ESC_DISPATCH),
+    [0x7f]          = TR(PARSER_STATE_ESCAPE, ACTION_NONE),
+  },
+  [PARSER_STATE_ESCAPE_INTERMEDIATE] = {
+    ANYWHERE,
+    C0(PARSER_STATE_ESCAPE_INTERMEDIATE, ACTION_EXECUTE),
+    [0x20 ... 0x2f] = TR(PARSER_STATE_ESCAPE_INTERMEDIATE, ACTION_COLLECT),
+    [0x30 ... 0x7e] = TR(PARSER_STATE_GROUND, ACTION_ESC_DISPATCH),
+    [0x7f]          = TR(PARSER_STATE_ESCAPE_INTERMEDIATE, ACTION_NONE),
+  },
+  [PARSER_STATE_CSI_ENTRY] = {
+    ANYWHERE,
+    C0(PARSER_STATE_CSI_ENTRY, ACTION_EXECUTE),
+    [0x20 ... 0x2f] = TR(PARSER_STATE_CSI_INTERMEDIATE, ACTION_COLLECT),
+    [0x30 ... 0x3b] = TR(PARSER_STATE_CSI_PARAM, ACTION_PARAM),
+    [0x3c ... 0x3f] = TR(PARSER_STATE_CSI_PARAM, ACTION_COLLECT),
+    [0x40 ... 0x7e] = TR(PARSER_STATE_GROUND, ACTION_CSI_DISPATCH),
+    [0x7f]          = TR(PARSER_STATE_CSI_ENTRY, ACTION_NONE),
+  },
+  [PARSER_STATE_CSI_PARAM] = {
+    ANYWHERE,
+    C0(PARSER_STATE_CSI_PARAM, ACTION_EXECUTE),
+    [0x20 ... 0x2f] = TR(PARSER_STATE_CSI_INTERMEDIATE, ACTION_COLLECT),
+    [0x30 ... 0x3b] = TR(PARSER_STATE_CSI_PARAM, ACTION_PARAM),
+    [0x3c ... 0x3f] = TR(PARSER_STATE_CSI_IGNORE, ACTION_NONE),
+    [0x40 ... 0x7e] = TR(PARSER_STATE_GROUND, ACTION_CSI_DISPATCH),
+    [0x7f]          = TR(PARSER_STATE_CSI_PARAM, ACTION_NONE),
+  },
+  [PARSER_STATE_CSI_INTERMEDIATE] = {
+    ANYWHERE,
+    C0(PARSER_STATE_CSI_INTERMEDIATE, ACTION_EXECUTE),
+    [0x20 ... 0x2f] = TR(PARSER_STATE_CSI_INTERMEDIATE, ACTION_COLLECT),
+    [0x30 ... 0x3f] = TR(PARSER_STATE_CSI_IGNORE, ACTION_NONE),
+    [0x40 ... 0x7e] = TR(PARSER_STATE_GROUND, ACTION_CSI_DISPATCH),
+    [0x7f]          = TR(PARSER_STATE_CSI_INTERMEDIATE, ACTION_NONE),
+  },
+  [PARSER_STATE_CSI_IGNORE] = {
+    ANYWHERE,
+    C0(PARSER_STATE_CSI_IGNORE, ACTION_EXECUTE),
+    [0x20 ... 0x3f] = TR(PARSER_STATE_CSI_IGNORE, ACTION_NONE),
+    [0x40 ... 0x7e] = TR(PARSER_STATE_GROUND, ACTION_NONE),
+    [0x7f]          = TR(PARSER_STATE_CSI_IGNORE, ACTION_NONE),
+  },
+  [PARSER_STATE_DCS_ENTRY] = {
+    ANYWHERE,
+    C0(PARSER_STATE_DCS_ENTRY, ACTION_NONE),
+    [0x20 ... 0x2f] = TR(PARSER_STATE_DCS_INTERMEDIATE, ACTION_COLLECT),
+    [0x30 ... 0x39] = TR(PARSER_STATE_DCS_PARAM, ACTION_PARAM),
+    [0x3a]          = TR(PARSER_STATE_DCS_IGNORE, ACTION_NONE),
+    [0x3b]          = TR(PARSER_STATE_DCS_PARAM, ACTION_PARAM),
+    [0x3c ... 0x3f] = TR(PARSER_STATE_DCS_PARAM, ACTION_COLLECT),
+    [0x40 ... 0x7e] = TR(PARSER_STATE_DCS_PASSTHROUGH, ACTION_NONE),
+    [0x7f]          = TR(PARSER_STATE_DCS_ENTRY, ACTION_NONE),
+  },
+  [PARSER_STATE_DCS_PARAM] = {
+    ANYWHERE,
+    C0(PARSER_STATE_DCS_PARAM, ACTION_NONE),
+    [0x20 ... 0x2f] = TR(PARSER_STATE_DCS_INTERMEDIATE, ACTION_COLLECT),
+    [0x30 ... 0x39] = TR(PARSER_STATE_DCS_PARAM, ACTION_PARAM),
+    [0x3a]          = TR(PARSER_STATE_DCS_IGNORE, ACTION_NONE),
+    [0x3b]          = TR(PARSER_STATE_DCS_PARAM, ACTION_PARAM),
+    [0x3c ... 0x3f] = TR(PARSER_STATE_DCS_IGNORE, ACTION_NONE),
+    [0x40 ... 0x7e] = TR(PARSER_STATE_DCS_PASSTHROUGH, ACTION_NONE),
+    [0x7f]          = TR(PARSER_STATE_DCS_PARAM, ACTION_NONE),
+  },
+  [PARSER_STATE_DCS_INTERMEDIATE] = {
+    ANYWHERE,
+    C0(PARSER_STATE_DCS_INTERMEDIATE, ACTION_NONE),
+    [0x20 ... 0x2f] = TR(PARSER_STATE_DCS_INTERMEDIATE, ACTION_COLLECT),
+    [0x30 ... 0x3f] = TR(PARSER_STATE_DCS_IGNORE, ACTION_NONE),
+    [0x40 ... 0x7e] = TR(PARSER_STATE_DCS_PASSTHROUGH, ACTION_NONE),
+    [0x7f]          = TR(PARSER_STATE_DCS_INTERMEDIATE, ACTION_NONE),
+  },
+  // No DCS sequences are implemented, so the payload is dropped
+  [PARSER_STATE_DCS_PASSTHROUGH] = {
+    ANYWHERE,
+    C0(PARSER_STATE_DCS_PASSTHROUGH, ACTION_NONE),
+    [0x20 ... 0x7f] = TR(PARSER_STATE_DCS_PASSTHROUGH, ACTION_NONE),
+  },
+  [PARSER_STATE_DCS_IGNORE] = {
+    ANYWHERE,
+    C0(PARSER_STATE_DCS_IGNORE, ACTION_NONE),
+    [0x20 ... 0x7f] = TR(PARSER_STATE_DCS_IGNORE, ACTION_NONE),
+  },
+  [PARSER_STATE_OSC_STRING] = {
+    ANYWHERE,
+    [0x00 ... 0x06] = TR(PARSER_STATE_OSC_STRING, ACTION_NONE),
+    // xterm also terminates OSC strings with BEL
+    [0x07]          = TR(PARSER_STATE_GROUND, ACTION_NONE),
+    [0x08 ... 0x17] = TR(PARSER_STATE_OSC_STRING, ACTION_NONE),
+    [0x19]          = TR(PARSER_STATE_OSC_STRING, ACTION_NONE),
+    [0x1c ... 0x1f] = TR(PARSER_STATE_OSC_STRING, ACTION_NONE),
+    [0x20 ... 0x7f] = TR(PARSER_STATE_OSC_STRING, ACTION_OSC_PUT),
+  },
+  [PARSER_STATE_SOS_PM_APC_STRING] = {
+    ANYWHERE,
+    C0(PARSER_STATE_SOS_PM_APC_STRING, ACTION_NONE),
+    [0x20 ... 0x7f] = TR(PARSER_STATE_SOS_PM_APC_STRING, ACTION_NONE),
+  },
+};
+
+static void
+clearseq(void) {
+  s.csiseq.nparams = 0;
+  s.csiseq.subparams = 0;
+  s.csiseq.prefix = '\0';
+  s.csiseq.intermediate = '\0';
+  s.csiseq.cmd[0] = s.csiseq.cmd[1] = '\0';
+  memset(s.csiseq.params, 0, sizeof(s.csiseq.params));
+}
+
+static void
+onentry(parser_state_t state) {
+  switch(state) {
+    case PARSER_STATE_ESCAPE:
+    case PARSER_STATE_CSI_ENTRY:
+    case PARSER_STATE_DCS_ENTRY:
+      clearseq();
+      break;
+    case PARSER_STATE_OSC_STRING:
+      s.csiseq.len = 0;
+      break;
+    default:
+      break;
+  }
+}
+
+static void
+onexit(parser_state_t state) {
+  if(state == PARSER_STATE_OSC_STRING) {
+    // No OSC commands are implemented yet, the string is only terminated
+    s.csiseq.buf[s.csiseq.len] = '\0';
+  }
+}
+
+static inline void
+param(uint8_t c) {
+  escape_seq_t* seq = &s.csiseq;
+  if(seq->nparams == 0)
+    seq->nparams = 1;
+
+  if(c >= '0' && c <= '9') {
+    // Digits beyond ESC_PARAM_SIZE parameters are dropped
+    if(seq->nparams > ESC_PARAM_SIZE) return;
+    int* p = &seq->params[seq->nparams - 1];
+    *p = MIN(*p * 10 + (c - '0'), ESC_PARAM_MAX);
+    return;
+  }
+
+  // ';' starts a new parameter, ':' a sub-parameter of the previous one
+  if(c == ':' && seq->nparams < ESC_PARAM_SIZE)
+    seq->subparams |= 1u << seq->nparams;
+  if(seq->nparams <= ESC_PARAM_SIZE)
+    seq->nparams++;
+}
+
+static inline void
+collect(uint8_t c) {
+  if(c >= 0x3c && c <= 0x3f)
+    s.csiseq.prefix = c;
+  else
+    s.csiseq.intermediate = c;
+}
+
+static inline void
+oscput(const char* bytes, size_t len) {
+  if(s.csiseq.len + len >= sizeof(s.csiseq.buf)) return;
+  memcpy(&s.csiseq.buf[s.csiseq.len], bytes, len);
+  s.csiseq.len += len;
+}
+
+static void
+csidispatch(uint8_t c) {
+  if(s.csiseq.nparams > ESC_PARAM_SIZE)
+    s.csiseq.nparams = ESC_PARAM_SIZE;
+  s.csiseq.cmd[0] = c;
+  s.csiseq.cmd[1] = s.csiseq.intermediate;
+  // None of the sequences with intermediate bytes are implemented
+  if(s.csiseq.intermediate) return;
+  handlecsi();
+}
+
+static inline void
+runaction(parser_action_t action, uint8_t c) {
+  switch(action) {
+    case ACTION_PRINT:
+      handleprint(c);
+      break;
+    case ACTION_EXECUTE:
+      handlectrl(c);
+      if(s.parserstate == PARSER_STATE_GROUND)
+        s.recentcodepoint = 0;
+      break;
+    case ACTION_COLLECT:
+      collect(c);
+      break;
+    case ACTION_PARAM:
+      param(c);
+      break;
+    case ACTION_ESC_DISPATCH:
+      handleescseq(c);
+      break;
+    case ACTION_CSI_DISPATCH:
+      csidispatch(c);
+      break;
+    case ACTION_OSC_PUT: {
+      char byte = c;
+      oscput(&byte, 1);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static inline void
+advance(uint8_t c) {
+  uint8_t tr = transitions[s.parserstate][c];
+  parser_state_t next = tr >> 4;
+  parser_action_t action = tr & 0xF;
+
+  if(next == s.parserstate) {
+    runaction(action, c);
+    return;
+  }
+  // The state is switched before the action runs, as dispatching may
+  // write to the pty and re-enter the parser.
+  onexit(s.parserstate);
+  s.parserstate = next;
+  runaction(action, c);
+  onentry(next);
+}
+
+static inline void
+advancecodepoint(uint32_t c) {
+  switch(s.parserstate) {
+    case PARSER_STATE_GROUND:
+      // C1 controls are not supported
+      if(!isctrlc1(c))
+        handleprint(c);
+      break;
+    case PARSER_STATE_OSC_STRING: {
+      char bytes[UTF_SIZE];
+      oscput(bytes, utf8encode(c, bytes));
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// Length of the run of printable ASCII (0x20 - 0x7E) at the start of buf
+static size_t
+printablerun_scalar(const uint8_t* buf, size_t len) {
+  size_t i = 0;
+  while(i < len && buf[i] >= 0x20 && buf[i] < 0x7f)
+    i++;
+  return i;
+}
+
+#ifdef __x86_64__
+// Bytes >= 0x80 are negative as signed chars, so a single signed compare
+// against 0x20 catches C0 controls and UTF-8 alike; DEL is checked apart.
+static size_t
+printablerun_sse2(const uint8_t* buf, size_t len) {
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  size_t i = 0;
+  for(; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+    __m128i stop = _mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del));
+    uint32_t mask = _mm_movemask_epi8(stop);
+    if(mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + printablerun_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t
+printablerun_avx2(const uint8_t* buf, size_t len) {
+  const __m256i space = _mm256_set1_epi8(0x1f);
+  const __m256i del = _mm256_set1_epi8(0x7f);
+  size_t i = 0;
+  for(; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i));
+    __m256i stop = _mm256_or_si256(
+      _mm256_cmpgt_epi8(space, v), _mm256_cmpeq_epi8(v, del));
+    uint32_t mask = _mm256_movemask_epi8(stop);
+    if(mask)
+      return i + __builtin_ctz(mask);
+  }
+  return i + printablerun_sse2(buf + i, len - i);
+}
+#endif
+
+static size_t (*printablerun)(const uint8_t* buf, size_t len) = NULL;
+
+static void
+selectprintablerun(void) {
+#ifdef __x86_64__
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    printablerun = printablerun_avx2;
+  else
+    printablerun = printablerun_sse2;
+#else
+  printablerun = printablerun_scalar;
+#endif
+}
+
+void
+termparse(const char* buf, size_t len) {
+  const uint8_t* bytes = (const uint8_t*)buf;
+  if(!printablerun)
+    selectprintablerun();
+
+  size_t i = 0;
+  while(i < len) {
+    uint8_t c = bytes[i];
+    if(c < 0x80 && s.utf8.needed) {
+      // The sequence started by the previous bytes was cut short
+      utf8reset(&s.utf8);
+      advancecodepoint(UTF8_REPLACEMENT_CHAR);
+    }
+    if(s.parserstate == PARSER_STATE_GROUND && c >= 0x20 && c < 0x7f) {
+      size_t run = printablerun(bytes + i, len - i);
+      handleprintrun(buf + i, run);
+      i += run;
+      continue;
+    }
+    if(c < 0x80) {
+      advance(c);
+      i++;
+      continue;
+    }
+
+    size_t end = i + 1;
+    while(end < len && bytes[end] >= 0x80 && end - i < UTF8_RUN_MAX)
+      end++;
+    uint32_t codepoints[UTF8_RUN_MAX + 1];
+    size_t n = utf8decodechunk(&s.utf8, bytes + i, end - i, codepoints);
+    for(size_t j = 0; j < n; j++)
+      advancecodepoint(codepoints[j]);
+    i = end;
+  }
+}
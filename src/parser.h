@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "tyr.h"
+
+// Runs a chunk of PTY output through the VT state machine. All bytes are
+// consumed; a trailing incomplete UTF-8 sequence is kept in s.utf8 and 
+// completed by the next call.
+void termparse(const char* buf, size_t len);
@@ -1,5 +1,6 @@
 #include "pty.h"
 
+#include <stdalign.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdint.h>
@@ -10,6 +11,8 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/select.h>
+#include <poll.h>
+#include <signal.h>
 #include <sys/wait.h>
 #include <string.h>
 #include <pthread.h>
@@ -19,30 +22,37 @@
 #include <leif/task.h>
 
 #include "term.h"
+#include "parser.h"
+#include "record.h"
+#include "../vendor/stb_ds.h"
 
 #define FRAME_INTERVAL_SEC (1 / 60.0f) 
 
 pty_data_t* setuppty(void) {
-  pty_data_t* data = malloc(sizeof(*data));
+  pty_data_t* data = aligned_alloc(alignof(pty_data_t), sizeof(*data));
   if (!data) {
-    perror("malloc");
+    perror("aligned_alloc");
     return NULL;
   }
+  memset(data, 0, sizeof(*data));
 
-  data->buf = malloc(BUF_SIZE);
-  if (!data->buf) {
-    perror("malloc");
+  if (!ringinit(&data->ring, PTY_RING_SIZE)) {
     free(data);
     return NULL;
   }
-  memset(data->buf, 0, BUF_SIZE);
-  data->buflen = 0;
-
+  if (s.recorder && !ringinit(&data->reads, PTY_READS_SIZE)) {
+    ringfree(&data->ring);
+    free(data);
+    return NULL;
+  }
+  atomic_init(&data->notified, false);
+  atomic_init(&data->eof, false);
 
   data->childpid = forkpty(&data->masterfd, NULL, NULL, NULL);
   if (data->childpid == -1) {
     perror("forkpty");
-    free(data->buf);
+    ringfree(&data->ring);
+    ringfree(&data->reads);
     free(data);
     return NULL;
   }
@@ -56,114 +66,320 @@ pty_data_t* setuppty(void) {
 
   if (pipe(data->shutdown_pipe) == -1) {
     perror("pipe");
-    free(data);
-    return NULL;
+    goto nopipes;
   }
   
   if (pipe(data->notify_pipe) == -1) {
     perror("pipe");
-    free(data);
-    return NULL;
+    goto noshutdownpipe;
   }
+  // Never block the reader thread on a main loop that is behind
+  fcntl(data->notify_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(data->notify_pipe[1], F_SETFL, O_NONBLOCK);
+  // Writes are queued and flushed when the pty is writable
+  fcntl(data->masterfd, F_SETFL, O_NONBLOCK);
 
+  if (pthread_create(&data->ptythread, NULL, ptyhandler, data) != 0) {
+    perror("pthread_create");
+    goto nothread;
+  }
 
   // Parent process: return the pty data
   return data;
+
+nothread:
+  close(data->notify_pipe[0]);
+  close(data->notify_pipe[1]);
+noshutdownpipe:
+  close(data->shutdown_pipe[0]);
+  close(data->shutdown_pipe[1]);
+nopipes:
+  // Nobody would read from the shell
+  close(data->masterfd);
+  kill(data->childpid, SIGKILL);
+  waitpid(data->childpid, NULL, 0);
+  ringfree(&data->ring);
+  ringfree(&data->reads);
+  free(data);
+  return NULL;
+}
+
+static void notifymainloop(pty_data_t* pty) {
+  // Only the first chunk after the main loop drained the ring needs a 
+  // wakeup, it picks up everything that arrives in the meantime.
+  if (atomic_exchange(&pty->notified, true)) return;
+  char dummy = 1;
+  write(pty->notify_pipe[1], &dummy, 1);
 }
 
+void* ptyhandler(void* data) {
+  pty_data_t* pty = (pty_data_t*)data;
+  struct pollfd fds[2] = {
+    { .fd = pty->masterfd,          .events = POLLIN },
+    { .fd = pty->shutdown_pipe[0],  .events = POLLIN },
+  };
+
+  while (true) {
+    char* span;
+    size_t space = ringwritespan(&pty->ring, &span);
+    if (space == 0) {
+      // The main loop is a whole ring behind, give it time to catch up
+      if (poll(&fds[1], 1, 1) > 0) break;
+      continue;
+    }
+
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "tyr: poll() failed: %s\n", strerror(errno));
+      break;
+    }
+    if (fds[1].revents) break;
+    if (!fds[0].revents) continue;
+
+    ssize_t n = read(pty->masterfd, span, space);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) continue;
+    if (n <= 0) {
+      // EIO is how Linux reports that the child closed the pty
+      if (n < 0 && errno != EIO)
+        fprintf(stderr, "tyr: failed to read from shell: %s\n", strerror(errno));
+      break;
+    }
+    // Noted before the bytes are published, so the main loop finds the
+    // time of every byte it reads. Entries never straddle the wrap.
+    if (pty->reads.buf) {
+      pty_read_t r = { 
+        .end = atomic_load_explicit(&pty->ring.head, memory_order_relaxed) + n,
+        .time = recordclock(),
+      };
+      ringput(&pty->reads, &r, sizeof(r));
+    }
+    ringcommit(&pty->ring, n);
+    notifymainloop(pty);
+  }
+
+  atomic_store(&pty->eof, true);
+  atomic_store(&pty->notified, false);
+  notifymainloop(pty);
+  return NULL;
+}
+
+void shutdownpty(pty_data_t* pty) {
+  char dummy = 1;
+  write(pty->shutdown_pipe[1], &dummy, 1);
+  pthread_join(pty->ptythread, NULL);
+  close(pty->shutdown_pipe[0]);
+  close(pty->shutdown_pipe[1]);
+  close(pty->notify_pipe[0]);
+  close(pty->notify_pipe[1]);
+  ringfree(&pty->ring);
+  ringfree(&pty->reads);
+  for (int32_t i = 0; i < arrlen(pty->outpaste); i++)
+    free(pty->outpaste[i].data);
+  arrfree(pty->outpaste);
+  arrfree(pty->outkeys);
+}
+
+static const char pastebegin[] = "\033[200~";
+static const char pasteend[] = "\033[201~";
+
+static void queuekeys(const char* buf, size_t len) {
+  memcpy(arraddnptr(s.pty->outkeys, len), buf, len);
+}
 
 void writetopty(const char* buf, size_t len) {
-  fd_set fdwrite, fdread;
-  size_t writelimit = 256;
+  // Replies to the host are dropped when replaying without a shell
+  if (!len || !s.pty) return;
+  record(RECORD_INPUT, buf, len);
+  queuekeys(buf, len);
+  flushpty();
+}
 
-  while (len > 0) {
-    FD_ZERO(&fdwrite);
-    FD_ZERO(&fdread);
-    FD_SET(s.pty->masterfd, &fdwrite);
-    FD_SET(s.pty->masterfd, &fdread);
-    if (pselect(s.pty->masterfd+1, &fdread, &fdwrite, NULL, NULL, NULL) < 0) {
-      if (errno == EINTR)
-        continue;
-      fprintf(stderr, "tyr: pselect() failed: %s\n", strerror(errno));
+void termpaste(char* buf, size_t len) {
+  bool bracketed = lf_flag_exists(&s.termmode, TERM_MODE_BRACKETED_PASTE);
+  if (bracketed) record(RECORD_INPUT, pastebegin, strlen(pastebegin));
+  record(RECORD_INPUT, buf, len);
+  if (bracketed) record(RECORD_INPUT, pasteend, strlen(pasteend));
+  if (bracketed)
+    arrput(s.pty->outpaste, ((pty_segment_t){ .kind = PTY_SEGMENT_PASTE_BEGIN }));
+  arrput(s.pty->outpaste, ((pty_segment_t){ 
+    .kind = PTY_SEGMENT_DATA, .data = buf, .len = len }));
+  if (bracketed)
+    arrput(s.pty->outpaste, ((pty_segment_t){ .kind = PTY_SEGMENT_PASTE_END }));
+  flushpty();
+}
+
+bool ptywritepending(void) {
+  return arrlen(s.pty->outkeys) > 0 || arrlen(s.pty->outpaste) > 0;
+}
+
+// Writes as much as the pty takes without blocking. Returns false once 
+// the pty is full.
+static bool writesome(const char* buf, size_t len, size_t* nwritten) {
+  *nwritten = 0;
+  while (*nwritten < len) {
+    ssize_t n = write(s.pty->masterfd, buf + *nwritten, len - *nwritten);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return false;
+      fprintf(stderr, "tyr: write error on pty: %s\n", strerror(errno));
       exit(1);
     }
-    if (FD_ISSET(s.pty->masterfd, &fdwrite)) {
-      int32_t nwritten = write(
-        s.pty->masterfd, buf, 
-        MIN(len, writelimit));
-      if(nwritten < 0) {
-        fprintf(stderr, "tyr: write error on pty: %s\n", strerror(errno));
-        exit(1);
+    *nwritten += n;
+  }
+  return true;
+}
+
+static bool flushpaste(void) {
+  pty_segment_t* seg = &s.pty->outpaste[0];
+  const char* data;
+  size_t len;
+  switch (seg->kind) {
+    case PTY_SEGMENT_PASTE_BEGIN:
+      data = pastebegin;
+      len = strlen(pastebegin);
+      break;
+    case PTY_SEGMENT_PASTE_END:
+      data = pasteend;
+      len = strlen(pasteend);
+      break;
+    default:
+      data = seg->data;
+      len = seg->len;
+      break;
+  }
+
+  while (seg->off < len) {
+    size_t chunk = MIN(len - seg->off, PTY_PASTE_CHUNK);
+    // Do not end a chunk inside a UTF-8 sequence, keys may follow it 
+    while (chunk < len - seg->off && chunk > 1 && 
+      ((uint8_t)data[seg->off + chunk] & 0xC0) == 0x80)
+      chunk--;
+    size_t n;
+    bool done = writesome(data + seg->off, chunk, &n);
+    seg->off += n;
+    if (!done) return false;
+    // Give keys typed in the meantime a chance to go first
+    if (arrlen(s.pty->outkeys) > 0) return true;
+  }
+
+  if (seg->kind == PTY_SEGMENT_PASTE_BEGIN) s.pty->pasteopen = true;
+  if (seg->kind == PTY_SEGMENT_PASTE_END)   s.pty->pasteopen = false;
+  free(seg->data);
+  arrdel(s.pty->outpaste, 0);
+  return true;
+}
+
+static void pushpastemarker(pty_segment_kind_t kind) {
+  arrput(s.pty->outpaste, (pty_segment_t){0});
+  memmove(&s.pty->outpaste[1], &s.pty->outpaste[0], 
+          (arrlen(s.pty->outpaste) - 1) * sizeof(pty_segment_t));
+  s.pty->outpaste[0] = (pty_segment_t){ .kind = kind };
+}
+
+void flushpty(void) {
+  while (ptywritepending()) {
+    bool keys = arrlen(s.pty->outkeys) > 0;
+    bool midmarker = arrlen(s.pty->outpaste) > 0 && 
+      s.pty->outpaste[0].kind != PTY_SEGMENT_DATA && s.pty->outpaste[0].off > 0;
+
+    // Keys jump ahead of pasted data. Inside a bracketed paste the 
+    // brackets are closed around them first, so they are not taken as 
+    // pasted text, and reopened afterwards.
+    if (keys && !midmarker) {
+      if (!s.pty->pasteopen) {
+        size_t n;
+        bool done = writesome(s.pty->outkeys, arrlen(s.pty->outkeys), &n);
+        arrdeln(s.pty->outkeys, 0, n);
+        if (!done) return;
+        continue;
       }
-      if(nwritten >= (int32_t)len) break;
-      if (nwritten < (int32_t)writelimit)
-        writelimit = readfrompty();
-      len -= nwritten;
-      buf += nwritten;
+      // With only the closing bracket left there is nothing to reopen, 
+      // it goes out as it is and the keys after it
+      if (!s.pty->pastesuspended && s.pty->outpaste[0].kind != PTY_SEGMENT_PASTE_END) {
+        pushpastemarker(PTY_SEGMENT_PASTE_END);
+        s.pty->pastesuspended = true;
+      }
+    } else if (!keys && s.pty->pastesuspended) {
+      pushpastemarker(PTY_SEGMENT_PASTE_BEGIN);
+      s.pty->pastesuspended = false;
     }
-    if (FD_ISSET(s.pty->masterfd, &fdread))
-      writelimit = readfrompty();
+    if (!flushpaste()) return;
   }
-  return;
 }
 
-size_t readfrompty(void) {
-  static char readbuf[BUF_SIZE];
-  static int buflen = 0;
-
-  int n = read(s.pty->masterfd, readbuf + buflen, sizeof(readbuf) - buflen);
-  if (n == 0) {
-    s.ui->running = false;
-    return 0;
-  } else if (n == -1) {
-    fprintf(stderr, "tyr: failed to read from shell: %s\n", strerror(errno));
-    exit(1);
+// Records n bytes at the read position of the ring, each read() of the
+// reader thread as a frame of the time it returned. A read whose entry
+// did not fit goes with the next one.
+static void recordoutput(const char* span, size_t n) {
+  pty_data_t* pty = s.pty;
+  if (!s.recorder) return;
+  if (!pty->reads.buf) {
+    record(RECORD_OUTPUT, span, n);
+    return;
+  }
+  size_t pos = atomic_load_explicit(&pty->ring.tail, memory_order_relaxed);
+  while (n > 0) {
+    pty_read_t r = { .end = pos + n, .time = recordclock() };
+    const char* entry;
+    if (ringreadspan(&pty->reads, &entry) >= sizeof(r)) memcpy(&r, entry, sizeof(r));
+    size_t len = MIN(n, r.end - pos);
+    recordat(RECORD_OUTPUT, span, len, r.time);
+    if (pos + len == r.end) ringconsume(&pty->reads, sizeof(r));
+    span += len;
+    pos += len;
+    n -= len;
   }
+}
 
-  buflen += n;
+size_t readfrompty(void) {
+  // Drain the pipe before clearing the flag. A chunk committed before the
+  // flag is cleared found it set and sent nothing, the ring is read below
+  // and has it. One committed after sends a new wakeup that stays in the
+  // pipe. The other way around, a wakeup sent in between would be drained
+  // with the flag left set, and no chunk would wake the main loop again.
+  char dummy[64];
+  while (read(s.pty->notify_pipe[0], dummy, sizeof(dummy)) > 0);
+  atomic_store(&s.pty->notified, false);
 
+  bool eof = atomic_load(&s.pty->eof);
 
-  int i = 0;
-  while (i < buflen) {
-    uint32_t c;
-    int len = utf8decode((const char*)&readbuf[i], &c);
-    if (len < 1 || i + len > buflen) break; // incomplete UTF-8 sequence
-    handlechar(c);
-    i += len;
+  // Bound the work per call, so a child that writes without pause 
+  // cannot starve the window. The main loop calls again while 
+  // ptypending() reports a backlog.
+  size_t total = 0;
+  const char* span;
+  size_t n;
+  while (total < PTY_DRAIN_MAX && (n = ringreadspan(&s.pty->ring, &span)) > 0) {
+    n = MIN(n, PTY_DRAIN_MAX - total);
+    recordoutput(span, n);
+    termparse(span, n);
+    ringconsume(&s.pty->ring, n);
+    total += n;
   }
 
-  // move leftover bytes (incomplete UTF-8) to beginning
-  if (i < buflen)
-    memmove(readbuf, readbuf + i, buflen - i);
-  buflen -= i;
+  if (total > 0 && s.search.active)
+    s.search.stale = true;
 
-  return n;
+  if (eof && !ptypending())
+    s.ui->running = false;
+
+  return total;
+}
+
+bool ptypending(void) {
+  const char* span;
+  return ringreadspan(&s.pty->ring, &span) > 0;
 }
 
 uint32_t
 termhandlecharstream(const char* buf, uint32_t buflen) {
-  uint32_t n = 0;
-  uint32_t charsize = 0;
-  uint32_t codepoint;
-
-  while (n < buflen) {
-    if (lf_flag_exists(&s.termmode, TERM_MODE_UTF8)) {
-      charsize = utf8decode(buf + n, &codepoint); 
-      if (charsize == 0) {
-        break;
-      }
-    } else {
-      codepoint = buf[n] & 0xFF;
-      charsize = 1;
-    }
-    handlechar(codepoint);
-    n += charsize;
-  }
+  termparse(buf, buflen);
+  if (!s.pty) return buflen;
   
   char dummy = 1;
   write(s.pty->notify_pipe[1], &dummy, 1);
 
-  return n;
+  return buflen;
 }
 
 void termwrite(const char* buf, size_t len, bool mayecho) {
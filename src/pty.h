@@ -6,10 +6,22 @@ pty_data_t* setuppty(void);
 
 void* ptyhandler(void* data);
 
+void shutdownpty(pty_data_t* pty);
+
 void writetopty(const char* buf, size_t len);
 
+// Queues buf for the child, taking ownership of it. Wrapped in bracketed
+// paste markers if the application asked for them.
+void termpaste(char* buf, size_t len);
+
+void flushpty(void);
+
+bool ptywritepending(void);
+
 size_t readfrompty(void);
 
+bool ptypending(void);
+
 void termwrite(const char* buf, size_t len, bool mayecho);
 
 uint32_t termhandlecharstream(const char* buf, uint32_t buflen);
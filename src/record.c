@@ -0,0 +1,166 @@
+#include "record.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static void* recordwriter(void* data) {
+  recorder_t* rec = (recorder_t*)data;
+  struct pollfd pfd = { .fd = rec->shutdown_pipe[0], .events = POLLIN };
+  bool stop = false, failed = false;
+
+  while (true) {
+    const char* span;
+    size_t n;
+    while ((n = ringreadspan(&rec->ring, &span)) > 0) {
+      ssize_t written = failed ? (ssize_t)n : write(rec->fd, span, n);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        // Keep draining, so the main loop is not left with a full queue
+        fprintf(stderr, "tyr: failed to write recording: %s\n", strerror(errno));
+        failed = true;
+        continue;
+      }
+      ringconsume(&rec->ring, written);
+    }
+    // Everything queued before the shutdown request is on disk now
+    if (stop) break;
+    if (poll(&pfd, 1, RECORD_FLUSH_MS) > 0) stop = true;
+  }
+  return NULL;
+}
+
+recorder_t* startrecording(const char* path) {
+  recorder_t* rec = aligned_alloc(alignof(recorder_t), sizeof(*rec));
+  if (!rec) {
+    perror("aligned_alloc");
+    return NULL;
+  }
+  memset(rec, 0, sizeof(*rec));
+
+  rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (rec->fd == -1) {
+    perror(path);
+    free(rec);
+    return NULL;
+  }
+  if (write(rec->fd, RECORD_MAGIC, strlen(RECORD_MAGIC)) != (ssize_t)strlen(RECORD_MAGIC)) {
+    perror(path);
+    close(rec->fd);
+    free(rec);
+    return NULL;
+  }
+
+  if (!ringinit(&rec->ring, RECORD_RING_SIZE)) {
+    close(rec->fd);
+    free(rec);
+    return NULL;
+  }
+  // Fault the queue in now rather than on the main loop
+  memset(rec->ring.buf, 0, rec->ring.cap);
+  if (pipe(rec->shutdown_pipe) == -1) {
+    perror("pipe");
+    ringfree(&rec->ring);
+    close(rec->fd);
+    free(rec);
+    return NULL;
+  }
+  rec->start = recordclock();
+
+  if (pthread_create(&rec->thread, NULL, recordwriter, rec) != 0) {
+    perror("pthread_create");
+    close(rec->shutdown_pipe[0]);
+    close(rec->shutdown_pipe[1]);
+    ringfree(&rec->ring);
+    close(rec->fd);
+    free(rec);
+    return NULL;
+  }
+  return rec;
+}
+
+void stoprecording(recorder_t* rec) {
+  char dummy = 1;
+  write(rec->shutdown_pipe[1], &dummy, 1);
+  pthread_join(rec->thread, NULL);
+  close(rec->shutdown_pipe[0]);
+  close(rec->shutdown_pipe[1]);
+  ringfree(&rec->ring);
+  if (rec->dropped) {
+    // The writer is gone, nothing fit after the gap
+    record_frame_t gap = { 
+      .time = recordclock() - rec->start, .len = sizeof(rec->dropped), .kind = RECORD_DROPPED 
+    };
+    if (write(rec->fd, &gap, sizeof(gap)) != sizeof(gap) ||
+      write(rec->fd, &rec->dropped, sizeof(rec->dropped)) != sizeof(rec->dropped))
+      perror("write");
+  }
+  close(rec->fd);
+  if (rec->lost)
+    fprintf(stderr, "tyr: recording is missing %llu bytes, the disk was too slow.\n",
+            (unsigned long long)rec->lost);
+  free(rec);
+}
+
+uint64_t recordclock(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void recordat(record_kind_t kind, const void* data, size_t len, uint64_t time) {
+  recorder_t* rec = s.recorder;
+  if (!rec || !len) return;
+
+  record_frame_t frame = {
+    .time = time - rec->start,
+    .len = len,
+    .kind = kind,
+  };
+  // A replay has to know that its screen may differ from the session
+  record_frame_t gap = { .time = frame.time, .len = sizeof(rec->dropped), .kind = RECORD_DROPPED };
+  size_t gapsize = rec->dropped ? sizeof(gap) + sizeof(rec->dropped) : 0;
+  if (ringspace(&rec->ring) < gapsize + sizeof(frame) + len) {
+    rec->dropped += len;
+    rec->lost += len;
+    return;
+  }
+  if (gapsize) {
+    ringput(&rec->ring, &gap, sizeof(gap));
+    ringput(&rec->ring, &rec->dropped, sizeof(rec->dropped));
+    rec->dropped = 0;
+  }
+  ringput(&rec->ring, &frame, sizeof(frame));
+  ringput(&rec->ring, data, len);
+}
+
+void record(record_kind_t kind, const void* data, size_t len) {
+  if (s.recorder) recordat(kind, data, len, recordclock());
+}
+
+void recordresize(int32_t cols, int32_t rows) {
+  uint32_t size[2] = { cols, rows };
+  record(RECORD_RESIZE, size, sizeof(size));
+}
+
+bool isrecording(const char* buf, size_t len, size_t* off) {
+  size_t magiclen = strlen(RECORD_MAGIC);
+  if (len < magiclen || memcmp(buf, RECORD_MAGIC, magiclen) != 0) return false;
+  *off = magiclen;
+  return true;
+}
+
+const char* nextframe(const char* buf, size_t len, size_t* off, record_frame_t* frame) {
+  if (len - *off < sizeof(*frame)) return NULL;
+  memcpy(frame, buf + *off, sizeof(*frame));
+  if (len - *off - sizeof(*frame) < frame->len) return NULL;
+  const char* data = buf + *off + sizeof(*frame);
+  *off += sizeof(*frame) + frame->len;
+  return data;
+}
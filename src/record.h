@@ -0,0 +1,31 @@
+#pragma once
+
+#include "tyr.h"
+
+// Starts a session recording into path. The pty stream, input and 
+// resizes are queued by the main loop and written by a background 
+// thread, so disk latency never reaches the parser. Output carries the
+// time it was read from the pty, not when the main loop parsed it.
+recorder_t* startrecording(const char* path);
+
+void stoprecording(recorder_t* rec);
+
+// No-ops unless s.recorder is set. Frames that do not fit into the 
+// queue are dropped, never waited for. The next frame that fits is 
+// preceded by a RECORD_DROPPED frame with the number of bytes lost.
+void record(record_kind_t kind, const void* data, size_t len);
+
+// Like record() for a frame that happened at time, from recordclock()
+void recordat(record_kind_t kind, const void* data, size_t len, uint64_t time);
+
+// Nanoseconds of CLOCK_MONOTONIC, safe to call from any thread
+uint64_t recordclock(void);
+
+void recordresize(int32_t cols, int32_t rows);
+
+// Returns true if buf holds a recording and sets *off to the first frame
+bool isrecording(const char* buf, size_t len, size_t* off);
+
+// Reads the frame at *off and advances past it. Returns NULL at the end
+// of the recording or on a truncated frame.
+const char* nextframe(const char* buf, size_t len, size_t* off, record_frame_t* frame);
@@ -4,11 +4,19 @@
 #include <pthread.h>
 #include <runara/runara.h>
 #include <leif/leif.h>
+#include <ctype.h>
 #include <stdatomic.h>
 #include <string.h>
 
 #include "tyr.h"
+#include "render.h"
 #include "term.h"
+#include "coverage.h"
+#include "fallback.h"
+#include "search.h"
+#include "shapecache.h"
+#include "style.h"
+#include "config.h"
 
 #define STB_DS_IMPLEMENTATION
 #include "../vendor/stb_ds.h"
@@ -19,101 +27,38 @@ typedef struct {
   RnHarfbuzzText* hb_text;
 } rendering_range_t;
 
-typedef struct {
-  uint32_t key;
-  char* value;
-} _fallback_family_hm_element;
-  
-static _fallback_family_hm_element* fallback_fonts = NULL; 
-
-char* fallbackfamily(uint32_t unicode) {
-  FcPattern *pattern = FcPatternCreate();
-  FcCharSet *charset = FcCharSetCreate();
-
-  FcCharSetAddChar(charset, unicode);
-  FcPatternAddCharSet(pattern, FC_CHARSET, charset);
-
-  FcConfigSubstitute(NULL, pattern, FcMatchPattern);
-  FcDefaultSubstitute(pattern);
-
-  FcResult result;
-  FcPattern *match = FcFontMatch(NULL, pattern, &result);
-
-  char *font_family = NULL;
-
-  if (match) {
-    FcChar8 *family = NULL;
-    if (FcPatternGetString(match, FC_FAMILY, 0, &family) == FcResultMatch) {
-      font_family = strdup((char*)family); 
-    }
-    FcPatternDestroy(match);
-  }
-
-  FcPatternDestroy(pattern);
-  FcCharSetDestroy(charset);
-
-  return font_family; 
-}
-
-char* getfallbackfamily(uint32_t codepoint) {
-  int index = hmgeti(fallback_fonts, codepoint);
-  if (index >= 0) {
-    return fallback_fonts[index].value;
-  } else {
-    char* family = fallbackfamily(codepoint);
-    if (family) {
-      hmput(fallback_fonts, codepoint, family); // already duplicated inside fallbackfamily
-    }
-    return family;
-  }
-}
-typedef struct {
-  RnTextProps props;
-  float occupied_w;
-} text_props_t;
-
-
-text_props_t rendertextranged(
-  RnState* state, 
+// Appends glyphs [rbegin, rend) of text, shaped with font into hb_text,
+// to glyphs, placed from x on. Returns the width they take up, and in 
+// occupied that of as many glyphs of the primary font.
+static float
+layoutranged(
   const char* text, 
+  uint32_t text_length,
+  RnHarfbuzzText* hb_text,
   RnFont* font, 
-  vec2s pos, 
-  RnColor color, 
-  bool render,
+  float x,
   uint32_t rbegin,
-  int32_t rend,
-  int32_t rowidx) {
-  // Get the harfbuzz text information for the string
-  RnHarfbuzzText* hb_text = rn_hb_text_from_str(state, *font, text);
-
-  // Retrieve highest bearing if 
-  hb_text->highest_bearing = font->size; 
-  vec2s start_pos = (vec2s){.x = pos.x, .y = pos.y};
-
+  uint32_t rend,
+  shaped_glyph_t** glyphs,
+  float* occupied) {
+  RnState* state = s.ui->render_state;
+  float start_x = x;
   float scale = 1.0f;
   float w = 0.0f;
-  float max_top = 0, min_bottom = 0;
-  int32_t charx = 0;
   if (font->selected_strike_size)
     scale = ((float)font->size / (float)font->selected_strike_size);
-  for (uint32_t i = rbegin; i < (rend == -1 ? hb_text->glyph_count : 
-  (uint32_t)rend); i++) {
-    // Get the glyph from the glyph index
-    // If the glyph is not within the font, dont render it
-    if(!hb_text->glyph_info[i].codepoint) {
+  for (uint32_t i = rbegin; i < rend; i++) {
+    uint32_t codepoint = rn_utf8_to_codepoint(text, hb_text->glyph_info[i].cluster, text_length);
+    // If the glyph is not within the font, dont render it. Until its 
+    // fallback font is known, the missing glyph box stands in for it.
+    if(!hb_text->glyph_info[i].codepoint && !fallbackpending(codepoint)) {
       hb_text->glyph_info[i].codepoint = ' ';
     }
-    RnGlyph glyph =  rn_glyph_from_codepoint(
-      state, font,
-      hb_text->glyph_info[i].codepoint); 
-
-    uint32_t text_length = strlen(text);
-    uint32_t codepoint = rn_utf8_to_codepoint(text, hb_text->glyph_info[i].cluster, text_length);
 
     // Advance the x position by the tab width if 
     // we iterate a tab character
     if(codepoint == '\t') {
-      pos.x += font->tab_w * font->space_w;
+      x += font->tab_w * font->space_w;
       continue;
     }
     float x_advance = (hb_text->glyph_pos[i].x_advance / 64.0f) * scale;
@@ -122,82 +67,30 @@ text_props_t rendertextranged(
     }
     float x_offset  = (hb_text->glyph_pos[i].x_offset / 64.0f) * scale;
 
-    vec2s glyph_pos = {
-      .x = pos.x + x_offset,
-      .y = pos.y + hb_text->highest_bearing  
-    };
-    float offset = (pos.y + (hb_text->highest_bearing - glyph.bearing_y)) - pos.y;
-    charx++;
-    if(render) {
-      if(charx == s.cursor.x && rowidx == s.cursor.y) {
-        FT_Face face = s.font.font->face;
-        int line_height = face->size->metrics.height >> 6;
-        int x_advance = face->size->metrics.max_advance >> 6;
-        s.last_cursor_row = rowidx;
-        rn_rect_render(
-          state, 
-          (vec2s){
-            .x = glyph_pos.x + glyph.bearing_x + x_advance, 
-            .y = rowidx * s.font.font->line_h }, 
-          (vec2s)
-            {
-              .x = x_advance, .y = line_height }, 
-          RN_WHITE);
-      }
-      rn_glyph_render(state, glyph, *font, glyph_pos, color);
-    }
-
-    if (glyph.glyph_top + offset > max_top) {
-      max_top = glyph.glyph_top + offset;
-    }
-    if (glyph.glyph_bottom < min_bottom) {
-      min_bottom = glyph.glyph_bottom;
-    }
+    arrput(*glyphs, ((shaped_glyph_t){
+      .font = font,
+      .glyph = rn_glyph_from_codepoint(state, font, hb_text->glyph_info[i].codepoint),
+      .x = x + x_offset,
+    }));
 
     // Advance to the next glyph
-    pos.x += (font->selected_strike_size != 0 ?  x_advance / 2 : x_advance); 
+    x += (font->selected_strike_size != 0 ?  x_advance / 2 : x_advance); 
 
     w += s.fontadvance;
   }
-
-  return (text_props_t){
-    .occupied_w = w,
-    .props = (RnTextProps){
-      .width = pos.x - start_pos.x, 
-      .height = max_top - min_bottom,
-      .paragraph_pos = pos
-    }
-  };
+  *occupied = w;
+  return x - start_x;
 }
 
 static int nrenders = 0;
 
-bool containsnonascii(const char *str) {
-  const unsigned char *p = (const unsigned char *)str;
-  while (*p) {
-    if (*p > 127) return true;
-    p++;
-  }
-  return false;
-}
-
-void rendertextui(
-  lf_ui_state_t* ui,
-  const char* text, 
-  lf_mapped_font_t mapped_font, 
-  vec2s pos, 
-  RnColor color, 
-  bool render,
-  uint32_t rowidx
-) {
-  if (!mapped_font.font) {
-    fprintf(stderr, "tyr: trying to render with unregistered font.\n");
-    return;
-  }
-
+// Shapes text with mapped_font, in ranges of fallback fonts where it 
+// has no glyph, and keeps the result in the shape cache
+static shaped_text_t*
+shapetext(lf_ui_state_t* ui, const char* text, lf_mapped_font_t mapped_font) {
   RnHarfbuzzText* hb_text = rn_hb_text_from_str(ui->render_state, *mapped_font.font, text);
 
-  rendering_range_t rendering_ranges[hb_text->glyph_count];
+  rendering_range_t rendering_ranges[hb_text->glyph_count + 1];
   memset(rendering_ranges, 0, sizeof(rendering_ranges));
 
   uint32_t nranges = 0;
@@ -211,32 +104,27 @@ void rendertextui(
 
   uint32_t text_length = strlen(text);
 
+  const font_coverage_t* mapped_coverage = fontcoverage(mapped_font.font->face);
+  const font_coverage_t* current_coverage = mapped_coverage;
   for (unsigned int i = 0; i < hb_text->glyph_count; i++) {
     hb_glyph_info_t inf = hb_text->glyph_info[i];
     uint32_t unicode_codepoint = rn_utf8_to_codepoint(text, inf.cluster, text_length);
     lf_mapped_font_t current_font = rendering_ranges[iranges].font;
     lf_mapped_font_t next_font = current_font;
+    bool mapped_has = coveragehas(mapped_coverage, unicode_codepoint);
 
-    if (FT_Get_Char_Index(current_font.font->face, unicode_codepoint) == 0
-      || (FT_Get_Char_Index(mapped_font.font->face, unicode_codepoint) != 0 &&
-      current_font.font != mapped_font.font)) {
+    if (!coveragehas(current_coverage, unicode_codepoint)
+      || (mapped_has && current_font.font != mapped_font.font)) {
       // current font cannot render this codepoint
-      if (FT_Get_Char_Index(mapped_font.font->face, unicode_codepoint) != 0) {
+      if (mapped_has) {
         // mapped font can render -> switch back
         next_font = mapped_font;
       } else {
-        // mapped font also cannot render: find fallback
-        const char* fallback_family = getfallbackfamily(unicode_codepoint);
-        if (fallback_family) {
-          lf_mapped_font_t fallback_font = lf_asset_manager_request_font(
-            ui, fallback_family, mapped_font.style.style, 
-            mapped_font.pixel_size);
-
-          if (fallback_font.font) {
-            next_font = fallback_font;
-          } else {
-            fprintf(stderr, "tyr: failed to load fallback font for unicode %u.\n", unicode_codepoint);
-          }
+        // mapped font also cannot render: use the fallback once it is 
+        // known, the worker looks it up meanwhile
+        const lf_mapped_font_t* fallback_font = fallbackfont(unicode_codepoint);
+        if (fallback_font) {
+          next_font = *fallback_font;
         }
       }
 
@@ -247,12 +135,15 @@ void rendertextui(
         rendering_ranges[iranges].font = next_font;
         rendering_ranges[iranges].hb_text = hb_text;
         nranges++;
+        current_coverage = fontcoverage(next_font.font->face);
       }
     }
     rendering_ranges[iranges].end = i + 1;
   }
 
-  float posx = pos.x;
+  static shaped_glyph_t* glyphs = NULL;
+  arrsetlen(glyphs, 0);
+  float posx = 0;
   float spacing = 0;
   for (uint32_t i = 0; i < nranges; i++) {
     rendering_range_t range = rendering_ranges[i];
@@ -261,61 +152,364 @@ void rendertextui(
       spacing = 0;
     }
 
-    text_props_t props = rendertextranged(
-      ui->render_state, text, range.font.font,
-      (vec2s){.x = posx, .y = pos.y},
-      color, render, range.begin, range.end,
-      rowidx
-    );
+    // Fallback fonts have their own glyph ids, the text is shaped again
+    RnHarfbuzzText* range_hb = range.font.font == mapped_font.font ? hb_text :
+      rn_hb_text_from_str(ui->render_state, *range.font.font, text);
+    float occupied;
+    float width = layoutranged(text, text_length, range_hb, range.font.font, posx, 
+                               range.begin, range.end, &glyphs, &occupied);
 
-    posx += props.props.width;
+    posx += width;
     if (range.font.font != mapped_font.font) {
-      spacing += props.occupied_w - props.props.width;
+      spacing += occupied - width;
     }
   }
+  return shapecacheput(text, mapped_font.font, glyphs, arrlenu(glyphs));
 }
 
+// Draws text at pos. Text that was drawn recently with the same font is
+// not shaped again, TUIs redraw the same rows over and over.
+void rendertextui(
+  lf_ui_state_t* ui,
+  const char* text, 
+  lf_mapped_font_t mapped_font, 
+  vec2s pos, 
+  RnColor color
+) {
+  if (!mapped_font.font) {
+    fprintf(stderr, "tyr: trying to render with unregistered font.\n");
+    return;
+  }
+  shaped_text_t* shaped = shapecacheget(text, mapped_font.font);
+  if (!shaped) 
+    shaped = shapetext(ui, text, mapped_font);
+  for (uint32_t i = 0; i < shaped->nglyphs; i++) {
+    const shaped_glyph_t* g = &shaped->glyphs[i];
+    rn_glyph_render(ui->render_state, g->glyph, *g->font, 
+                    (vec2s){ .x = pos.x + g->x, .y = pos.y + g->font->size }, color);
+  }
+}
 
-void 
-renderterminalrows(void) {
-  float y = 0;
-  for (uint32_t i = 0; i < (uint32_t)s.rows; i++) {
-    if (s.dirty[i] == 0) {
-      y += s.font.font->line_h;
-      continue;
+
+static int32_t
+cellwidth(void) {
+  return s.font.font->face->size->metrics.max_advance >> 6;
+}
+
+// Highlights the search matches of a row inside columns [from, to)
+static void
+rendersearchmatches(uint32_t rowidx, float y, int32_t from, int32_t to) {
+  search_match_t matches[64];
+  size_t n = searchlinematches(searchlineofrow(rowidx), matches, 64);
+  if (!n) return;
+  int line_height = s.font.font->face->size->metrics.height >> 6;
+  for (size_t i = 0; i < n; i++) {
+    int32_t begin = MAX(matches[i].col, from);
+    int32_t end = MIN(matches[i].col + matches[i].len, to);
+    if (begin >= end) continue;
+    rn_rect_render(
+      s.ui->render_state,
+      (vec2s){ .x = begin * cellwidth(), .y = y },
+      (vec2s){ .x = (end - begin) * cellwidth(), .y = line_height },
+      matches[i].line == s.search.current ? SEARCH_CURRENT_COLOR : SEARCH_MATCH_COLOR);
+  }
+}
+
+// The search prompt takes the place of the last row while typing
+static void
+rendersearchprompt(float y) {
+  char prompt[SEARCH_QUERY_SIZE * 2];
+  searchprompt(prompt, sizeof(prompt));
+  rendertextui(s.ui, prompt, s.font, (vec2s){.x = 0, .y = y}, RN_WHITE);
+}
+
+uint32_t
+damagedareas(lf_container_t* areas, float width) {
+  if (s.search.editing)
+    setdirty(s.rows - 1, true);
+
+  uint32_t nareas = 0;
+  int32_t line_h = s.font.font->line_h;
+  damage_t prev = { .mincol = INT32_MAX, .maxcol = -1 };
+  for (int32_t i = 0; i < s.rows; i++) {
+    damage_t* d = &s.damage[i];
+    if (d->maxcol >= d->mincol) {
+      // Never start or end a span inside a wide character
+      cell_t* cells = getviewrow(i);
+      if (d->mincol > 0 && cells[d->mincol].widedummy) d->mincol--;
+      if (d->maxcol < s.cols - 1 && cells[d->maxcol].wide) d->maxcol++;
+      // The last column reaches to the window edge, glyphs may overhang
+      float x = d->mincol * cellwidth();
+      float w = d->maxcol == s.cols - 1 ? width - x : (d->maxcol + 1) * cellwidth() - x;
+      if (nareas && prev.mincol == d->mincol && prev.maxcol == d->maxcol &&
+          areas[nareas - 1].pos.y + areas[nareas - 1].size.y == i * line_h) {
+        areas[nareas - 1].size.y += line_h;
+      } else {
+        areas[nareas++] = (lf_container_t){
+          .pos = (vec2s){ .x = x, .y = i * line_h },
+          .size = (vec2s){ .x = w, .y = line_h },
+        };
+      }
     }
+    prev = *d;
+  }
+  return nareas;
+}
 
-    char* row = s.rowsunicode[i]; 
-    char* ptr = row;
-    for (int32_t j = 0; j < s.cols; j++)
-      ptr += utf8encode(s.cells[i * s.cols + j].codepoint, ptr);
-    *ptr = '\0';
+static const uint32_t palette16[16] = TERM_PALETTE;
 
-    rendertextui(s.ui, row, s.font, (vec2s){.x = 0, .y = y}, RN_WHITE, true, i);
+static RnColor
+rgbcolor(uint32_t rgb) {
+  return (RnColor){ (rgb >> 16) & 0xff, (rgb >> 8) & 0xff, rgb & 0xff, 255 };
+}
 
-    y += s.font.font->line_h;
-    s.dirty[i] = 0;
+// 0xRRGGBB of a style color, def for the default color
+static uint32_t
+resolvecolor(uint32_t color, uint32_t def) {
+  if (COLOR_KIND(color) == COLOR_RGB) return COLOR_VALUE(color);
+  if (COLOR_KIND(color) != COLOR_PALETTE) return def;
+  uint32_t i = COLOR_VALUE(color) & 0xff;
+  if (i < 16) return palette16[i];
+  if (i >= 232) {
+    uint32_t v = 8 + (i - 232) * 10;
+    return v << 16 | v << 8 | v;
   }
-  nrenders = 0;
+  static const uint8_t levels[6] = { 0, 95, 135, 175, 215, 255 };
+  i -= 16;
+  return levels[i / 36] << 16 | levels[(i / 6) % 6] << 8 | levels[i % 6];
 }
 
+run_colors_t
+stylecolors(const style_t* st) {
+  uint32_t fgcolor = st->fg;
+  // Bold makes the first 8 colors bright
+  if ((st->attrs & FONT_BOLD) && COLOR_KIND(fgcolor) == COLOR_PALETTE && 
+    COLOR_VALUE(fgcolor) < 8)
+    fgcolor += CLR_BRIGHT_BLACK;
+  uint32_t fg = resolvecolor(fgcolor, TERM_FOREGROUND);
+  uint32_t bg = resolvecolor(st->bg, TERM_BACKGROUND);
+  bool hasbg = st->bg != COLOR_DEFAULT;
+  if (st->attrs & FONT_REVERSE) {
+    uint32_t tmp = fg;
+    fg = bg;
+    bg = tmp;
+    hasbg = true;
+  }
+  if (st->attrs & FONT_DIM) {
+    // Halfway to the background
+    fg = (((fg >> 1) & 0x7f7f7f) + ((bg >> 1) & 0x7f7f7f));
+  }
+  return (run_colors_t){
+    .fg = fg, .bg = bg, .hasbg = hasbg, .hidden = st->attrs & FONT_HIDDEN,
+    .ul = st->ulcolor == COLOR_DEFAULT ? fg : resolvecolor(st->ulcolor, fg),
+  };
+}
 
-void renderterminalrows_range(uint32_t from, uint32_t to) {
-  float y = from * s.font.font->line_h;
-  for (uint32_t i = from; i <= to; i++) {
+FT_Face glyphface(FT_Face face, uint32_t codepoint, bool* pending) {
+  *pending = false;
+  if (fonthas(face, codepoint)) return face;
+  if (!s.ui) return NULL;
+  const lf_mapped_font_t* fallback = fallbackfont(codepoint);
+  if (fallback) return fallback->font->face;
+  *pending = fallbackpending(codepoint);
+  return NULL;
+}
 
-    char* row = s.rowsunicode[i]; 
-    char* ptr = row;
-    for (int32_t j = 0; j < s.cols; j++)
-      ptr += utf8encode(s.cells[i * s.cols + j].codepoint, ptr);
+void glyphalpha(const FT_Bitmap* bm, uint8_t* out) {
+  for (uint32_t y = 0; y < bm->rows; y++) {
+    const uint8_t* src = bm->buffer + (ptrdiff_t)y * bm->pitch;
+    uint8_t* dst = out + (size_t)y * bm->width;
+    for (uint32_t x = 0; x < bm->width; x++) {
+      switch (bm->pixel_mode) {
+        case FT_PIXEL_MODE_MONO: dst[x] = (src[x >> 3] >> (7 - (x & 7))) & 1 ? 255 : 0; break;
+        // Color glyphs are drawn in the text color
+        case FT_PIXEL_MODE_BGRA: dst[x] = src[x * 4 + 3]; break;
+        default:                 dst[x] = src[x]; break;
+      }
+    }
+  }
+}
+
+// Cells [begin, end) of a row that share a style
+typedef struct {
+  int32_t begin, end;
+  uint32_t style;
+} style_run_t;
+
+static uint32_t
+stylerunsof(const cell_t* cells, int32_t from, int32_t to, style_run_t* runs) {
+  uint32_t nruns = 0;
+  for (int32_t x = from; x < to; x++) {
+    if (nruns && runs[nruns - 1].style == cells[x].style) {
+      runs[nruns - 1].end = x + 1;
+    } else {
+      runs[nruns++] = (style_run_t){ .begin = x, .end = x + 1, .style = cells[x].style };
+    }
+  }
+  return nruns;
+}
+
+// Lines over, through and under a run
+static void
+renderdecorations(const style_t* st, const run_colors_t* c, float x, float y, float w) {
+  int32_t line_h = s.font.font->line_h;
+  float thick = MAX(line_h / 16, 1);
+  float baseline = y + s.font.font->size;
+  RnState* state = s.ui->render_state;
+  if (st->underline != UNDERLINE_NONE) {
+    // Curly, dotted and dashed underlines are drawn as straight ones
+    rn_rect_render(state, (vec2s){ .x = x, .y = baseline + thick }, 
+                   (vec2s){ .x = w, .y = thick }, rgbcolor(c->ul));
+    if (st->underline == UNDERLINE_DOUBLE)
+      rn_rect_render(state, (vec2s){ .x = x, .y = baseline + 3 * thick }, 
+                     (vec2s){ .x = w, .y = thick }, rgbcolor(c->ul));
+  }
+  if (st->attrs & FONT_STRIKETHROUGH)
+    rn_rect_render(state, (vec2s){ .x = x, .y = y + line_h / 2.0f }, 
+                   (vec2s){ .x = w, .y = thick }, rgbcolor(c->fg));
+  if (st->attrs & FONT_OVERLINED)
+    rn_rect_render(state, (vec2s){ .x = x, .y = y }, 
+                   (vec2s){ .x = w, .y = thick }, rgbcolor(c->fg));
+}
+
+// Glyphs of printable ASCII in the primary font, looked up once
+static struct {
+  RnFont* font;
+  RnGlyph glyphs[128];
+  uint32_t ids[128]; // 0 if the font has none
+  bool known[128];
+} asciiglyphs;
+
+static uint32_t
+asciiglyphid(uint32_t c) {
+  RnFont* font = s.font.font;
+  if (asciiglyphs.font != font) {
+    memset(&asciiglyphs, 0, sizeof(asciiglyphs));
+    asciiglyphs.font = font;
+  }
+  if (!asciiglyphs.known[c]) {
+    asciiglyphs.ids[c] = FT_Get_Char_Index(font->face, c);
+    if (asciiglyphs.ids[c])
+      asciiglyphs.glyphs[c] = rn_glyph_from_codepoint(s.ui->render_state, font, asciiglyphs.ids[c]);
+    asciiglyphs.known[c] = true;
+  }
+  return asciiglyphs.ids[c];
+}
+
+// Punctuation is what fonts join into ligatures, like -> or !=
+static bool
+joinable(uint32_t c) {
+  return c < 0x80 && ispunct(c);
+}
+
+// Whether cell x of [begin, end) can go straight onto the cell grid: 
+// printable ASCII the primary font has, with nothing next to it that
+// shaping could join it with or put a combining mark on it
+static bool
+placeable(const cell_t* cells, int32_t x, int32_t begin, int32_t end) {
+  uint32_t c = cells[x].codepoint;
+  if (c <= ' ' || c >= 0x7f) return false;
+  if (x + 1 < end && cells[x + 1].codepoint >= 0x80) return false;
+  if (joinable(c) && ((x > begin && joinable(cells[x - 1].codepoint)) || 
+    (x + 1 < end && joinable(cells[x + 1].codepoint)))) 
+    return false;
+  return asciiglyphid(c) != 0;
+}
+
+// Text of a run: placeable cells are drawn at their column from the 
+// glyph table, everything in between is shaped with HarfBuzz.
+static void
+renderruntext(const cell_t* cells, const style_run_t* run, uint32_t rowidx, float y, 
+              RnColor color) {
+  RnFont* font = s.font.font;
+  float cw = cellwidth();
+  // Bitmap fonts are scaled while shaping
+  bool grid = !font->selected_strike_size;
+  char* text = s.rowsunicode[rowidx];
+  int32_t x = run->begin;
+  while (x < run->end) {
+    if (cells[x].codepoint == ' ') {
+      x++;
+      continue;
+    }
+    if (grid && placeable(cells, x, run->begin, run->end)) {
+      rn_glyph_render(s.ui->render_state, asciiglyphs.glyphs[cells[x].codepoint], *font, 
+                      (vec2s){ .x = x * cw, .y = y + font->size }, color);
+      x++;
+      continue;
+    }
+    int32_t start = x;
+    char* ptr = text;
+    while (x < run->end && !(grid && placeable(cells, x, run->begin, run->end))) 
+      ptr += utf8encode(cells[x++].codepoint, ptr);
     *ptr = '\0';
+    rendertextui(s.ui, text, s.font, (vec2s){ .x = start * cw, .y = y }, color);
+  }
+}
+
+// A span of a row is drawn in layers: one rectangle per run of equal 
+// background, search matches, the cursor, then per style run its text
+// in one call and its decorations. The number of draw calls grows with
+// the number of runs, not of cells.
+static void
+renderrowspan(uint32_t rowidx, float y, int32_t from, int32_t to) {
+  cell_t* cells = getviewrow(rowidx);
+  style_run_t runs[to - from];
+  uint32_t nruns = stylerunsof(cells, from, to, runs);
+  run_colors_t colors[nruns];
+  for (uint32_t r = 0; r < nruns; r++) 
+    colors[r] = stylecolors(getstyle(runs[r].style));
+
+  int32_t line_h = s.font.font->line_h;
+  float cw = cellwidth();
+  RnState* state = s.ui->render_state;
+  for (uint32_t r = 0; r < nruns; r++) {
+    if (!colors[r].hasbg) continue;
+    // Neighbouring runs that only differ in their text are merged
+    uint32_t last = r;
+    while (last + 1 < nruns && colors[last + 1].hasbg && colors[last + 1].bg == colors[r].bg) 
+      last++;
+    rn_rect_render(state, (vec2s){ .x = runs[r].begin * cw, .y = y }, 
+                   (vec2s){ .x = (runs[last].end - runs[r].begin) * cw, .y = line_h }, 
+                   rgbcolor(colors[r].bg));
+    r = last;
+  }
+
+  rendersearchmatches(rowidx, y, from, to);
 
-    rendertextui(s.ui, row, s.font, (vec2s){.x = 0, .y = y}, RN_WHITE, true, i);
+  if ((int32_t)rowidx == s.cursor.y + s.viewoffset && s.cursor.x >= from && s.cursor.x < to) {
+    s.last_cursor_row = rowidx;
+    s.last_cursor_col = s.cursor.x;
+    rn_rect_render(state, (vec2s){ .x = s.cursor.x * cw, .y = y }, 
+                   (vec2s){ .x = cw, .y = s.font.font->face->size->metrics.height >> 6 }, 
+                   RN_WHITE);
+  }
 
-    y += s.font.font->line_h;
+  for (uint32_t r = 0; r < nruns; r++) {
+    const style_t* st = getstyle(runs[r].style);
+    renderdecorations(st, &colors[r], runs[r].begin * cw, y, 
+                      (runs[r].end - runs[r].begin) * cw);
+    if (!colors[r].hidden) 
+      renderruntext(cells, &runs[r], rowidx, y, rgbcolor(colors[r].fg));
   }
 }
 
+void 
+renderterminalrows(void) {
+  float y = 0;
+  for (uint32_t i = 0; i < (uint32_t)s.rows; i++, y += s.font.font->line_h) {
+    damage_t d = s.damage[i];
+    if (d.maxcol < d.mincol) continue;
+    setdirty(i, false);
+    if (s.search.editing && i == (uint32_t)s.rows - 1) {
+      rendersearchprompt(y);
+      break;
+    }
+    renderrowspan(i, y, d.mincol, d.maxcol + 1);
+  }
+  nrenders = 0;
+}
+
 void 
 taskrender(void* data) {
   lf_ui_state_t* ui = ((task_data_t*)data)->ui;
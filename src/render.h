@@ -2,9 +2,32 @@
 
 #include <leif/leif.h>
 
+#include "tyr.h"
+
 void renderterminalrows(void);
 
-void renderterminalrows_range(uint32_t from, uint32_t to);
+// What a style looks like, bg is only drawn if it differs from the 
+// window background
+typedef struct {
+  uint32_t fg, bg, ul;
+  bool hasbg, hidden;
+} run_colors_t;
+
+run_colors_t stylecolors(const style_t* st);
+
+// Face that draws codepoint without shaping: face if it has a glyph for
+// it, else its fallback. NULL if there is none, or while the fallback is
+// still looked up, which sets pending. Without a window there are no 
+// fallback fonts.
+FT_Face glyphface(FT_Face face, uint32_t codepoint, bool* pending);
+
+// Coverage of a rendered glyph as 8 bit alpha into out, which has room
+// for width x rows bytes, whatever pixel mode FreeType rendered it in
+void glyphalpha(const FT_Bitmap* bm, uint8_t* out);
+
+// Screen areas of the damaged row spans, rows with the same span are
+// merged. areas needs room for one per row. Returns their count.
+uint32_t damagedareas(lf_container_t* areas, float width);
 
 void taskrender(void* data);
 
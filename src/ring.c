@@ -0,0 +1,75 @@
+#include "ring.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool ringinit(ringbuf_t* ring, size_t cap) {
+  if (cap & (cap - 1)) {
+    fprintf(stderr, "tyr: ring buffer size %zu is not a power of two.\n", cap);
+    return false;
+  }
+  ring->buf = malloc(cap);
+  if (!ring->buf) {
+    perror("malloc");
+    return false;
+  }
+  ring->cap = cap;
+  atomic_init(&ring->head, 0);
+  atomic_init(&ring->tail, 0);
+  return true;
+}
+
+void ringfree(ringbuf_t* ring) {
+  free(ring->buf);
+  ring->buf = NULL;
+  ring->cap = 0;
+}
+
+size_t ringwritespan(ringbuf_t* ring, char** ptr) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  size_t off = head & (ring->cap - 1);
+  size_t free = ring->cap - (head - tail);
+  size_t untilwrap = ring->cap - off;
+  *ptr = ring->buf + off;
+  return free < untilwrap ? free : untilwrap;
+}
+
+void ringcommit(ringbuf_t* ring, size_t n) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_store_explicit(&ring->head, head + n, memory_order_release);
+}
+
+size_t ringspace(ringbuf_t* ring) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  return ring->cap - (head - tail);
+}
+
+bool ringput(ringbuf_t* ring, const void* data, size_t len) {
+  size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+  if (ring->cap - (head - tail) < len) return false;
+  size_t off = head & (ring->cap - 1);
+  size_t first = ring->cap - off < len ? ring->cap - off : len;
+  memcpy(ring->buf + off, data, first);
+  memcpy(ring->buf, (const char*)data + first, len - first);
+  atomic_store_explicit(&ring->head, head + len, memory_order_release);
+  return true;
+}
+
+size_t ringreadspan(ringbuf_t* ring, const char** ptr) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+  size_t off = tail & (ring->cap - 1);
+  size_t used = head - tail;
+  size_t untilwrap = ring->cap - off;
+  *ptr = ring->buf + off;
+  return used < untilwrap ? used : untilwrap;
+}
+
+void ringconsume(ringbuf_t* ring, size_t n) {
+  size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  atomic_store_explicit(&ring->tail, tail + n, memory_order_release);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Lock-free single producer, single consumer byte ring. head and tail
+// count all bytes ever written and read, the capacity is a power of two.
+typedef struct {
+  char* buf;
+  size_t cap;
+  alignas(64) _Atomic size_t head;
+  alignas(64) _Atomic size_t tail;
+} ringbuf_t;
+
+bool ringinit(ringbuf_t* ring, size_t cap);
+
+void ringfree(ringbuf_t* ring);
+
+// Producer side: contiguous free space at the write position and
+// publishing n bytes written into it.
+size_t ringwritespan(ringbuf_t* ring, char** ptr);
+
+void ringcommit(ringbuf_t* ring, size_t n);
+
+// Free bytes in total, possibly split by the wrap
+size_t ringspace(ringbuf_t* ring);
+
+// Copies len bytes in, across the wrap if needed, and publishes them 
+// at once. Writes nothing and returns false if they do not fit.
+bool ringput(ringbuf_t* ring, const void* data, size_t len);
+
+// Consumer side: contiguous readable bytes at the read position and
+// releasing n of them back to the producer.
+size_t ringreadspan(ringbuf_t* ring, const char** ptr);
+
+void ringconsume(ringbuf_t* ring, size_t n);
@@ -0,0 +1,808 @@
+#define _GNU_SOURCE
+#include "scrollback.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef TYR_LZ4
+#include <lz4.h>
+#endif
+
+#include "term.h"
+#include "config.h"
+#include "../vendor/stb_ds.h"
+
+// Encoded line: u16 cell count with LINE_WRAPPED set if the text goes
+// on in the next line, u16 run count, runs of 
+// { u16 length, u32 style id }, then one UTF-8 encoded codepoint per 
+// cell. A run with RUN_WIDE set in its length is made of wide characters,
+// each followed by the cell it covers.
+#define RUN_SIZE 6
+#define LINE_WRAPPED 0x8000
+#define RUN_WIDE 0x8000
+
+// The spill file is mapped in chunks, blocks never cross a chunk
+#define SPILL_CHUNK (64 << 20)
+
+// Room for more blocks than the history ever holds
+#define SPILL_QUEUE_SIZE (4096 * sizeof(cold_block_t*))
+
+// The search thread reads sealed blocks through scrollbackcopyblock(),
+// every public function here holds this lock.
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Stands in for every line of a block that cannot be read back: one
+// U+FFFD, as encodeline() stores it
+static const uint8_t badline[] = { 1, 0, 1, 0, 1, 0, 0, 0, 0, 0, 0xEF, 0xBF, 0xBD };
+
+static bool sameattrs(const cell_t* a, const cell_t* b) {
+  return a->style == b->style;
+}
+
+static bool isblankcell(const cell_t* c) {
+  return c->codepoint == ' ' && c->style == 0 && !c->widedummy;
+}
+
+// A wide character together with the cell it covers
+static bool iswidepair(const cell_t* row, int32_t i, int32_t n) {
+  return row[i].wide && i + 1 < n && row[i + 1].widedummy;
+}
+
+// End of the run that starts at cell i. A wide character whose other 
+// half was overwritten is kept as a narrow one.
+static int32_t runend(const cell_t* row, int32_t i, int32_t n) {
+  bool wide = iswidepair(row, i, n);
+  int32_t j = i + (wide ? 2 : 1);
+  while (j < n && sameattrs(&row[j], &row[i]) && iswidepair(row, j, n) == wide) 
+    j += wide ? 2 : 1;
+  return j;
+}
+
+static void put16(uint8_t* p, uint16_t v) {
+  p[0] = v & 0xff;
+  p[1] = v >> 8;
+}
+
+static uint16_t get16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+  put16(p, v & 0xffff);
+  put16(p + 2, v >> 16);
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+static size_t encodeline(const cell_t* row, int32_t cols, uint8_t** data) {
+  // A wrapped line keeps its blanks, they are part of the text when it
+  // is joined with the next one
+  int32_t n = cols;
+  while (n > 0 && !row[cols - 1].wrapped && isblankcell(&row[n - 1])) n--;
+
+  uint16_t nruns = 0;
+  for (int32_t i = 0; i < n; i = runend(row, i, n)) nruns++;
+
+  size_t start = arrlen(*data);
+  // Worst case, every codepoint takes four bytes
+  uint8_t* p = arraddnptr(*data, 4 + nruns * RUN_SIZE + n * 4);
+  put16(p, n | (row[cols - 1].wrapped ? LINE_WRAPPED : 0));
+  put16(p + 2, nruns);
+  p += 4;
+  for (int32_t i = 0; i < n;) {
+    int32_t j = runend(row, i, n);
+    put16(p, (j - i) | (iswidepair(row, i, n) ? RUN_WIDE : 0));
+    put32(p + 2, row[i].style);
+    p += RUN_SIZE;
+    i = j;
+  }
+  for (int32_t i = 0; i < n; i++) {
+    uint32_t c = row[i].codepoint;
+    if (c < 0x80) *p++ = c;
+    else p += utf8encode(c, (char*)p);
+  }
+
+  arrsetlen(*data, p - *data);
+  return arrlen(*data) - start;
+}
+
+// The text was written by utf8encode(), so it is well-formed
+static uint32_t nextcodepoint(const uint8_t** p) {
+  const uint8_t* s = *p;
+  uint32_t c;
+  if (s[0] < 0x80) {
+    c = s[0];
+    *p += 1;
+  } else if (s[0] < 0xE0) {
+    c = (s[0] & 0x1F) << 6 | (s[1] & 0x3F);
+    *p += 2;
+  } else if (s[0] < 0xF0) {
+    c = (s[0] & 0x0F) << 12 | (s[1] & 0x3F) << 6 | (s[2] & 0x3F);
+    *p += 3;
+  } else {
+    c = (s[0] & 0x07) << 18 | (s[1] & 0x3F) << 12 | (s[2] & 0x3F) << 6 | (s[3] & 0x3F);
+    *p += 4;
+  }
+  return c;
+}
+
+static void decodeline(const uint8_t* p, cell_t* out, int32_t cols) {
+  int32_t n = get16(p) & ~LINE_WRAPPED;
+  bool wrapped = get16(p) & LINE_WRAPPED;
+  uint16_t nruns = get16(p + 2);
+  const uint8_t* runs = p + 4;
+  const uint8_t* text = runs + nruns * RUN_SIZE;
+
+  int32_t x = 0;
+  for (uint16_t r = 0; r < nruns; r++, runs += RUN_SIZE) {
+    cell_t attrs = { .style = get32(runs + 2) };
+    bool wide = get16(runs) & RUN_WIDE;
+    for (uint16_t i = 0; i < (get16(runs) & ~RUN_WIDE); i++, x++) {
+      uint32_t c = nextcodepoint(&text);
+      if (x < cols) {
+        out[x] = attrs;
+        out[x].codepoint = c;
+        // Unless the line is cut between the two halves
+        out[x].wide = wide && !(i & 1) && x + 1 < cols;
+        out[x].widedummy = wide && (i & 1);
+      }
+    }
+  }
+  for (x = MIN(n, cols); x < cols; x++) 
+    out[x] = (cell_t){ .codepoint = ' ' };
+  if (cols > 0) out[cols - 1].wrapped = wrapped;
+}
+
+static size_t blockmemory(const cold_block_t* b) {
+  if (b->spilled) return sizeof(*b);
+  return sizeof(*b) + (b->sealed ? b->size : (size_t)arrcap(b->data));
+}
+
+static bool openspill(void) {
+  const char* dir = getenv("TMPDIR");
+  if (!dir) dir = "/tmp";
+  int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    // Not every file system supports O_TMPFILE
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/tyr-scrollback-XXXXXX", dir);
+    fd = mkstemp(path);
+    if (fd != -1) unlink(path);
+  }
+  if (fd == -1) {
+    fprintf(stderr, "tyr: cannot create scrollback file in %s: %s\n", dir, strerror(errno));
+    return false;
+  }
+  s.scrollback.spillfd = fd;
+  return true;
+}
+
+// Blocks are dropped oldest first
+static bool wasdropped(const cold_block_t* b) {
+  scrollback_t* sb = &s.scrollback;
+  return !arrlen(sb->blocks) || b->id < sb->blocks[0]->id;
+}
+
+// Runs with the history unlocked, the data of a queued block does not
+// change and is only freed here. A block dropped before or while it was
+// written is freed here too.
+static void writeblock(cold_block_t* b) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+  bool ok = !wasdropped(b);
+  pthread_mutex_unlock(&lock);
+  bool written = ok;
+  for (uint32_t done = 0; ok && done < b->size;) {
+    ssize_t n = pwrite(sb->spillfd, b->data + done, b->size - done, b->fileoff + done);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "tyr: failed to write scrollback file: %s\n", strerror(errno));
+      ok = false;
+      break;
+    }
+    done += n;
+  }
+
+  pthread_mutex_lock(&lock);
+  if (wasdropped(b)) {
+    if (written)
+      fallocate(sb->spillfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, b->fileoff, b->size);
+    free(b->data);
+    free(b);
+  } else {
+    // A block that failed to write stays in memory
+    sb->spillpending -= b->size;
+    b->spilling = false;
+    if (ok) {
+      sb->bytes -= blockmemory(b);
+      free(b->data);
+      b->data = NULL;
+      b->spilled = true;
+      sb->spilledbytes += b->size;
+      sb->bytes += blockmemory(b);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void* spillwriter(void* data) {
+  scrollback_t* sb = (scrollback_t*)data;
+  struct pollfd pfd = { .fd = sb->spillwake[0], .events = POLLIN };
+  bool stop = false;
+
+  while (true) {
+    const char* span;
+    while (ringreadspan(&sb->spillqueue, &span) >= sizeof(cold_block_t*)) {
+      cold_block_t* b;
+      memcpy(&b, span, sizeof(b));
+      writeblock(b);
+      ringconsume(&sb->spillqueue, sizeof(b));
+    }
+    // Everything queued before the write end was closed is written now
+    if (stop) break;
+    poll(&pfd, 1, -1);
+    char dummy[64];
+    if (read(sb->spillwake[0], dummy, sizeof(dummy)) == 0) stop = true;
+  }
+  return NULL;
+}
+
+static bool startspill(void) {
+  scrollback_t* sb = &s.scrollback;
+  if (sb->spillfd < 0 && !openspill()) return false;
+  if (!ringinit(&sb->spillqueue, SPILL_QUEUE_SIZE)) return false;
+  if (pipe2(sb->spillwake, O_CLOEXEC | O_NONBLOCK) == -1) {
+    perror("pipe");
+    ringfree(&sb->spillqueue);
+    return false;
+  }
+  if (pthread_create(&sb->spillthread, NULL, spillwriter, sb) != 0) {
+    perror("pthread_create");
+    close(sb->spillwake[0]);
+    close(sb->spillwake[1]);
+    ringfree(&sb->spillqueue);
+    return false;
+  }
+  sb->spillstarted = true;
+  return true;
+}
+
+// Waits for the queued blocks to be written. Called without the lock,
+// the writer takes it for every block.
+static void stopspill(void) {
+  scrollback_t* sb = &s.scrollback;
+  if (!sb->spillstarted) return;
+  close(sb->spillwake[1]);
+  pthread_join(sb->spillthread, NULL);
+  close(sb->spillwake[0]);
+  ringfree(&sb->spillqueue);
+  sb->spillstarted = false;
+}
+
+// Picks the place of a sealed block in the spill file and hands it to
+// the writer, the block counts as spilled once it is written.
+static bool spillblock(cold_block_t* b) {
+  scrollback_t* sb = &s.scrollback;
+  if (!sb->spillstarted && !startspill()) return false;
+
+  uint64_t off = sb->spillend;
+  if (off / SPILL_CHUNK != (off + b->size - 1) / SPILL_CHUNK)
+    off = (off / SPILL_CHUNK + 1) * SPILL_CHUNK;
+  b->fileoff = off;
+  b->spilling = true;
+  if (!ringput(&sb->spillqueue, &b, sizeof(b))) {
+    b->spilling = false;
+    return false;
+  }
+  sb->spillend = off + b->size;
+  sb->spillpending += b->size;
+  char dummy = 1;
+  write(sb->spillwake[1], &dummy, 1);
+  return true;
+}
+
+// Only the first one is logged, the rest would repeat it on every redraw
+static void unreadable(const cold_block_t* b, const char* why) {
+  static bool logged = false;
+  if (logged) return;
+  logged = true;
+  fprintf(stderr, "tyr: cannot read scrollback block %lu (%s), its lines are shown as U+FFFD.\n",
+          (unsigned long)b->id, why);
+}
+
+// NULL if the chunk of the file cannot be mapped
+static const uint8_t* spilleddata(cold_block_t* b) {
+  scrollback_t* sb = &s.scrollback;
+  size_t chunk = b->fileoff / SPILL_CHUNK;
+  while ((size_t)arrlen(sb->spillmaps) <= chunk) arrput(sb->spillmaps, NULL);
+  if (!sb->spillmaps[chunk]) {
+    // Pages are read in on first access and can be dropped again by the 
+    // kernel, they are clean once written back.
+    void* map = mmap(NULL, SPILL_CHUNK, PROT_READ, MAP_SHARED, sb->spillfd, 
+                     (off_t)chunk * SPILL_CHUNK);
+    if (map == MAP_FAILED) {
+      unreadable(b, strerror(errno));
+      return NULL;
+    }
+    sb->spillmaps[chunk] = map;
+  }
+  return sb->spillmaps[chunk] + b->fileoff % SPILL_CHUNK;
+}
+
+static void dropblock(cold_block_t* b) {
+  scrollback_t* sb = &s.scrollback;
+  sb->bytes -= blockmemory(b);
+  sb->nlines -= b->nlines;
+  sb->firstline += b->nlines;
+  if (b->spilling) {
+    // The writer frees it once it is done with it
+    sb->spillpending -= b->size;
+    return;
+  }
+  if (b->spilled) {
+    sb->spilledbytes -= b->size;
+    // Give the disk space back, the file only ever grows at the end
+    fallocate(sb->spillfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 
+              b->fileoff, b->size);
+  } else if (b->sealed) {
+    free(b->data);
+  } else {
+    arrfree(b->data);
+  }
+  free(b);
+}
+
+// Full blocks are immutable, they are compressed or at least shrunk to
+// their size.
+static void sealblock(cold_block_t* b) {
+  scrollback_t* sb = &s.scrollback;
+  sb->bytes -= blockmemory(b);
+  b->rawsize = arrlen(b->data);
+  uint8_t* data = NULL;
+#ifdef TYR_LZ4
+  int bound = LZ4_compressBound(b->rawsize);
+  data = malloc(bound);
+  int size = LZ4_compress_default((const char*)b->data, (char*)data, b->rawsize, bound);
+  if (size > 0 && (uint32_t)size < b->rawsize) {
+    data = realloc(data, size);
+    b->size = size;
+  } else {
+    free(data);
+    data = NULL;
+  }
+#endif
+  if (!data) {
+    data = malloc(b->rawsize);
+    memcpy(data, b->data, b->rawsize);
+    b->size = b->rawsize;
+  }
+  arrfree(b->data);
+  b->data = data;
+  b->sealed = true;
+  sb->bytes += blockmemory(b);
+}
+
+static bool unpack(cold_block_t* b, const uint8_t* data, uint8_t* out) {
+#ifdef TYR_LZ4
+  if (b->size != b->rawsize) {
+    if (LZ4_decompress_safe((const char*)data, (char*)out, b->size, b->rawsize) 
+      != (int)b->rawsize) {
+      unreadable(b, "it is corrupt");
+      return false;
+    }
+    return true;
+  }
+#endif
+  memcpy(out, data, b->rawsize);
+  return true;
+}
+
+// NULL if the block cannot be read
+static const uint8_t* rawdata(cold_block_t* b) {
+  const uint8_t* data = b->spilled ? spilleddata(b) : b->data;
+  if (!data || !b->sealed || b->size == b->rawsize) return data;
+
+  scrollback_t* sb = &s.scrollback;
+  if (sb->cache && sb->cachedid == b->id) return sb->cache;
+  if (sb->cachecap < b->rawsize) {
+    sb->cache = realloc(sb->cache, b->rawsize);
+    sb->cachecap = b->rawsize;
+  }
+  if (!unpack(b, data, sb->cache)) return NULL;
+  sb->cachedid = b->id;
+  return sb->cache;
+}
+
+static const uint8_t* blockline(cold_block_t* b, uint32_t i) {
+  const uint8_t* data = rawdata(b);
+  return data ? data + b->offsets[i] : badline;
+}
+
+void scrollbackpush(const cell_t* row, int32_t cols) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+
+  cold_block_t* b = arrlen(sb->blocks) ? arrlast(sb->blocks) : NULL;
+  if (!b || b->nlines == COLD_BLOCK_LINES) {
+    if (b) sealblock(b);
+    // Drop the oldest block once the history is full
+    if (sb->nlines + COLD_BLOCK_LINES > SCROLLBACK_LINES - SCROLLBACK_HOT_LINES 
+      && arrlen(sb->blocks)) {
+      dropblock(sb->blocks[0]);
+      arrdel(sb->blocks, 0);
+      if (sb->spillnext > 0) sb->spillnext--;
+    }
+    // Move the oldest blocks out of memory, all but the one being filled
+    while (SCROLLBACK_MEMORY && sb->bytes - sb->spillpending > SCROLLBACK_MEMORY && 
+      sb->spillnext < arrlen(sb->blocks) - 1) {
+      if (!spillblock(sb->blocks[sb->spillnext])) break;
+      sb->spillnext++;
+    }
+    b = calloc(1, sizeof(*b));
+    b->id = sb->nextid++;
+    arrput(sb->blocks, b);
+    sb->bytes += blockmemory(b);
+  }
+
+  size_t cap = arrcap(b->data);
+  b->offsets[b->nlines++] = arrlen(b->data);
+  encodeline(row, cols, &b->data);
+  sb->bytes += arrcap(b->data) - cap;
+  sb->nlines++;
+  pthread_mutex_unlock(&lock);
+}
+
+// Encoded data of a line, by its number. Valid until the next call.
+static const uint8_t* linedata(uint64_t line) {
+  scrollback_t* sb = &s.scrollback;
+  size_t idx = line - sb->firstline;
+  return blockline(sb->blocks[idx / COLD_BLOCK_LINES], idx % COLD_BLOCK_LINES);
+}
+
+// Forgets rewrapped rows of lines that were dropped
+static void trimreflow(void) {
+  scrollback_t* sb = &s.scrollback;
+  sb->reflowend = MAX(sb->reflowend, sb->firstline);
+  if (sb->reflowscan >= sb->firstline) return;
+  sb->reflowscan = sb->firstline;
+  while (arrlen(sb->reflowrows) && arrlast(sb->reflowrows).line < sb->firstline)
+    arrpop(sb->reflowrows);
+}
+
+// Lines stored at the current width, shown one row each
+static size_t plainrows(void) {
+  scrollback_t* sb = &s.scrollback;
+  return sb->firstline + sb->nlines - sb->reflowend;
+}
+
+// Starts a new row before a cell that does not fit into the current 
+// one. Like reflowput() in tyr.c, a wide character does not go into the
+// last column.
+static bool rowfull(int32_t col, bool wide, int32_t cols) {
+  return col >= cols || (wide && col > 0 && col == cols - 1);
+}
+
+// Adds the rows of the text of lines [start, end) rewrapped to the
+// current width, newest first
+static void pushrows(uint64_t start, uint64_t end) {
+  scrollback_t* sb = &s.scrollback;
+  int32_t cols = sb->reflowcols;
+  size_t first = arrlen(sb->reflowrows);
+  arrput(sb->reflowrows, ((scroll_row_t){ .line = start, .offset = 0 }));
+  uint32_t pos = 0;
+  int32_t col = 0;
+  for (uint64_t l = start; l < end; l++) {
+    const uint8_t* p = linedata(l);
+    const uint8_t* runs = p + 4;
+    for (uint16_t r = get16(p + 2); r > 0; r--, runs += RUN_SIZE) {
+      bool wide = get16(runs) & RUN_WIDE;
+      int32_t w = wide ? 2 : 1;
+      for (int32_t cells = get16(runs) & ~RUN_WIDE; cells > 0;) {
+        if (rowfull(col, wide, cols)) {
+          arrput(sb->reflowrows, ((scroll_row_t){ .line = start, .offset = pos }));
+          col = 0;
+        }
+        // As many cells as fit into the row, a wide character at least
+        int32_t n = MAX(MIN(cells, (cols - col) / w * w), w);
+        col += n;
+        pos += n;
+        cells -= n;
+      }
+    }
+  }
+  for (size_t i = first, j = arrlen(sb->reflowrows) - 1; i < j; i++, j--) {
+    scroll_row_t row = sb->reflowrows[i];
+    sb->reflowrows[i] = sb->reflowrows[j];
+    sb->reflowrows[j] = row;
+  }
+}
+
+// Rewraps stored lines, newest first, until row j of the rewrapped part
+// is known or the oldest line is reached
+static void reflowto(size_t j) {
+  scrollback_t* sb = &s.scrollback;
+  while ((size_t)arrlen(sb->reflowrows) <= j && sb->reflowscan > sb->firstline) {
+    uint64_t start = sb->reflowscan - 1;
+    while (start > sb->firstline && (get16(linedata(start - 1)) & LINE_WRAPPED)) 
+      start--;
+    pushrows(start, sb->reflowscan);
+    sb->reflowscan = start;
+  }
+}
+
+static void rewrappedrow(scroll_row_t row, cell_t* out, int32_t cols) {
+  scrollback_t* sb = &s.scrollback;
+  int32_t x = 0;
+  size_t pos = 0;
+  bool full = false;
+  for (uint64_t l = row.line; l < sb->reflowend && !full; l++) {
+    const uint8_t* p = linedata(l);
+    int32_t n = get16(p) & ~LINE_WRAPPED;
+    if (pos + n > row.offset) {
+      if (sb->reflowlinecap < n) {
+        sb->reflowline = realloc(sb->reflowline, sizeof(cell_t) * n);
+        sb->reflowlinecap = n;
+      }
+      decodeline(p, sb->reflowline, n);
+      for (int32_t i = pos < row.offset ? row.offset - pos : 0; i < n; i++) {
+        cell_t c = sb->reflowline[i];
+        if ((full = rowfull(x, c.wide, cols))) break;
+        c.wrapped = 0;
+        out[x++] = c;
+      }
+    }
+    pos += n;
+    if (!(get16(p) & LINE_WRAPPED)) break;
+  }
+  for (; x < cols; x++) 
+    out[x] = (cell_t){ .codepoint = ' ' };
+}
+
+void scrollbackreflow(int32_t cols) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+  if (cols != sb->reflowcols) {
+    sb->reflowend = sb->reflowscan = sb->firstline + sb->nlines;
+    sb->reflowcols = cols;
+    arrsetlen(sb->reflowrows, 0);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+bool scrollbackpop(cell_t* out, int32_t cols) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+  cold_block_t* b = arrlen(sb->blocks) ? arrlast(sb->blocks) : NULL;
+  bool popped = false;
+  // Lines of sealed blocks stay where they are
+  if (b && b->nlines && sb->firstline + sb->nlines > sb->reflowend) {
+    const uint8_t* p = b->data + b->offsets[b->nlines - 1];
+    if (get16(p) & LINE_WRAPPED) {
+      decodeline(p, out, cols);
+      b->nlines--;
+      sb->nlines--;
+      arrsetlen(b->data, b->offsets[b->nlines]);
+      popped = true;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return popped;
+}
+
+size_t scrollbackrows(void) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+  trimreflow();
+  size_t n = plainrows() + arrlen(sb->reflowrows) + (sb->reflowscan - sb->firstline);
+  pthread_mutex_unlock(&lock);
+  return n;
+}
+
+void scrollbackrow(size_t back, cell_t* out, int32_t cols) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+  trimreflow();
+  size_t plain = plainrows();
+  if (back <= plain) {
+    decodeline(linedata(sb->firstline + sb->nlines - back), out, cols);
+  } else {
+    size_t j = back - plain - 1;
+    reflowto(j);
+    if (j < (size_t)arrlen(sb->reflowrows)) {
+      rewrappedrow(sb->reflowrows[j], out, cols);
+    } else {
+      for (int32_t x = 0; x < cols; x++) 
+        out[x] = (cell_t){ .codepoint = ' ' };
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+uint64_t scrollbackrowline(size_t back) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+  trimreflow();
+  uint64_t line = back <= plainrows() ? sb->firstline + sb->nlines - back : UINT64_MAX;
+  pthread_mutex_unlock(&lock);
+  return line;
+}
+
+size_t scrollbacklinerow(uint64_t line) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+  trimreflow();
+  size_t plain = plainrows(), back;
+  if (line >= sb->reflowend) {
+    back = sb->firstline + sb->nlines - line;
+  } else {
+    while (sb->reflowscan > MAX(line, sb->firstline)) 
+      reflowto(arrlen(sb->reflowrows));
+    // Rows are newest first, the newest row of the wrapped line that 
+    // holds line is the first one that starts at or before it
+    size_t lo = 0, hi = arrlen(sb->reflowrows);
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (sb->reflowrows[mid].line > line) lo = mid + 1;
+      else hi = mid;
+    }
+    if (lo < (size_t)arrlen(sb->reflowrows)) {
+      uint64_t start = sb->reflowrows[lo].line;
+      size_t pos = 0;
+      for (uint64_t l = start; l < line; l++) 
+        pos += get16(linedata(l)) & ~LINE_WRAPPED;
+      // Rows are not all full, the line starts on the newest row that 
+      // starts at or before it
+      while (lo + 1 < (size_t)arrlen(sb->reflowrows) && sb->reflowrows[lo + 1].line == start &&
+        sb->reflowrows[lo].offset > pos)
+        lo++;
+    }
+    back = plain + 1 + lo;
+  }
+  pthread_mutex_unlock(&lock);
+  return back;
+}
+
+void scrollbackline(size_t idx, cell_t* out, int32_t cols) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+  // Only the newest block can be partly filled
+  decodeline(blockline(sb->blocks[idx / COLD_BLOCK_LINES], idx % COLD_BLOCK_LINES), out, cols);
+  pthread_mutex_unlock(&lock);
+}
+
+size_t scrollbacklines(void) {
+  return s.scrollback.nlines;
+}
+
+uint64_t scrollbackfirstline(void) {
+  return s.scrollback.firstline;
+}
+
+void scrollbacksealed(uint64_t* first, uint64_t* end) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+  *first = *end = sb->nextid;
+  if (arrlen(sb->blocks)) {
+    *first = sb->blocks[0]->id;
+    *end = arrlast(sb->blocks)->sealed ? sb->nextid : sb->nextid - 1;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+bool scrollbackcopyblock(uint64_t id, scroll_block_copy_t* out) {
+  scrollback_t* sb = &s.scrollback;
+  pthread_mutex_lock(&lock);
+  bool found = arrlen(sb->blocks) && id >= sb->blocks[0]->id && 
+    id - sb->blocks[0]->id < (uint64_t)arrlen(sb->blocks);
+  cold_block_t* b = found ? sb->blocks[id - sb->blocks[0]->id] : NULL;
+  if (b && b->sealed) {
+    uint32_t cap = MAX(b->rawsize, b->nlines * (uint32_t)sizeof(badline));
+    if (out->cap < cap) {
+      out->raw = realloc(out->raw, cap);
+      out->cap = cap;
+    }
+    const uint8_t* data = b->spilled ? spilleddata(b) : b->data;
+    if (data && unpack(b, data, out->raw)) {
+      memcpy(out->offsets, b->offsets, sizeof(b->offsets));
+      out->rawsize = b->rawsize;
+    } else {
+      for (uint32_t i = 0; i < b->nlines; i++) {
+        memcpy(out->raw + i * sizeof(badline), badline, sizeof(badline));
+        out->offsets[i] = i * sizeof(badline);
+      }
+      out->rawsize = b->nlines * sizeof(badline);
+    }
+    out->nlines = b->nlines;
+    // Every block before it is full
+    out->firstline = sb->firstline + (id - sb->blocks[0]->id) * COLD_BLOCK_LINES;
+  }
+  pthread_mutex_unlock(&lock);
+  return b && b->sealed;
+}
+
+const char* scrollbacktext(const scroll_block_copy_t* copy, uint32_t i, size_t* len) {
+  const uint8_t* p = copy->raw + copy->offsets[i];
+  uint32_t end = i + 1 < copy->nlines ? copy->offsets[i + 1] : copy->rawsize;
+  const uint8_t* text = p + 4 + get16(p + 2) * RUN_SIZE;
+  *len = copy->raw + end - text;
+  return (const char*)text;
+}
+
+size_t scrollbackmemory(void) {
+  return s.scrollback.bytes;
+}
+
+size_t scrollbackspilled(void) {
+  return s.scrollback.spilledbytes;
+}
+
+void scrollbackprefetch(size_t from, size_t to) {
+  scrollback_t* sb = &s.scrollback;
+  long page = sysconf(_SC_PAGESIZE);
+  pthread_mutex_lock(&lock);
+  trimreflow();
+  // Rows back map to line numbers, going through the rewrapped rows
+  size_t plain = plainrows();
+  uint64_t end = sb->firstline + sb->nlines;
+  uint64_t lines[2];
+  size_t backs[2] = { to, from };
+  for (int32_t k = 0; k < 2; k++) {
+    if (backs[k] <= plain) {
+      lines[k] = end - MAX(backs[k], 1);
+    } else {
+      size_t j = backs[k] - plain - 1;
+      reflowto(j);
+      lines[k] = j < (size_t)arrlen(sb->reflowrows) ? sb->reflowrows[j].line : sb->firstline;
+    }
+  }
+  if (!sb->nlines) lines[0] = lines[1] = sb->firstline;
+  size_t first = lines[0] - sb->firstline, last = lines[1] - sb->firstline;
+  for (size_t i = first / COLD_BLOCK_LINES; i <= last / COLD_BLOCK_LINES && 
+    i < (size_t)arrlen(sb->blocks); i++) {
+    cold_block_t* b = sb->blocks[i];
+    if (!b->spilled) continue;
+    uint8_t* start = (uint8_t*)spilleddata(b);
+    if (!start) continue;
+    uint8_t* aligned = (uint8_t*)((uintptr_t)start & ~(uintptr_t)(page - 1));
+    madvise(aligned, b->size + (start - aligned), MADV_WILLNEED);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void scrollbackclear(void) {
+  scrollback_t* sb = &s.scrollback;
+  stopspill();
+  pthread_mutex_lock(&lock);
+  for (int32_t i = 0; i < arrlen(sb->blocks); i++) 
+    dropblock(sb->blocks[i]);
+  arrfree(sb->blocks);
+  for (int32_t i = 0; i < arrlen(sb->spillmaps); i++) 
+    if (sb->spillmaps[i]) munmap(sb->spillmaps[i], SPILL_CHUNK);
+  arrfree(sb->spillmaps);
+  if (sb->spillfd >= 0) close(sb->spillfd);
+  sb->spillfd = -1;
+  sb->spillend = 0;
+  sb->spillnext = 0;
+  free(sb->cache);
+  sb->cache = NULL;
+  sb->cachecap = 0;
+  sb->nlines = 0;
+  sb->bytes = 0;
+  sb->spilledbytes = 0;
+  sb->firstline = 0;
+  sb->reflowend = sb->reflowscan = 0;
+  arrfree(sb->reflowrows);
+  free(sb->reflowline);
+  sb->reflowline = NULL;
+  sb->reflowlinecap = 0;
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tyr.h"
+
+// Stores a row that leaves the hot ring as the newest history line
+void scrollbackpush(const cell_t* row, int32_t cols);
+
+// Decodes history line idx (0 is the oldest) into cols cells, cut or 
+// padded with blanks.
+void scrollbackline(size_t idx, cell_t* out, int32_t cols);
+
+size_t scrollbacklines(void);
+
+// Lines stored so far are shown rewrapped to cols from now on. Their
+// rows are worked out as the view scrolls back to them.
+void scrollbackreflow(int32_t cols);
+
+// Takes the newest line back out if it wrapped into the line after it
+// and is stored at the current width, so that it can be rewrapped 
+// together with its continuation.
+bool scrollbackpop(cell_t* out, int32_t cols);
+
+// History rows at the current width. Counts lines that were not 
+// rewrapped yet as one row, the number settles as the view reaches them.
+size_t scrollbackrows(void);
+
+// Decodes the history row back rows above the hot ring (1 is the newest).
+// Lines of a block that cannot be read are a single U+FFFD.
+void scrollbackrow(size_t back, cell_t* out, int32_t cols);
+
+// Number of the line shown as row back, UINT64_MAX for rewrapped rows
+uint64_t scrollbackrowline(size_t back);
+
+// Row back that the start of a stored line is shown on, rewrapping the
+// history up to it if needed
+size_t scrollbacklinerow(uint64_t line);
+
+// Number of the oldest stored line, counting every line ever pushed
+uint64_t scrollbackfirstline(void);
+
+// Ids of the blocks that are full and no longer change, [first, end)
+void scrollbacksealed(uint64_t* first, uint64_t* end);
+
+// Copies a sealed block out for another thread, decompressed. Returns 
+// false if the block was dropped in the meantime. The lines of a block
+// that cannot be read are copied as U+FFFD.
+bool scrollbackcopyblock(uint64_t id, scroll_block_copy_t* out);
+
+// The UTF-8 text of line i in a copied block, one codepoint per cell
+const char* scrollbacktext(const scroll_block_copy_t* copy, uint32_t i, size_t* len);
+
+// Bytes held in memory by the compact history, including block headers
+size_t scrollbackmemory(void);
+
+// Bytes of compact history moved to the spill file
+size_t scrollbackspilled(void);
+
+// Asks the kernel to read the spilled blocks of history rows back
+// [from, to] ahead, so drawing them does not wait on the disk.
+void scrollbackprefetch(size_t from, size_t to);
+
+void scrollbackclear(void);
@@ -0,0 +1,500 @@
+#define _GNU_SOURCE
+#include "search.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <regex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __x86_64__
+#include <emmintrin.h>
+#endif
+
+#include "term.h"
+#include "scrollback.h"
+#include "../vendor/stb_ds.h"
+
+#ifdef __x86_64__
+// Candidates are positions where the first and the last byte of the
+// needle both match, 16 positions at a time.
+static const char* memmemsimd(const char* hay, size_t n, const char* needle, size_t m) {
+  if (m == 0 || m > n) return NULL;
+  if (m == 1) return memchr(hay, needle[0], n);
+
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(hay + i + m - 1));
+    uint32_t mask = _mm_movemask_epi8(
+      _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask) {
+      uint32_t bit = __builtin_ctz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+        return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  for (; i + m <= n; i++)
+    if (hay[i] == needle[0] && memcmp(hay + i, needle, m) == 0)
+      return hay + i;
+  return NULL;
+}
+#else
+static const char* memmemsimd(const char* hay, size_t n, const char* needle, size_t m) {
+  if (m == 0) return NULL;
+  return memmem(hay, n, needle, m);
+}
+#endif
+
+// Each cell holds one codepoint, so cells are counted by lead bytes
+static uint16_t cellsin(const char* text, size_t len) {
+  size_t n = 0;
+  for (size_t i = 0; i < len; i++)
+    n += ((uint8_t)text[i] & 0xC0) != 0x80;
+  return MIN(n, UINT16_MAX);
+}
+
+_Static_assert(SEARCH_RESULT_RING % sizeof(search_match_t) == 0,
+               "search results must not wrap around the ring");
+
+typedef struct {
+  search_t* se;
+  uint32_t gen;
+  bool regex;
+  regex_t re;
+  char query[SEARCH_QUERY_SIZE];
+  size_t querylen;
+} search_job_t;
+
+static bool cancelled(search_job_t* job) {
+  return atomic_load(&job->se->gen) != job->gen;
+}
+
+static void notifymainloop(search_t* se) {
+  if (atomic_exchange(&se->notified, true)) return;
+  char dummy = 1;
+  write(se->notify_pipe[1], &dummy, 1);
+}
+
+static bool emit(search_job_t* job, search_match_t m) {
+  m.gen = job->gen;
+  while (!ringput(&job->se->results, &m, sizeof(m))) {
+    // The main loop is behind, hand it what is there and wait
+    if (cancelled(job)) return false;
+    notifymainloop(job->se);
+    usleep(1000);
+  }
+  return true;
+}
+
+static bool searchline(search_job_t* job, const char* text, size_t len,
+                       uint64_t line, search_record_kind_t kind) {
+  size_t off = 0;
+  while (off < len) {
+    size_t start, end;
+    if (job->regex) {
+      regmatch_t pm = { .rm_so = off, .rm_eo = len };
+      if (regexec(&job->re, text, 1, &pm, REG_STARTEND | (off ? REG_NOTBOL : 0)) != 0)
+        break;
+      start = pm.rm_so;
+      end = pm.rm_eo;
+    } else {
+      const char* hit = memmemsimd(text + off, len - off, job->query, job->querylen);
+      if (!hit) break;
+      start = hit - text;
+      end = start + job->querylen;
+    }
+    if (end > start) {
+      search_match_t m = {
+        .line = line, .kind = kind,
+        .col = cellsin(text, start), .len = cellsin(text + start, end - start),
+      };
+      if (!emit(job, m)) return false;
+    }
+    off = end > start ? end : start + 1;
+  }
+  return true;
+}
+
+static void* searchworker(void* data) {
+  search_t* se = (search_t*)data;
+  search_job_t job = { .se = se };
+  bool compiled = false;
+  char* text = NULL;
+  uint32_t* offsets = NULL;
+  scroll_block_copy_t copy = {0};
+  uint64_t scanned = 0; // blocks before this id were searched
+
+  while (true) {
+    pthread_mutex_lock(&se->lock);
+    while (!se->pending && !se->quit)
+      pthread_cond_wait(&se->cond, &se->lock);
+    if (se->quit) {
+      pthread_mutex_unlock(&se->lock);
+      break;
+    }
+    bool fresh = se->fresh;
+    job.gen = atomic_load(&se->gen);
+    if (fresh) {
+      memcpy(job.query, se->query, sizeof(job.query));
+      job.querylen = strlen(job.query);
+      job.regex = se->regex;
+    }
+    arrfree(text);
+    arrfree(offsets);
+    text = se->livetext;
+    offsets = se->liveoffsets;
+    se->livetext = NULL;
+    se->liveoffsets = NULL;
+    uint64_t livefirst = se->livefirst;
+    uint64_t coldend = se->coldend;
+    se->pending = se->fresh = false;
+    pthread_mutex_unlock(&se->lock);
+
+    if (fresh) {
+      if (compiled) regfree(&job.re);
+      compiled = false;
+      if (job.regex) {
+        int err = regcomp(&job.re, job.query, REG_EXTENDED | REG_NEWLINE);
+        if (err) {
+          char msg[256];
+          regerror(err, &job.re, msg, sizeof(msg));
+          fprintf(stderr, "tyr: invalid search pattern: %s\n", msg);
+          emit(&job, (search_match_t){ .kind = SEARCH_DONE });
+          notifymainloop(se);
+          continue;
+        }
+        compiled = true;
+      }
+    }
+
+    // Screen and recent history first, they change with every update
+    if (!emit(&job, (search_match_t){ .kind = SEARCH_LIVE_BEGIN })) continue;
+    bool ok = true;
+    for (int64_t i = (int64_t)arrlen(offsets) - 1; i >= 0 && ok; i--) {
+      uint32_t end = i + 1 < arrlen(offsets) ? offsets[i + 1] : (uint32_t)arrlen(text);
+      ok = searchline(&job, text + offsets[i], end - offsets[i], livefirst + i,
+                      SEARCH_MATCH_LIVE);
+    }
+    notifymainloop(se);
+    if (!ok) continue;
+
+    if (fresh) {
+      // Walk back from the newest sealed block, so the matches closest
+      // to the screen show up first
+      for (uint64_t id = coldend; id > 0 && ok; id--) {
+        if (!scrollbackcopyblock(id - 1, &copy)) break;
+        for (int32_t i = copy.nlines - 1; i >= 0 && ok; i--) {
+          size_t len;
+          const char* line = scrollbacktext(&copy, i, &len);
+          ok = searchline(&job, line, len, copy.firstline + i, SEARCH_MATCH_OLDER);
+        }
+        notifymainloop(se);
+      }
+    } else {
+      // Only the blocks sealed since the last job, oldest first
+      for (uint64_t id = scanned; id < coldend && ok; id++) {
+        if (!scrollbackcopyblock(id, &copy)) continue;
+        for (uint32_t i = 0; i < copy.nlines && ok; i++) {
+          size_t len;
+          const char* line = scrollbacktext(&copy, i, &len);
+          ok = searchline(&job, line, len, copy.firstline + i, SEARCH_MATCH_NEWER);
+        }
+      }
+    }
+    if (!ok) continue;
+    scanned = coldend;
+    emit(&job, (search_match_t){ .kind = SEARCH_DONE });
+    notifymainloop(se);
+  }
+
+  if (compiled) regfree(&job.re);
+  arrfree(text);
+  arrfree(offsets);
+  free(copy.raw);
+  return NULL;
+}
+
+static bool searchinit(void) {
+  search_t* se = &s.search;
+  if (se->started) return true;
+  if (!ringinit(&se->results, SEARCH_RESULT_RING)) return false;
+  if (pipe(se->notify_pipe) == -1) {
+    perror("pipe");
+    ringfree(&se->results);
+    return false;
+  }
+  fcntl(se->notify_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(se->notify_pipe[1], F_SETFL, O_NONBLOCK);
+  pthread_mutex_init(&se->lock, NULL);
+  pthread_cond_init(&se->cond, NULL);
+  atomic_init(&se->notified, false);
+  atomic_init(&se->gen, 0);
+  if (pthread_create(&se->thread, NULL, searchworker, se) != 0) {
+    perror("pthread_create");
+    close(se->notify_pipe[0]);
+    close(se->notify_pipe[1]);
+    ringfree(&se->results);
+    return false;
+  }
+  se->started = true;
+  return true;
+}
+
+static void appendrow(char** text, uint32_t** offsets, const cell_t* row) {
+  arrput(*offsets, arrlen(*text));
+  int32_t n = s.cols;
+  while (n > 0 && row[n - 1].codepoint == ' ') n--;
+  if (n == 0) return;
+  size_t cap = (size_t)n * 4;
+  char* p = arraddnptr(*text, cap);
+  for (int32_t x = 0; x < n; x++)
+    p += utf8encode(row[x].codepoint, p);
+  arrsetlen(*text, p - *text);
+}
+
+// Hands the worker the lines that can still change or are not in a
+// sealed block yet: the block being filled, the hot ring and the screen.
+static void postjob(bool fresh) {
+  search_t* se = &s.search;
+  char* text = NULL;
+  uint32_t* offsets = NULL;
+
+  uint64_t first, end;
+  scrollbacksealed(&first, &end);
+  size_t sealedlines = (end - first) * COLD_BLOCK_LINES;
+  // Not into the view's rows, which hold what is drawn
+  arrsetlen(se->row, s.cols);
+  for (size_t i = sealedlines; i < scrollbacklines(); i++) {
+    scrollbackline(i, se->row, s.cols);
+    appendrow(&text, &offsets, se->row);
+  }
+  for (int32_t y = -s.grid.histlen; y < s.rows; y++)
+    appendrow(&text, &offsets, getphysrow(y));
+
+  pthread_mutex_lock(&se->lock);
+  arrfree(se->livetext);
+  arrfree(se->liveoffsets);
+  se->livetext = text;
+  se->liveoffsets = offsets;
+  se->livefirst = scrollbackfirstline() + sealedlines;
+  se->coldend = end;
+  se->fresh |= fresh;
+  se->pending = true;
+  pthread_cond_signal(&se->cond);
+  pthread_mutex_unlock(&se->lock);
+  se->stale = false;
+}
+
+// Number of the line at the top of the live screen
+static uint64_t livelines(void) {
+  return scrollbackfirstline() + scrollbacklines() + s.grid.histlen;
+}
+
+static void clearmatches(void) {
+  arrsetlen(s.search.older, 0);
+  arrsetlen(s.search.newer, 0);
+  arrsetlen(s.search.live, 0);
+  s.search.done = false;
+}
+
+void searchstart(const char* query, bool regex) {
+  search_t* se = &s.search;
+  if (!*query || lf_flag_exists(&s.termmode, TERM_MODE_ALTSCREEN)) {
+    searchstop();
+    return;
+  }
+  if (!searchinit()) return;
+
+  pthread_mutex_lock(&se->lock);
+  snprintf(se->query, sizeof(se->query), "%s", query);
+  se->regex = regex;
+  atomic_fetch_add(&se->gen, 1);
+  pthread_mutex_unlock(&se->lock);
+
+  clearmatches();
+  se->active = true;
+  se->current = livelines() + s.rows - s.viewoffset;
+  postjob(true);
+  s.fullrerender = true;
+}
+
+void searchstop(void) {
+  search_t* se = &s.search;
+  if (!se->active) return;
+  atomic_fetch_add(&se->gen, 1);
+  clearmatches();
+  se->active = se->stale = false;
+  s.fullrerender = true;
+}
+
+void searchupdate(void) {
+  if (!s.search.active || !s.search.stale) return;
+  if (lf_flag_exists(&s.termmode, TERM_MODE_ALTSCREEN)) return;
+  postjob(false);
+}
+
+bool searchpoll(void) {
+  search_t* se = &s.search;
+  if (!se->started) return false;
+  atomic_store(&se->notified, false);
+  char dummy[64];
+  while (read(se->notify_pipe[0], dummy, sizeof(dummy)) > 0);
+
+  uint32_t gen = atomic_load(&se->gen) & 0xFFFFFF;
+  bool changed = false;
+  const char* span;
+  size_t n;
+  // Records are written whole and the ring size is a multiple of them
+  while ((n = ringreadspan(&se->results, &span)) > 0) {
+    const search_match_t* m = (const search_match_t*)span;
+    size_t count = n / sizeof(*m);
+    for (size_t i = 0; i < count; i++) {
+      if (m[i].gen != gen || !se->active) continue;
+      switch (m[i].kind) {
+        case SEARCH_MATCH_OLDER: arrput(se->older, m[i]); break;
+        case SEARCH_MATCH_NEWER: arrput(se->newer, m[i]); break;
+        case SEARCH_MATCH_LIVE:  arrput(se->live, m[i]); break;
+        case SEARCH_LIVE_BEGIN:  arrsetlen(se->live, 0); break;
+        case SEARCH_DONE:        se->done = true; break;
+      }
+      changed = true;
+    }
+    ringconsume(&se->results, count * sizeof(*m));
+  }
+  if (changed) s.fullrerender = true;
+  return changed;
+}
+
+void searchshutdown(void) {
+  search_t* se = &s.search;
+  if (!se->started) return;
+  pthread_mutex_lock(&se->lock);
+  se->quit = true;
+  atomic_fetch_add(&se->gen, 1);
+  pthread_cond_signal(&se->cond);
+  pthread_mutex_unlock(&se->lock);
+  pthread_join(se->thread, NULL);
+  close(se->notify_pipe[0]);
+  close(se->notify_pipe[1]);
+  ringfree(&se->results);
+  arrfree(se->livetext);
+  arrfree(se->liveoffsets);
+  arrfree(se->older);
+  arrfree(se->newer);
+  arrfree(se->live);
+  arrfree(se->row);
+  pthread_mutex_destroy(&se->lock);
+  pthread_cond_destroy(&se->cond);
+  se->started = se->active = false;
+}
+
+size_t searchcount(void) {
+  search_t* se = &s.search;
+  return arrlen(se->older) + arrlen(se->newer) + arrlen(se->live);
+}
+
+void searchprompt(char* out, size_t size) {
+  search_t* se = &s.search;
+  snprintf(out, size, "%s: %s  (%zu%s)", se->inputregex ? "regex" : "search", 
+           se->input, searchcount(), se->active && !se->done ? "..." : "");
+}
+
+uint64_t searchlineofrow(int32_t viewrow) {
+  int32_t line = viewrow - s.viewoffset;
+  if (line >= -s.grid.histlen) return livelines() + line;
+  return scrollbackrowline(-line - s.grid.histlen);
+}
+
+void searchrestart(void) {
+  search_t* se = &s.search;
+  if (!se->active) return;
+  char query[SEARCH_QUERY_SIZE];
+  memcpy(query, se->query, sizeof(query));
+  searchstart(query, se->regex);
+}
+
+// First index in a whose line is not past line in the array's order
+static size_t lowerbound(const search_match_t* a, size_t n, uint64_t line, bool descending) {
+  size_t lo = 0, hi = n;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    bool before = descending ? a[mid].line > line : a[mid].line < line;
+    if (before) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo;
+}
+
+static size_t collect(const search_match_t* a, size_t n, bool descending,
+                      uint64_t line, search_match_t* out, size_t max) {
+  size_t count = 0;
+  for (size_t i = lowerbound(a, n, line, descending); i < n && a[i].line == line && count < max; i++)
+    out[count++] = a[i];
+  return count;
+}
+
+size_t searchlinematches(uint64_t line, search_match_t* out, size_t max) {
+  search_t* se = &s.search;
+  if (!se->active) return 0;
+  size_t n = collect(se->live, arrlen(se->live), true, line, out, max);
+  n += collect(se->older, arrlen(se->older), true, line, out + n, max - n);
+  n += collect(se->newer, arrlen(se->newer), false, line, out + n, max - n);
+  return n;
+}
+
+// Nearest matching line before (older) or after a line, kept in *found
+// if it is closer than what is there
+static void nearest(const search_match_t* a, size_t n, bool descending,
+                    uint64_t line, bool older, uint64_t* found) {
+  size_t i;
+  if (descending) {
+    // lowerbound() finds the first entry at or below a line
+    if (older) {
+      if (line == 0) return;
+      i = lowerbound(a, n, line - 1, true);
+    } else {
+      i = lowerbound(a, n, line, true);
+      if (i-- == 0) return;
+    }
+  } else {
+    // and here the first entry at or above it
+    if (older) {
+      i = lowerbound(a, n, line, false);
+      if (i-- == 0) return;
+    } else {
+      i = lowerbound(a, n, line + 1, false);
+    }
+  }
+  if (i >= n) return;
+  if (*found == UINT64_MAX || (older ? a[i].line > *found : a[i].line < *found))
+    *found = a[i].line;
+}
+
+void searchjump(bool older) {
+  search_t* se = &s.search;
+  if (!se->active) return;
+  uint64_t found = UINT64_MAX;
+  nearest(se->live, arrlen(se->live), true, se->current, older, &found);
+  nearest(se->older, arrlen(se->older), true, se->current, older, &found);
+  nearest(se->newer, arrlen(se->newer), false, se->current, older, &found);
+  if (found == UINT64_MAX || found < scrollbackfirstline()) return;
+  se->current = found;
+
+  // Center the match in the view. Rewrapped history has more or fewer
+  // rows than lines, the history maps its lines to rows.
+  int32_t row = s.rows / 2;
+  int64_t offset;
+  if (found >= livelines() - s.grid.histlen)
+    offset = (int64_t)livelines() + row - (int64_t)found;
+  else
+    offset = (int64_t)row + s.grid.histlen + (int64_t)scrollbacklinerow(found);
+  scrollview((int32_t)offset - s.viewoffset);
+  s.fullrerender = true;
+}
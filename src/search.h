@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "tyr.h"
+
+// Searches the screen and the whole scrollback on a worker thread. 
+// Matches stream back through searchpoll(), and searchupdate() extends
+// the search to output that arrived since, without starting over. 
+// An empty query stops the search.
+void searchstart(const char* query, bool regex);
+
+void searchstop(void);
+
+// Runs the current search again from scratch, after the lines were
+// renumbered by a resize
+void searchrestart(void);
+
+void searchupdate(void);
+
+// Takes the matches the worker found so far. Returns true if there 
+// were new ones.
+bool searchpoll(void);
+
+void searchshutdown(void);
+
+size_t searchcount(void);
+
+// Text of the prompt that takes the place of the last row while typing
+void searchprompt(char* out, size_t size);
+
+// Line number of a row of the view, in the numbering matches use.
+// History rewrapped by a resize has none, it is UINT64_MAX.
+uint64_t searchlineofrow(int32_t viewrow);
+
+// Copies up to max matches on line into out and returns their count
+size_t searchlinematches(uint64_t line, search_match_t* out, size_t max);
+
+// Moves the view to the next older or newer match
+void searchjump(bool older);
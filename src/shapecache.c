@@ -0,0 +1,93 @@
+#include "shapecache.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+#include "../vendor/stb_ds.h"
+
+// FNV-1a of the text, then the font
+static uint64_t shapehash(const char* text, const RnFont* font) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (const uint8_t* p = (const uint8_t*)text; *p; p++) 
+    h = (h ^ *p) * 0x100000001b3ULL;
+  h ^= (uintptr_t)font;
+  return h * 0x9e3779b97f4a7c15ULL;
+}
+
+static void detach(shaped_text_t* e) {
+  shape_cache_t* c = &s.shapecache;
+  if (e->prev) e->prev->next = e->next;
+  else c->newest = e->next;
+  if (e->next) e->next->prev = e->prev;
+  else c->oldest = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void attach(shaped_text_t* e) {
+  shape_cache_t* c = &s.shapecache;
+  e->next = c->newest;
+  if (c->newest) c->newest->prev = e;
+  c->newest = e;
+  if (!c->oldest) c->oldest = e;
+}
+
+static void drop(shaped_text_t* e) {
+  shape_cache_t* c = &s.shapecache;
+  detach(e);
+  (void)hmdel(c->map, e->hash);
+  c->bytes -= e->size;
+  free(e);
+}
+
+shaped_text_t* shapecacheget(const char* text, RnFont* font) {
+  shape_cache_t* c = &s.shapecache;
+  uint64_t hash = shapehash(text, font);
+  ptrdiff_t i = hmgeti(c->map, hash);
+  if (i < 0 || c->map[i].value->font != font || strcmp(c->map[i].value->text, text)) {
+    c->misses++;
+    return NULL;
+  }
+  shaped_text_t* e = c->map[i].value;
+  if (e != c->newest) {
+    detach(e);
+    attach(e);
+  }
+  c->hits++;
+  return e;
+}
+
+shaped_text_t* shapecacheput(const char* text, RnFont* font, 
+                             const shaped_glyph_t* glyphs, uint32_t nglyphs) {
+  shape_cache_t* c = &s.shapecache;
+  uint64_t hash = shapehash(text, font);
+  // Another text with the same hash is replaced
+  ptrdiff_t i = hmgeti(c->map, hash);
+  if (i >= 0) drop(c->map[i].value);
+
+  size_t len = strlen(text) + 1;
+  size_t size = sizeof(shaped_text_t) + nglyphs * sizeof(shaped_glyph_t) + len;
+  shaped_text_t* e = malloc(size);
+  e->hash = hash;
+  e->font = font;
+  e->glyphs = (shaped_glyph_t*)(e + 1);
+  e->nglyphs = nglyphs;
+  memcpy(e->glyphs, glyphs, nglyphs * sizeof(shaped_glyph_t));
+  e->text = memcpy((char*)(e->glyphs + nglyphs), text, len);
+  e->size = size;
+  e->prev = e->next = NULL;
+
+  // The new entry stays even if it is bigger than the budget on its own
+  while (c->oldest && c->bytes + size > SHAPE_CACHE_MEMORY) 
+    drop(c->oldest);
+  attach(e);
+  hmput(c->map, hash, e);
+  c->bytes += size;
+  return e;
+}
+
+void shapecacheclear(void) {
+  shape_cache_t* c = &s.shapecache;
+  while (c->oldest) drop(c->oldest);
+  hmfree(c->map);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "tyr.h"
+
+// Shaped text drawn before with font, NULL if it is not kept. Counts
+// a hit or a miss.
+shaped_text_t* shapecacheget(const char* text, RnFont* font);
+
+// Keeps a copy of the shaped glyphs of text, dropping the texts drawn
+// longest ago to stay within SHAPE_CACHE_MEMORY.
+shaped_text_t* shapecacheput(const char* text, RnFont* font, 
+                             const shaped_glyph_t* glyphs, uint32_t nglyphs);
+
+void shapecacheclear(void);
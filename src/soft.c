@@ -0,0 +1,462 @@
+#include "soft.h"
+
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "config.h"
+#include "render.h"
+#include "search.h"
+#include "style.h"
+#include "term.h"
+#include "../vendor/stb_ds.h"
+
+// Pixels are 0xAARRGGBB, always opaque
+#define OPAQUE 0xff000000u
+
+// Underline kind of a style and these bits, like gridgl.c has them
+#define DECO_UNDERLINE 0xffu
+#define DECO_STRIKE    (1u << 8)
+#define DECO_OVERLINE  (1u << 9)
+
+typedef struct {
+  int32_t left, top; // of the bitmap, from the pen on the baseline
+  uint32_t width, rows;
+  size_t alpha;      // offset of its coverage in g.alpha
+} soft_glyph_t;
+
+typedef struct {
+  uint32_t key;   // codepoint
+  uint32_t value; // index into g.glyphs, 0 if nothing is drawn for it
+} soft_glyph_index_t;
+
+// A cell as it is drawn, resolved when its row changes
+typedef struct {
+  uint32_t glyph;
+  uint32_t fg, bg, ul;
+  uint32_t deco;
+} soft_cell_t;
+
+static struct {
+  bool ready;
+  FT_Face face;
+  int32_t cw, ch, baseline;
+  // Rows above the cell and below it that glyphs reach into
+  int32_t above, below;
+
+  uint32_t* pixels;
+  int32_t width, height;
+  int32_t top, bottom; // pixel rows drawn since the last present
+
+  soft_cell_t* cells;
+  int32_t cols, rows;
+  int32_t cursorrow, cursorcol; // where the cursor was drawn
+
+  soft_glyph_t* glyphs;            // stb_ds array, 0 is no glyph
+  uint8_t* alpha;                  // stb_ds array
+  soft_glyph_index_t* bycodepoint; // stb_ds hash map
+  uint32_t notdef;                 // the missing glyph box
+
+  // The window the framebuffer is put onto
+  Display* dpy;
+  Window win;
+  Visual* visual;
+  int32_t depth;
+  GC gc;
+  XImage* image;
+  XShmSegmentInfo shm;
+  bool shared;
+} g;
+
+static void resetglyphs(void) {
+  arrsetlen(g.glyphs, 1);
+  arrsetlen(g.alpha, 0);
+  hmfree(g.bycodepoint);
+  g.notdef = 0;
+  g.above = g.below = 0;
+}
+
+static uint32_t rasterize(FT_Face face, uint32_t gid) {
+  if (FT_Load_Glyph(face, gid, FT_LOAD_RENDER | FT_LOAD_COLOR) != 0) return 0;
+  FT_GlyphSlot gs = face->glyph;
+  const FT_Bitmap* bm = &gs->bitmap;
+  if (!bm->width || !bm->rows) return 0;
+  soft_glyph_t glyph = { gs->bitmap_left, gs->bitmap_top, bm->width, bm->rows, arrlenu(g.alpha) };
+  glyphalpha(bm, arraddnptr(g.alpha, (size_t)bm->width * bm->rows));
+  g.above = MAX(g.above, glyph.top - g.baseline);
+  g.below = MAX(g.below, (int32_t)glyph.rows - glyph.top - (g.ch - g.baseline));
+  arrput(g.glyphs, glyph);
+  return arrlenu(g.glyphs) - 1;
+}
+
+static uint32_t glyphindex(uint32_t cp) {
+  if (cp <= ' ') return 0;
+  ptrdiff_t i = hmgeti(g.bycodepoint, cp);
+  if (i >= 0) return g.bycodepoint[i].value;
+  bool pending;
+  FT_Face face = glyphface(g.face, cp, &pending);
+  // The missing glyph box stands in until the fallback is known
+  if (pending) {
+    if (!g.notdef) g.notdef = rasterize(g.face, 0);
+    return g.notdef;
+  }
+  uint32_t glyph = face ? rasterize(face, FT_Get_Char_Index(face, cp)) : 0;
+  hmput(g.bycodepoint, cp, glyph);
+  return glyph;
+}
+
+static uint32_t rgbof(RnColor c) {
+  return (uint32_t)c.r << 16 | (uint32_t)c.g << 8 | c.b;
+}
+
+static void resolverow(int32_t y) {
+  soft_cell_t* out = &g.cells[(size_t)y * s.cols];
+  run_colors_t plain = stylecolors(getstyle(0));
+  // The search prompt takes the place of the last row while typing
+  if (s.search.editing && y == s.rows - 1) {
+    char prompt[SEARCH_QUERY_SIZE * 2];
+    searchprompt(prompt, sizeof(prompt));
+    size_t len = strlen(prompt);
+    uint32_t cps[len + 1];
+    utf8_decoder_t dec;
+    utf8reset(&dec);
+    size_t n = utf8decodechunk(&dec, (const uint8_t*)prompt, len, cps);
+    for (int32_t x = 0; x < s.cols; x++)
+      out[x] = (soft_cell_t){ (size_t)x < n ? glyphindex(cps[x]) : 0, plain.fg, plain.bg, plain.ul, 0 };
+    return;
+  }
+
+  const cell_t* cells = getviewrow(y);
+  uint32_t id = UINT32_MAX;
+  run_colors_t c = plain;
+  uint32_t deco = 0;
+  for (int32_t x = 0; x < s.cols; x++) {
+    if (cells[x].style != id) {
+      id = cells[x].style;
+      const style_t* st = getstyle(id);
+      c = stylecolors(st);
+      deco = st->underline | (st->attrs & FONT_STRIKETHROUGH ? DECO_STRIKE : 0) |
+        (st->attrs & FONT_OVERLINED ? DECO_OVERLINE : 0);
+    }
+    bool drawn = !cells[x].widedummy && !c.hidden;
+    out[x] = (soft_cell_t){ drawn ? glyphindex(cells[x].codepoint) : 0, c.fg, c.bg, c.ul, deco };
+  }
+  search_match_t matches[64];
+  size_t n = searchlinematches(searchlineofrow(y), matches, 64);
+  for (size_t i = 0; i < n; i++) {
+    uint32_t bg = rgbof(matches[i].line == s.search.current ? SEARCH_CURRENT_COLOR : SEARCH_MATCH_COLOR);
+    for (int32_t x = matches[i].col; x < MIN(matches[i].col + matches[i].len, s.cols); x++)
+      out[x].bg = bg;
+  }
+}
+
+static void fill(uint32_t* dst, int32_t n, uint32_t color) {
+  for (int32_t i = 0; i < n; i++) dst[i] = color;
+}
+
+// x * y / 255 of 8 bit values, rounded the way Mesa's llvmpipe does
+static inline uint32_t mul255(uint32_t x, uint32_t y) {
+  uint32_t t = x * y;
+  return (t + (t >> 8) + 128) >> 8;
+}
+
+// fg over dst by coverage a. Both products are rounded on their own and
+// the sum saturates like llvmpipe blending into an 8 bit framebuffer, so
+// the images of both renderers match there.
+static inline uint32_t blend(uint32_t dst, uint32_t fg, uint32_t a) {
+  uint32_t out = 0;
+  for (uint32_t shift = 0; shift < 32; shift += 8) {
+    uint32_t v = mul255((fg >> shift) & 0xff, a) + mul255((dst >> shift) & 0xff, 255 - a);
+    out |= MIN(v, 255) << shift;
+  }
+  return out;
+}
+
+#ifdef __SSE2__
+static inline __m128i mul255x8(__m128i x, __m128i y) {
+  __m128i t = _mm_mullo_epi16(x, y);
+  return _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 
+                                      _mm_set1_epi16(128)), 8);
+}
+
+// blend() on the 16 bit channels of two pixels, packing saturates
+static inline __m128i blend2(__m128i dst, __m128i fg, __m128i a) {
+  return _mm_add_epi16(mul255x8(fg, a), mul255x8(dst, _mm_sub_epi16(_mm_set1_epi16(255), a)));
+}
+#endif
+
+// Blends fg into n pixels by the coverage in alpha, four at a time
+static void blendspan(uint32_t* dst, const uint8_t* alpha, int32_t n, uint32_t fg) {
+  int32_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i fg2 = _mm_unpacklo_epi8(_mm_set1_epi32(fg), zero);
+  for (; i + 4 <= n; i += 4) {
+    uint32_t a4;
+    memcpy(&a4, alpha + i, 4);
+    if (!a4) continue;
+    if (a4 == 0xffffffffu) {
+      _mm_storeu_si128((__m128i*)(dst + i), _mm_set1_epi32(fg));
+      continue;
+    }
+    // Each coverage byte once for every channel of its pixel
+    __m128i a = _mm_cvtsi32_si128(a4);
+    a = _mm_unpacklo_epi8(a, a);
+    a = _mm_unpacklo_epi16(a, a);
+    __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+    __m128i lo = blend2(_mm_unpacklo_epi8(d, zero), fg2, _mm_unpacklo_epi8(a, zero));
+    __m128i hi = blend2(_mm_unpackhi_epi8(d, zero), fg2, _mm_unpackhi_epi8(a, zero));
+    _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (; i < n; i++) {
+    if (alpha[i] == 255) dst[i] = fg;
+    else if (alpha[i]) dst[i] = blend(dst[i], fg, alpha[i]);
+  }
+}
+
+// Glyphs of row y, clipped to pixel rows [top, bottom)
+static void drawglyphs(int32_t y, int32_t top, int32_t bottom) {
+  const soft_cell_t* row = &g.cells[(size_t)y * s.cols];
+  int32_t baseline = y * g.ch + g.baseline;
+  for (int32_t x = 0; x < s.cols; x++) {
+    if (!row[x].glyph) continue;
+    const soft_glyph_t* glyph = &g.glyphs[row[x].glyph];
+    int32_t gx = x * g.cw + glyph->left, gy = baseline - glyph->top;
+    int32_t x0 = MAX(gx, 0), x1 = MIN(gx + (int32_t)glyph->width, g.width);
+    int32_t y0 = MAX(gy, top), y1 = MIN(gy + (int32_t)glyph->rows, bottom);
+    for (int32_t py = y0; py < y1; py++)
+      blendspan(g.pixels + (size_t)py * g.width + x0,
+                g.alpha + glyph->alpha + (size_t)(py - gy) * glyph->width + (x0 - gx),
+                x1 - x0, row[x].fg | OPAQUE);
+  }
+}
+
+// Decorations are drawn like renderdecorations() does
+static uint32_t colorat(const soft_cell_t* c, int32_t y, uint32_t bg) {
+  int32_t thick = MAX(g.ch / 16, 1), middle = g.ch / 2;
+  uint32_t underline = c->deco & DECO_UNDERLINE, color = bg;
+  if (underline && ((y >= g.baseline + thick && y < g.baseline + 2 * thick) ||
+      (underline == 2 && y >= g.baseline + 3 * thick && y < g.baseline + 4 * thick)))
+    color = c->ul;
+  if ((c->deco & DECO_STRIKE) && y >= middle && y < middle + thick) color = c->fg;
+  if ((c->deco & DECO_OVERLINE) && y < thick) color = c->fg;
+  return color | OPAQUE;
+}
+
+// Draws the pixel rows of row y: the backgrounds, then the glyphs of it
+// and of the rows next to it that reach into it. The last row also draws
+// what is below the grid.
+static void drawband(int32_t y) {
+  int32_t top = y * g.ch;
+  int32_t bottom = y == s.rows - 1 ? g.height : MIN(top + g.ch, g.height);
+  if (top >= bottom) return;
+  const soft_cell_t* row = &g.cells[(size_t)y * s.cols];
+  int32_t right = MIN(s.cols * g.cw, g.width);
+  int32_t cursor = y == g.cursorrow ? g.cursorcol : -1;
+  for (int32_t py = top; py < bottom; py++) {
+    uint32_t* dst = g.pixels + (size_t)py * g.width;
+    int32_t cy = py - top;
+    if (cy >= g.ch) {
+      fill(dst, g.width, TERM_BACKGROUND | OPAQUE);
+      continue;
+    }
+    for (int32_t x = 0; x * g.cw < right; x++) {
+      uint32_t bg = x == cursor ? rgbof(RN_WHITE) : row[x].bg;
+      fill(dst + x * g.cw, MIN(g.cw, right - x * g.cw), colorat(&row[x], cy, bg));
+    }
+    fill(dst + right, g.width - right, TERM_BACKGROUND | OPAQUE);
+  }
+  if (y > 0 && g.below > 0) drawglyphs(y - 1, top, bottom);
+  drawglyphs(y, top, bottom);
+  if (y + 1 < s.rows && g.above > 0) drawglyphs(y + 1, top, bottom);
+  g.top = MIN(g.top, top);
+  g.bottom = MAX(g.bottom, bottom);
+}
+
+void softinit(FT_Face face) {
+  g.face = face;
+  g.cw = face->size->metrics.max_advance >> 6;
+  g.ch = face->size->metrics.height >> 6;
+  // Where runara puts the baseline too
+  g.baseline = face->size->metrics.y_ppem;
+  arrsetlen(g.glyphs, 0);
+  arrput(g.glyphs, (soft_glyph_t){ 0 });
+  resetglyphs();
+  g.cursorrow = -1;
+  g.top = INT32_MAX;
+  g.ready = true;
+}
+
+bool softattach(Display* dpy, Window win) {
+  XWindowAttributes wa;
+  if (!XGetWindowAttributes(dpy, win, &wa)) return false;
+  if (wa.visual->class != TrueColor || wa.visual->red_mask != 0xff0000 ||
+    wa.visual->green_mask != 0xff00 || wa.visual->blue_mask != 0xff) {
+    fprintf(stderr, "tyr: the window is not 8 bit per channel TrueColor.\n");
+    return false;
+  }
+  g.dpy = dpy;
+  g.win = win;
+  g.visual = wa.visual;
+  g.depth = wa.depth;
+  g.gc = XCreateGC(dpy, win, 0, NULL);
+  return true;
+}
+
+static void freeframebuffer(void) {
+  if (g.image) {
+    if (g.shared) {
+      XShmDetach(g.dpy, &g.shm);
+      XDestroyImage(g.image);
+      shmdt(g.shm.shmaddr);
+    } else {
+      XDestroyImage(g.image);
+    }
+  } else {
+    free(g.pixels);
+  }
+  g.image = NULL;
+  g.pixels = NULL;
+  g.shared = false;
+}
+
+// Without a window the pixels are plain memory. With one they are an
+// XShm image, or an XImage that goes over the wire if the X server
+// does not share memory with us.
+static void allocframebuffer(int32_t width, int32_t height) {
+  freeframebuffer();
+  g.width = width;
+  g.height = height;
+  if (!g.dpy) {
+    g.pixels = malloc((size_t)width * height * 4);
+    return;
+  }
+  if (XShmQueryExtension(g.dpy)) {
+    g.image = XShmCreateImage(g.dpy, g.visual, g.depth, ZPixmap, NULL, &g.shm, width, height);
+    if (g.image && g.image->bits_per_pixel == 32 && g.image->bytes_per_line == width * 4) {
+      g.shm.shmid = shmget(IPC_PRIVATE, (size_t)g.image->bytes_per_line * height, IPC_CREAT | 0600);
+      g.shm.shmaddr = g.shm.shmid < 0 ? (void*)-1 : shmat(g.shm.shmid, NULL, 0);
+      g.shm.readOnly = False;
+      if (g.shm.shmaddr != (void*)-1 && XShmAttach(g.dpy, &g.shm)) {
+        XSync(g.dpy, False);
+        // Gone once both sides detached
+        shmctl(g.shm.shmid, IPC_RMID, NULL);
+        g.image->data = g.shm.shmaddr;
+        g.pixels = (uint32_t*)g.image->data;
+        g.shared = true;
+        return;
+      }
+      if (g.shm.shmaddr != (void*)-1) shmdt(g.shm.shmaddr);
+      if (g.shm.shmid >= 0) shmctl(g.shm.shmid, IPC_RMID, NULL);
+    }
+    if (g.image) XDestroyImage(g.image);
+    g.image = NULL;
+  }
+  g.pixels = malloc((size_t)width * height * 4);
+  g.image = XCreateImage(g.dpy, g.visual, g.depth, ZPixmap, 0, (char*)g.pixels,
+                         width, height, 32, width * 4);
+}
+
+const uint32_t* softframe(int32_t width, int32_t height) {
+  if (!g.ready || !s.rows || !s.cols || width <= 0 || height <= 0) return g.pixels;
+  bool all = s.fullrerender;
+  if (width != g.width || height != g.height || !g.pixels) {
+    allocframebuffer(width, height);
+    all = true;
+  }
+  if (g.cols != s.cols || g.rows != s.rows) {
+    g.cols = s.cols;
+    g.rows = s.rows;
+    free(g.cells);
+    g.cells = malloc((size_t)s.cols * s.rows * sizeof(*g.cells));
+    all = true;
+  }
+  if (arrlenu(g.alpha) > SOFT_GLYPH_MEMORY) {
+    // Rows drawn already point at glyphs of the old cache
+    resetglyphs();
+    all = true;
+  }
+  s.fullrerender = false;
+
+  bool changed[s.rows];
+  for (int32_t y = 0; y < s.rows; y++) {
+    damage_t d = s.damage[y];
+    changed[y] = all || d.maxcol >= d.mincol;
+    if (!changed[y]) continue;
+    setdirty(y, false);
+    resolverow(y);
+  }
+
+  // Rows the cursor left and entered
+  int32_t lastrow = g.cursorrow, cursorrow = s.cursor.y + s.viewoffset;
+  bool moved = cursorrow != g.cursorrow || s.cursor.x != g.cursorcol;
+  g.cursorrow = cursorrow >= 0 && cursorrow < s.rows ? cursorrow : -1;
+  g.cursorcol = s.cursor.x;
+  for (int32_t y = 0; y < s.rows; y++) {
+    bool draw = changed[y] || (moved && (y == lastrow || y == g.cursorrow)) ||
+      (g.below > 0 && y > 0 && changed[y - 1]) ||
+      (g.above > 0 && y + 1 < s.rows && changed[y + 1]);
+    if (draw) drawband(y);
+  }
+  return g.pixels;
+}
+
+void softpresent(bool all) {
+  if (!g.image) return;
+  int32_t top = all ? 0 : g.top, bottom = all ? g.height : g.bottom;
+  if (top < bottom) {
+    if (g.shared)
+      XShmPutImage(g.dpy, g.win, g.gc, g.image, 0, top, 0, top, g.width, bottom - top, False);
+    else
+      XPutImage(g.dpy, g.win, g.gc, g.image, 0, top, 0, top, g.width, bottom - top);
+    // The next frame draws into the memory the server reads from
+    XSync(g.dpy, False);
+  }
+  g.top = INT32_MAX;
+  g.bottom = 0;
+}
+
+bool writeppm(const char* path, const uint32_t* pixels, int32_t width, int32_t height) {
+  FILE* f = fopen(path, "wb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  uint8_t* row = malloc((size_t)width * 3);
+  for (int32_t y = 0; y < height; y++) {
+    const uint32_t* src = pixels + (size_t)y * width;
+    for (int32_t x = 0; x < width; x++) {
+      row[x * 3] = src[x] >> 16;
+      row[x * 3 + 1] = src[x] >> 8;
+      row[x * 3 + 2] = src[x];
+    }
+    fwrite(row, 3, width, f);
+  }
+  free(row);
+  bool ok = !ferror(f);
+  if (fclose(f) != 0 || !ok) {
+    perror(path);
+    return false;
+  }
+  return true;
+}
+
+void softshutdown(void) {
+  if (!g.ready) return;
+  freeframebuffer();
+  if (g.gc) XFreeGC(g.dpy, g.gc);
+  free(g.cells);
+  arrfree(g.glyphs);
+  arrfree(g.alpha);
+  hmfree(g.bycodepoint);
+  memset(&g, 0, sizeof(g));
+}
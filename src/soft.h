@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <X11/Xlib.h>
+
+#include "tyr.h"
+
+// Draws the screen on the CPU, without OpenGL. Glyphs are rasterized
+// once by FreeType and blended into a framebuffer of 0xffRRGGBB pixels,
+// only the rows that changed are drawn again. With a window the
+// framebuffer is an XShm image that is put onto it.
+
+// Sets up to draw glyphs of face at its current pixel size
+void softinit(FT_Face face);
+
+// Draws into an XShm image of win from now on. Returns false if the
+// visual is not 32 bit TrueColor.
+bool softattach(Display* dpy, Window win);
+
+// Draws the damaged rows into the framebuffer, which is sized to width
+// x height pixels. Returns it.
+const uint32_t* softframe(int32_t width, int32_t height);
+
+// Puts what the last frames drew onto the window, everything if all
+// is set
+void softpresent(bool all);
+
+// Writes pixels of width x height as a binary PPM, the top byte is 
+// ignored
+bool writeppm(const char* path, const uint32_t* pixels, int32_t width, int32_t height);
+
+void softshutdown(void);
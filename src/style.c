@@ -0,0 +1,178 @@
+#include "style.h"
+
+#include <string.h>
+
+#include "config.h"
+#include "../vendor/stb_ds.h"
+
+// Styles are four words, padding included
+static uint32_t stylehash(const style_t* st) {
+  uint32_t w[4];
+  memcpy(w, st, sizeof(w));
+  uint64_t h = (w[0] * 0x9e3779b97f4a7c15ULL) ^ w[1];
+  h = (h * 0x9e3779b97f4a7c15ULL) ^ w[2];
+  h = (h * 0x9e3779b97f4a7c15ULL) ^ w[3];
+  h *= 0x9e3779b97f4a7c15ULL;
+  return h >> 32;
+}
+
+static void styleinsert(uint32_t id) {
+  style_table_t* t = &s.styles;
+  uint32_t i = stylehash(&t->items[id]) & (t->nslots - 1);
+  while (t->slots[i]) i = (i + 1) & (t->nslots - 1);
+  t->slots[i] = id + 1;
+}
+
+// Kept at most half full
+static void stylegrow(void) {
+  style_table_t* t = &s.styles;
+  free(t->slots);
+  t->nslots = t->nslots ? t->nslots * 2 : 256;
+  t->slots = calloc(t->nslots, sizeof(*t->slots));
+  for (uint32_t id = 0; id < arrlenu(t->items); id++) 
+    styleinsert(id);
+}
+
+// Nearest color of the 6x6x6 cube of the 256 color palette
+static uint32_t palettecolor(uint32_t color) {
+  if (COLOR_KIND(color) != COLOR_RGB) return color;
+  uint32_t idx = 16;
+  for (int32_t shift = 16, mul = 36; shift >= 0; shift -= 8, mul /= 6) {
+    uint32_t v = (color >> shift) & 0xff;
+    idx += mul * (v < 48 ? 0 : v < 115 ? 1 : (v - 35) / 40);
+  }
+  return COLOR_PALETTE | idx;
+}
+
+uint32_t styleintern(const style_t* style) {
+  style_table_t* t = &s.styles;
+  uint32_t h = stylehash(style);
+  for (uint32_t i = h & (t->nslots - 1); t->slots[i]; i = (i + 1) & (t->nslots - 1)) {
+    uint32_t id = t->slots[i] - 1;
+    if (!memcmp(&t->items[id], style, sizeof(*style))) return id;
+  }
+
+  if (arrlenu(t->items) >= STYLE_TABLE_MAX) {
+    style_t reduced = *style;
+    reduced.fg = palettecolor(style->fg);
+    reduced.bg = palettecolor(style->bg);
+    reduced.ulcolor = palettecolor(style->ulcolor);
+    if (memcmp(&reduced, style, sizeof(*style))) return styleintern(&reduced);
+    return 0;
+  }
+
+  uint32_t id = arrlenu(t->items);
+  arrput(t->items, *style);
+  if (arrlenu(t->items) * 2 > t->nslots) stylegrow();
+  else styleinsert(id);
+  return id;
+}
+
+void setpen(uint32_t id) {
+  uint32_t bg = s.pen.bg;
+  s.pen = *getstyle(id);
+  s.penid = id;
+  // Erased cells take the background color, nothing else
+  if (s.pen.bg == COLOR_DEFAULT) {
+    s.blankid = 0;
+  } else if (s.pen.bg != bg) {
+    style_t blank = { .bg = s.pen.bg };
+    s.blankid = styleintern(&blank);
+  }
+}
+
+// A color given by 38, 48 or 58 and the parameters after it at *i: 
+// 5;n or 2;r;g;b, or with colons 5:n or 2:[colorspace]:r:g:b
+static bool extcolor(const int* params, uint32_t nparams, uint32_t subparams, 
+                     uint32_t* i, uint32_t* color) {
+  uint32_t k = *i + 1;
+  if (k >= nparams) return false;
+  bool colon = subparams & (1u << k);
+  // Parameters that belong to this color
+  uint32_t end = nparams;
+  if (colon) {
+    end = k + 1;
+    while (end < nparams && (subparams & (1u << end))) end++;
+  }
+  bool ok = false;
+  if (params[k] == 5 && k + 1 < end) {
+    *color = COLOR_PALETTE | (params[k + 1] & 0xff);
+    *i = k + 1;
+    ok = true;
+  } else if (params[k] == 2) {
+    if (colon && end - k > 4) k++; // color space id
+    if (k + 3 < end) {
+      *color = COLOR_RGB | (params[k + 1] & 0xff) << 16 | 
+        (params[k + 2] & 0xff) << 8 | (params[k + 3] & 0xff);
+      *i = k + 3;
+      ok = true;
+    }
+  }
+  // An incomplete color takes the rest of the sequence with it
+  if (colon || !ok) *i = end - 1;
+  return ok;
+}
+
+void handlesgr(const int* params, uint32_t nparams, uint32_t subparams) {
+  style_t style = s.pen;
+  style_t* pen = &style;
+  // CSI m is CSI 0 m
+  if (!nparams) nparams = 1;
+  for (uint32_t i = 0; i < nparams; i++) {
+    int32_t p = params[i];
+    switch (p) {
+      case 0: *pen = (style_t){0}; break;
+      case 1: pen->attrs |= FONT_BOLD; break;
+      case 2: pen->attrs |= FONT_DIM; break;
+      case 3: pen->attrs |= FONT_ITALIC; break;
+      case 4:
+        // 4:n picks the kind of underline, 4:0 removes it
+        if (i + 1 < nparams && (subparams & (1u << (i + 1)))) {
+          int32_t kind = params[++i];
+          if (kind <= UNDERLINE_DASHED) pen->underline = kind;
+        } else {
+          pen->underline = UNDERLINE_SINGLE;
+        }
+        break;
+      case 5: 
+      case 6: pen->attrs |= FONT_BLINK; break;
+      case 7: pen->attrs |= FONT_REVERSE; break;
+      case 8: pen->attrs |= FONT_HIDDEN; break;
+      case 9: pen->attrs |= FONT_STRIKETHROUGH; break;
+      case 21: pen->underline = UNDERLINE_DOUBLE; break;
+      case 22: pen->attrs &= ~(FONT_BOLD | FONT_DIM); break;
+      case 23: pen->attrs &= ~FONT_ITALIC; break;
+      case 24: pen->underline = UNDERLINE_NONE; break;
+      case 25: pen->attrs &= ~FONT_BLINK; break;
+      case 27: pen->attrs &= ~FONT_REVERSE; break;
+      case 28: pen->attrs &= ~FONT_HIDDEN; break;
+      case 29: pen->attrs &= ~FONT_STRIKETHROUGH; break;
+      case 30 ... 37: pen->fg = COLOR_PALETTE | (p - 30); break;
+      case 38: extcolor(params, nparams, subparams, &i, &pen->fg); break;
+      case 39: pen->fg = COLOR_DEFAULT; break;
+      case 40 ... 47: pen->bg = COLOR_PALETTE | (p - 40); break;
+      case 48: extcolor(params, nparams, subparams, &i, &pen->bg); break;
+      case 49: pen->bg = COLOR_DEFAULT; break;
+      case 53: pen->attrs |= FONT_OVERLINED; break;
+      case 55: pen->attrs &= ~FONT_OVERLINED; break;
+      case 58: extcolor(params, nparams, subparams, &i, &pen->ulcolor); break;
+      case 59: pen->ulcolor = COLOR_DEFAULT; break;
+      case 90 ... 97: pen->fg = COLOR_PALETTE | (p - 90 + CLR_BRIGHT_BLACK); break;
+      case 100 ... 107: pen->bg = COLOR_PALETTE | (p - 100 + CLR_BRIGHT_BLACK); break;
+      default: break;
+    }
+    // Sub-parameters of codes that take none are skipped
+    while (i + 1 < nparams && (subparams & (1u << (i + 1)))) i++;
+  }
+  setpen(styleintern(pen));
+}
+
+void stylereset(void) {
+  arrfree(s.styles.items);
+  free(s.styles.slots);
+  s.styles = (style_table_t){0};
+  arrput(s.styles.items, (style_t){0});
+  stylegrow();
+  s.pen = (style_t){0};
+  s.penid = s.blankid = s.saved_penid = 0;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "tyr.h"
+
+// Id of a style, storing it if it is new. Called from the parser only.
+uint32_t styleintern(const style_t* style);
+
+static inline const style_t* getstyle(uint32_t id) {
+  return &s.styles.items[id];
+}
+
+// Sets the pen from SGR parameters
+void handlesgr(const int* params, uint32_t nparams, uint32_t subparams);
+
+// Sets the pen, as restored with the cursor
+void setpen(uint32_t id);
+
+// Forgets every style but the default one, id 0, and resets the pen. 
+// Also sets the table up at startup.
+void stylereset(void);
@@ -7,6 +7,8 @@
 
 #include "pty.h"
 #include "render.h"
+#include "scrollback.h"
+#include "style.h"
 
 
 const uint32_t dec_special_graphics[128]= {
@@ -102,24 +104,6 @@ const uint32_t dec_special_graphics[128]= {
 };
 
 
-int32_t utf8decode(const char *s, uint32_t *out_cp) {
-  unsigned char c = s[0];
-  if (c < 0x80) {
-    *out_cp = c;
-    return 1;
-  } else if ((c >> 5) == 0x6) {
-    *out_cp = ((c & 0x1F) << 6) | (s[1] & 0x3F);
-    return 2;
-  } else if ((c >> 4) == 0xE) {
-    *out_cp = ((c & 0x0F) << 12) | ((s[1] & 0x3F) << 6) | (s[2] & 0x3F);
-    return 3;
-  } else if ((c >> 3) == 0x1E) {
-    *out_cp = ((c & 0x07) << 18) | ((s[1] & 0x3F) << 12) | ((s[2] & 0x3F) << 6) | (s[3] & 0x3F);
-    return 4;
-  }
-  return -1; // invalid UTF-8
-}
-
 int32_t utf8encode(uint32_t codepoint, char *out) {
   if (codepoint <= 0x7F) {
     out[0] = codepoint;
@@ -143,17 +127,56 @@ int32_t utf8encode(uint32_t codepoint, char *out) {
   return 0;
 }
 
+static cell_t** ringslot(int32_t logicalrow) {
+  // Negative rows reach into the scrollback
+  int32_t physrow = s.grid.head + logicalrow;
+  if (physrow >= s.grid.nrows) physrow -= s.grid.nrows;
+  else if (physrow < 0) physrow += s.grid.nrows;
+  return &s.grid.lines[physrow];
+}
+
 cell_t* getphysrow(int32_t logicalrow) {
-  int32_t physrow = (s.head + logicalrow) % MAX_ROWS;
-  return &s.cells[physrow * s.cols];
+  return *ringslot(logicalrow);
+}
+
+cell_t* getviewrow(int32_t viewrow) {
+  int32_t line = viewrow - s.viewoffset;
+  if (line >= -s.grid.histlen) return getphysrow(line);
+
+  // Older lines only exist in the compact history
+  cell_t* row = &s.scrollback.viewrows[viewrow * s.cols];
+  scrollbackrow((size_t)(-line - s.grid.histlen), row, s.cols);
+  return row;
+}
+
+static int32_t historylines(void) {
+  if (lf_flag_exists(&s.termmode, TERM_MODE_ALTSCREEN)) return 0;
+  return s.grid.histlen + (int32_t)scrollbackrows();
+}
+
+void scrollview(int32_t lines) {
+  int32_t offset = CLAMP(s.viewoffset + lines, 0, historylines());
+  if (offset == s.viewoffset) return;
+  s.viewoffset = offset;
+  s.fullrerender = true;
+
+  // Start reading spilled history for this page and the one above it,
+  // before it is drawn. Rewrapped history only gets its exact length 
+  // once it is reached, so the offset is checked again.
+  int32_t coldrows = s.viewoffset - s.grid.histlen;
+  if (coldrows > 0) {
+    scrollbackprefetch(MAX(coldrows - s.rows + 1, 1), coldrows + s.rows);
+    s.viewoffset = MIN(s.viewoffset, historylines());
+  }
 }
 
 char* getrowutf8(uint32_t idx) {
   char* row = malloc((s.cols * 4) + 1);
   char* ptr = row;
 
+  cell_t* cells = getviewrow(idx);
   for (uint32_t i = 0; i < (uint32_t)s.cols; i++) {
-    uint32_t cp = s.cells[idx * s.cols + i].codepoint;
+    uint32_t cp = cells[i].codepoint;
     ptr += utf8encode(cp, ptr);
   }
 
@@ -205,18 +228,25 @@ void handletab(int32_t count) {
 }
 
 cell_t* cellat(int32_t x, int32_t y) {
-  int32_t physrow = (s.head + y) % MAX_ROWS;
-  return &s.cells[physrow * s.cols + x];
+  return &getphysrow(y)[x];
 }
 void setcell(int32_t x, int32_t y, uint32_t codepoint) {
-  s.cells[y * s.cols + x].codepoint = codepoint;
-  setdirty(y,true);
+  getphysrow(y)[x] = (cell_t){ .codepoint = codepoint, .style = s.penid };
+  damagecells(y, x, x + 1);
+}
+
+void clearcells(int32_t y, int32_t from, int32_t to) {
+  cell_t* row = getphysrow(y);
+  for (int32_t x = MAX(from, 0); x < MIN(to, s.cols); x++)
+    row[x] = (cell_t){ .codepoint = ' ', .style = s.blankid };
+  damagecells(y, from, to);
 }
 
 void togglealtscreen(void) {
-  cell_t* tmp = s.cells;
-  s.cells = s.altcells;
-  s.altcells = tmp;
+  grid_t tmp = s.grid;
+  s.grid = s.altgrid;
+  s.altgrid = tmp;
+  s.viewoffset = 0;
   s.termmode ^= TERM_MODE_ALTSCREEN;
   for(int32_t i = 0; i < s.rows; i++) {
     setdirty(i, true);
@@ -232,21 +262,19 @@ void moveto(int32_t x, int32_t y) {
   s.cursor.x = CLAMP(x, 0, s.cols - 1);
   s.cursor.y = CLAMP(y, miny, maxy);
   lf_flag_unset(&s.cursorstate, CURSOR_STATE_ONWRAP);
-  if(y > s.rows - 1)
-    setdirty(y, true);
 }
 
 void handlealtcursor(cursor_action_t action) {
   if(action == CURSOR_ACTION_STORE) {
     s.altcursor = s.cursor;
+    s.saved_penid = s.penid;
     s.saved_scrollbottom = s.scrollbottom;
     s.saved_scrolltop = s.scrolltop;
-    s.saved_head = s.head;
   } else {
     s.cursor = s.altcursor;
+    setpen(s.saved_penid);
     s.scrolltop = s.saved_scrolltop;
     s.scrollbottom = s.saved_scrollbottom;
-    s.head = s.saved_head;
     moveto(s.cursor.x, s.cursor.y);
   }
 }
@@ -261,7 +289,6 @@ void movetodecom(int32_t x, int32_t y) {
   bool cursororigin = lf_flag_exists(&s.cursorstate, CURSOR_STATE_ORIGIN); 
   moveto(
     x, y + (cursororigin ? s.scrolltop : 0));
-  setdirty(y, true);
 }
 void 
 deletecells(int32_t ncells) {
@@ -279,12 +306,10 @@ deletecells(int32_t ncells) {
   memmove(
     &cursorrow[dest], 
     &cursorrow[src], n * sizeof(cell_t));
+  damagecells(s.cursor.y, dest, s.cols);
 
-  setdirty(s.cursor.y, true);
   // clear the trailing garbage characters after the move
-  for(int32_t x = s.cols - ncells; x < s.cols; x++) {
-    cursorrow[x].codepoint = ' ';
-  }
+  clearcells(s.cursor.y, s.cols - ncells, s.cols);
 }
 
 void insertblankchars(int32_t nchars) {
@@ -304,52 +329,75 @@ void insertblankchars(int32_t nchars) {
   memmove(
     &cursorrow[dest], 
     &cursorrow[src], n * sizeof(cell_t));
-  setdirty(s.cursor.y, true);
+  damagecells(s.cursor.y, src, s.cols);
 
   // Insert blank cells
-  for (int32_t x = src; x < dest; x++) {
-    cursorrow[x].codepoint = ' ';
-  }
+  clearcells(s.cursor.y, src, dest);
+}
+
+// Moves screen rows [top, bottom] up by n rows, the n rows pushed out 
+// at the top come back at the bottom.
+static void rotaterows(int32_t top, int32_t bottom, int32_t n) {
+  int32_t len = bottom - top + 1;
+  if (n <= 0 || n >= len) return;
+  cell_t* out[n];
+  for (int32_t i = 0; i < n; i++)
+    out[i] = *ringslot(top + i);
+  for (int32_t i = top; i + n <= bottom; i++)
+    *ringslot(i) = *ringslot(i + n);
+  for (int32_t i = 0; i < n; i++)
+    *ringslot(bottom - n + 1 + i) = out[i];
 }
 
 void scrollup(int32_t start, int32_t scrolls) {
   if (scrolls <= 0) return;
+  scrolls = MIN(scrolls, s.scrollbottom - start + 1);
 
   for(int32_t i = start; i <= s.scrollbottom; i++) {
     setdirty(i, true);
   }
-  for (int32_t i = 0; i <= s.scrollbottom - start - scrolls; i++) {
-    cell_t* src = getphysrow(start + scrolls + i);
-    cell_t* dest = getphysrow(start + i);
-    memcpy(dest, src, sizeof(cell_t) * s.cols);
+  if (start == 0 && s.scrollbottom == s.rows - 1) {
+    // The whole screen scrolls: advance the ring, the top lines become 
+    // scrollback and the oldest ring rows are reused at the bottom. 
+    // What they held moves to the compact history first.
+    if (!lf_flag_exists(&s.termmode, TERM_MODE_ALTSCREEN)) {
+      int32_t evicted = s.grid.histlen + scrolls - (s.grid.nrows - s.rows);
+      for (int32_t i = 0; i < evicted; i++)
+        scrollbackpush(getphysrow(i - s.grid.histlen), s.cols);
+    }
+    s.grid.head = (s.grid.head + scrolls) % s.grid.nrows;
+    s.grid.histlen = MIN(s.grid.histlen + scrolls, s.grid.nrows - s.rows);
+    // Keep a scrolled back view on the same lines
+    if (s.viewoffset) 
+      s.viewoffset = MIN(s.viewoffset + scrolls, historylines());
+  } else {
+    rotaterows(start, s.scrollbottom, scrolls);
   }
 
   // Clear lines at the bottom
   for (int32_t i = s.scrollbottom - scrolls + 1; i <= s.scrollbottom; i++) {
     cell_t* row = getphysrow(i);
     for (int32_t x = 0; x < s.cols; x++) {
-      row[x].codepoint = ' ';
+      row[x] = (cell_t){ .codepoint = ' ', .style = s.blankid };
     }
   }
 }
 
 void scrolldown(int32_t start, int32_t scrolls) {
   if (scrolls <= 0) return;
+  scrolls = MIN(scrolls, s.scrollbottom - start + 1);
 
-  for(int32_t i = start; i < s.scrollbottom-scrolls; i++) {
+  for(int32_t i = start; i <= s.scrollbottom; i++) {
     setdirty(i, true);
   }
-  for (int32_t i = s.scrollbottom - start - scrolls; i >= 0; i--) {
-    cell_t* src = getphysrow(start + i);
-    cell_t* dest = getphysrow(start + i + scrolls);
-    memcpy(dest, src, sizeof(cell_t) * s.cols);
-  }
+  // The bottom rows come back at the top, where they are cleared
+  rotaterows(start, s.scrollbottom, s.scrollbottom - start + 1 - scrolls);
 
   // Clear lines at the top
   for (int32_t i = start; i < start + scrolls; i++) {
     cell_t* row = getphysrow(i);
     for (int32_t x = 0; x < s.cols; x++) {
-      row[x].codepoint = ' ';
+      row[x] = (cell_t){ .codepoint = ' ', .style = s.blankid };
     }
   }
 }
@@ -438,12 +486,8 @@ void settermmode(
         case 1047: {
           bool inaltscreen = lf_flag_exists(&s.termmode, TERM_MODE_ALTSCREEN);
           if (inaltscreen) {
-            for (int32_t y = 0; y < s.rows; y++) {
-              setdirty(y, true);
-              for (int32_t x = 0; x < s.cols; x++) {
-                cellat(x, y)->codepoint = ' ';
-              }
-            }
+            for (int32_t y = 0; y < s.rows; y++)
+              clearcells(y, 0, s.cols);
           }
           if (toggle != inaltscreen) {
             togglealtscreen();
@@ -483,34 +527,30 @@ void settermmode(
   }
 }
 
-bool handleescseq(uint32_t c) {
-  switch(c) {
-    case '[':
-      lf_flag_set(&s.escflags, ESC_STATE_CSI);
-      return true;
-    case '#':
-      s.escflags |= ESC_STATE_TEST;
-      return true;
-    case '%':
-      s.escflags |= ESC_STATE_UTF8;
-      return true;
-    case 'P':
-    case '_':
-    case '^':
-    case ']':
-    case 'k':
-      s.escflags |= ESC_STATE_STR;
-      return true;
-    case 'n': 
-    case 'o':
-      // locking shift
+void handleescseq(uint32_t c) {
+  switch(s.csiseq.intermediate) {
+    case '\0':
       break;
     case '(': 
     case ')':
     case '*':
     case '+':
-      s.escflags |= ESC_STATE_ALTCHARSET;
-      return true;
+      // designate charset
+      if (c == '0') {
+        s.charset = CHARSET_ALT;
+      } else if (c == 'B') {
+        s.charset = CHARSET_ASCII;
+      }
+      return;
+    default:
+      // '#' (DEC tests) and '%' (charset selection) are not supported
+      return;
+  }
+  switch(c) {
+    case 'n': 
+    case 'o':
+      // locking shift
+      break;
     case 'D': 
       if (s.cursor.y == s.scrollbottom) {
         scrollup(s.scrolltop, 1);
@@ -551,52 +591,11 @@ bool handleescseq(uint32_t c) {
       handlealtcursor(CURSOR_ACTION_RESTORE);
       break;
     case '\\': 
-      // TODO: String terminator
+      // String terminator
       break;
     default:
       break;
   }
-  return false;
-}
-
-void parsecsi(void) {
-  if (!s.csiseq.len) return;
-  s.csiseq.buf[s.csiseq.len] = '\0';
-  s.csiseq.nparams = 0;
-  uint32_t i = 0;
-  if (s.csiseq.buf[i] == '?') {
-    s.csiseq.prefix = s.csiseq.buf[i];
-    i++;
-  } else {
-    s.csiseq.prefix = '\0';
-  }
-
-  char argbuf[64] = {0};
-  uint32_t argidx = 0;
-  for (; i < s.csiseq.len; i++) {
-    if (s.csiseq.nparams >= ESC_PARAM_SIZE) break;
-    if (isdigit(s.csiseq.buf[i])) {
-      if (argidx < sizeof(argbuf) - 1) {
-        argbuf[argidx++] = s.csiseq.buf[i];
-      }
-    } else if (s.csiseq.buf[i] == ';') {
-      argbuf[argidx] = '\0';
-      s.csiseq.params[s.csiseq.nparams++] = atoi(argbuf);
-      memset(argbuf, 0, sizeof(argbuf));
-      argidx = 0;
-    } else {
-      break;
-    }
-  }
-
-  if (argidx > 0 && s.csiseq.nparams < ESC_PARAM_SIZE) {
-    argbuf[argidx] = '\0';
-    s.csiseq.params[s.csiseq.nparams++] = atoi(argbuf);
-  }
-
-  s.csiseq.cmd[0] = s.csiseq.buf[i];
-  if(i + 1 <= s.csiseq.len - 1) 
-    s.csiseq.cmd[1] = s.csiseq.buf[i + 1];
 }
 
 void  
@@ -607,7 +606,7 @@ handlecsi(void) {
       // print most recent character n times 
       uint32_t n = MIN(dp, SHRT_MAX);
       for(uint32_t i = 0; i < n; i++)
-        handlechar(s.recentcodepoint);
+        handleprint(s.recentcodepoint);
       break;
     } 
     case '@': { 
@@ -631,7 +630,7 @@ handlecsi(void) {
       moveto(s.cursor.x + dp, s.cursor.y);
       break;
     case 'c': 
-      if (s.csiseq.params[0] == 0)
+      if (s.csiseq.prefix == '\0' && s.csiseq.params[0] == 0)
         termwrite("\033[?6c", strlen("\033[?6c"), false);
       break;
     case 'D': 
@@ -681,19 +680,13 @@ handlecsi(void) {
       int32_t op = s.csiseq.params[0]; 
       if(op == 0) {
         // clear line right of cursor
-        for(int32_t x = s.cursor.x; x < s.cols; x++) {
-          cellat(x, s.cursor.y)->codepoint = ' ';
-        }
+        clearcells(s.cursor.y, s.cursor.x, s.cols);
       } else if(op == 1) {
         // clear line left of cursor
-        for(int32_t x = 0; x < s.cursor.x; x++) {
-          cellat(x, s.cursor.y)->codepoint = ' ';
-        }
+        clearcells(s.cursor.y, 0, s.cursor.x);
       } else if(op == 2) {
         // entire line 
-        for(int32_t x = 0; x < s.cols; x++) {
-          cellat(x, s.cursor.y)->codepoint = ' ';
-        }
+        clearcells(s.cursor.y, 0, s.cols);
       }
       break;
     }
@@ -702,39 +695,20 @@ handlecsi(void) {
       int32_t op = s.csiseq.params[0]; 
       if(op == 0) {
         // From cursor to end of screen
-        for(int32_t x = s.cursor.x; x < s.cols; x++) {
-          cellat(x, s.cursor.y)->codepoint = ' ';
-        }
-        if(s.cursor.y >= s.rows - 1) break;
-        for(int32_t y = s.cursor.y + 1; y < s.rows; y++) {
-          setdirty(y, true);
-          for(int32_t x = 0; x < s.cols; x++) {
-            cellat(x, y)->codepoint = ' ';
-          }
-        }
+        clearcells(s.cursor.y, s.cursor.x, s.cols);
+        for(int32_t y = s.cursor.y + 1; y < s.rows; y++)
+          clearcells(y, 0, s.cols);
       } else if(op == 1) {
         // From begin of screen to cursor
         if(s.cursor.y > 1) {
-          for(int32_t y = 0; y < s.cursor.y - 1; y++) {
-            setdirty(y, true);
-            for(int32_t x = 0; x < s.cols; x++) {
-              cellat(x, y)->codepoint = ' ';
-            }
-          }
-        }
-
-        setdirty(s.cursor.y, true);
-        for(int32_t x = 0; x < s.cursor.x; x++) {
-          cellat(x, s.cursor.y)->codepoint = ' ';
+          for(int32_t y = 0; y < s.cursor.y - 1; y++)
+            clearcells(y, 0, s.cols);
         }
+        clearcells(s.cursor.y, 0, s.cursor.x);
       } else if (op == 2) {
         // Entire screen
-        for(int32_t y = 0; y < s.rows; y++) {
-          setdirty(y, true);
-          for(int32_t x = 0; x < s.cols; x++) {
-            cellat(x, y)->codepoint = ' ';
-          }
-        }
+        for(int32_t y = 0; y < s.rows; y++)
+          clearcells(y, 0, s.cols);
       }
       break;
     }
@@ -763,9 +737,12 @@ handlecsi(void) {
       break;
     case 'X':
       // clear n cells
-      for(int32_t x = s.cursor.x; x < s.cursor.x + (int32_t)dp && x < s.cols; x++) {
-        cellat(x, s.cursor.y)->codepoint = ' ';
-      }
+      clearcells(s.cursor.y, s.cursor.x, s.cursor.x + (int32_t)dp);
+      break;
+    case 'm':
+      // Colors and attributes, CSI > m sets key modifier options
+      if (s.csiseq.prefix == '\0')
+        handlesgr(s.csiseq.params, s.csiseq.nparams, s.csiseq.subparams);
       break;
     case 'h': 
       // Set terminal mode 
@@ -790,8 +767,13 @@ handlecsi(void) {
     case 'r':
       // set scrolling region
       if (s.csiseq.prefix == '?') break; 
-      uint32_t top = s.csiseq.nparams > 0 ? s.csiseq.params[0] - 1 : 0;
-      uint32_t bottom = s.csiseq.nparams > 1 ? s.csiseq.params[1] - 1 : s.rows - 1;
+      int32_t top = s.csiseq.nparams > 0 ? s.csiseq.params[0] - 1 : 0;
+      int32_t bottom = s.csiseq.nparams > 1 && s.csiseq.params[1] > 0 ? 
+        s.csiseq.params[1] - 1 : s.rows - 1;
+      top = CLAMP(top, 0, s.rows - 1);
+      bottom = CLAMP(bottom, 0, s.rows - 1);
+      // A region needs two lines at least
+      if (top >= bottom) break;
       s.scrolltop = top;
       s.scrollbottom = bottom;
       movetodecom(0, 0);
@@ -845,95 +827,35 @@ handlectrl(uint32_t c) {
     case 0x85:   
       newline(true); 
       break;
-    case '\033': /* ESC */
-      memset(&s.csiseq, 0, sizeof(s.csiseq));
-      lf_flag_unset(&s.escflags, ESC_STATE_CSI|ESC_STATE_ALTCHARSET|ESC_STATE_TEST);
-      lf_flag_set(&s.escflags, ESC_STATE_ON_ESC);
-      return;
     case '\032': /* SUB */
       setcell(s.cursor.x, s.cursor.y, '?'); 
       [[fallthrough]];
     default: break;
   }
-	lf_flag_unset(&s.escflags, ESC_STATE_STR_END|ESC_STATE_STR);
 }
 
-void handlechar(uint32_t c) {
-  //lf_flag_unset(&s.termmode, TERM_MODE_AUTO_WRAP);
+// Autowrap, the row is marked so history and reflow know the text 
+// goes on in the next row
+static void wrapline(void) {
+  getphysrow(s.cursor.y)[s.cols - 1].wrapped = 1;
+  newline(true);
+}
+
+void handleprint(uint32_t c) {
   int32_t w = 1;
-  bool ctrl = isctrl(c);
-  char utf8[4];
 
-  if (c < 127 || !lf_flag_exists(&s.termmode, TERM_MODE_UTF8)) {
-    utf8[0] = c;
-  } else {
-    utf8encode(c, utf8);
-    if (!ctrl) {
-      w = wcwidth(c);
-      if (w == -1) w = 1;
-    }
-  }
-
-  if (ctrl) {
-    if (isctrlc1(c))
-      return;
-
-    handlectrl(c);
-    if (s.escflags == 0)
-      s.recentcodepoint = 0;
-    return;
-  } else if (lf_flag_exists(&s.escflags, ESC_STATE_ON_ESC)) {
-    if (lf_flag_exists(&s.escflags, ESC_STATE_CSI)) {
-      s.csiseq.buf[s.csiseq.len++] = c;
-      if ((0x40 <= c && c <= 0x7E) || s.csiseq.len >= sizeof(s.csiseq.buf) - 1) {
-        s.escflags = 0;
-        parsecsi();
-        handlecsi();
-      }
-      return;
-    } else if (lf_flag_exists(&s.escflags, ESC_STATE_UTF8)) {
-      // UTF8 state handling
-    } else if (lf_flag_exists(&s.escflags, ESC_STATE_ALTCHARSET)) {
-      s.escflags &= ~ESC_STATE_ALTCHARSET;
-      if (c == '0') {
-        s.charset = CHARSET_ALT;
-      } else if (c == 'B') {
-        s.charset = CHARSET_ASCII;
-      }
-      return;
-    } else if (lf_flag_exists(&s.escflags, ESC_STATE_TEST)) {
-      // test handling
-    } else if (lf_flag_exists(&s.escflags, ESC_STATE_STR)) {
-      // Read until BEL (\a) or ESC 
-      if (c == '\a') { 
-        s.escflags &= ~ESC_STATE_STR;
-        return;
-      }
-      if (c == '\\' && s.csiseq.buf[s.csiseq.len - 1] == '\033') {
-        s.escflags &= ~ESC_STATE_STR;
-        return;
-      }
-      if (s.csiseq.len < sizeof(s.csiseq.buf) - 1) {
-        s.csiseq.buf[s.csiseq.len++] = c;
-      }
-      return;
-    }
-    else {
-      if (handleescseq(c))
-        return;
-    }
-    s.escflags = 0;
-    return;
+  if (c >= 127 && lf_flag_exists(&s.termmode, TERM_MODE_UTF8)) {
+    w = wcwidth(c);
+    if (w == -1) w = 1;
   }
 
   if (s.cursorstate & CURSOR_STATE_ONWRAP) {
-    printf("Moving cursor.\n");
-    newline(true);
+    wrapline();
   }
 	
   if (s.cursor.x+w> s.cols) {
 		if ( lf_flag_exists(&s.termmode, TERM_MODE_AUTO_WRAP))
-			newline(true);
+			wrapline();
 		else
 			moveto(s.cols - w, s.cursor.y);
 	}
@@ -944,9 +866,11 @@ void handlechar(uint32_t c) {
 
   setcell(s.cursor.x, s.cursor.y, c);
   if (w == 2 && s.cursor.x + 1 < s.cols) {
-    setcell(s.cursor.x + 1, s.cursor.y, ' ');
+    cell_t* row = getphysrow(s.cursor.y);
+    row[s.cursor.x].wide = 1;
+    row[s.cursor.x + 1] = (cell_t){ .codepoint = ' ', .widedummy = 1, .style = s.penid };
+    damagecells(s.cursor.y, s.cursor.x, s.cursor.x + 2);
   }
-  s.dirty[s.cursor.y] = true;
   s.recentcodepoint = c;
 
   if (s.cursor.x + w < s.cols) {
@@ -956,6 +880,53 @@ void handlechar(uint32_t c) {
   }
 }
 
+void handleprintrun(const char* buf, size_t len) {
+  // Same as calling handleprint() for every byte, but the row is 
+  // filled in one go and wrapped and damaged once per row.
+  while (len > 0) {
+    if (s.cursorstate & CURSOR_STATE_ONWRAP) {
+      wrapline();
+    }
+
+    cell_t* row = getphysrow(s.cursor.y);
+    int32_t x = s.cursor.x;
+    int32_t n = MIN((int32_t)len, s.cols - x);
+
+    if (s.charset == CHARSET_ALT) {
+      for (int32_t i = 0; i < n; i++) {
+        uint32_t c = (uint8_t)buf[i];
+        row[x + i] = (cell_t){ 
+          .codepoint = dec_special_graphics[c] ? dec_special_graphics[c] : c, .style = s.penid 
+        };
+      }
+    } else {
+      for (int32_t i = 0; i < n; i++) {
+        row[x + i] = (cell_t){ .codepoint = (uint8_t)buf[i], .style = s.penid };
+      }
+    }
+    damagecells(s.cursor.y, x, x + n);
+    s.recentcodepoint = row[x + n - 1].codepoint;
+
+    if (x + n < s.cols) {
+      moveto(x + n, s.cursor.y);
+    } else {
+      s.cursor.x = s.cols - 1;
+      s.cursorstate |= CURSOR_STATE_ONWRAP;
+    }
+    buf += n;
+    len -= n;
+  }
+}
+
 void setdirty(uint32_t rowidx, bool dirty) {
-  s.dirty[rowidx] = (uint8_t)dirty;
+  if (dirty) 
+    s.damage[rowidx] = (damage_t){ .mincol = 0, .maxcol = s.cols - 1 };
+  else
+    s.damage[rowidx] = (damage_t){ .mincol = INT32_MAX, .maxcol = -1 };
+}
+
+void damagecells(uint32_t rowidx, int32_t from, int32_t to) {
+  damage_t* d = &s.damage[rowidx];
+  d->mincol = MIN(d->mincol, MAX(from, 0));
+  d->maxcol = MAX(d->maxcol, MIN(to, s.cols) - 1);
 }
@@ -2,14 +2,19 @@
 
 #include "tyr.h"
 
-int32_t utf8decode(const char *s, uint32_t *out_cp);
-
 int32_t utf8encode(uint32_t codepoint, char *out);
 
 char* getrowutf8(uint32_t idx);
 
 cell_t* getphysrow(int32_t logicalrow);
 
+// Row of the screen as the user sees it, s.viewoffset lines back
+cell_t* getviewrow(int32_t viewrow);
+
+// Moves the view into the scrollback (lines > 0) or back towards the
+// live screen (lines < 0).
+void scrollview(int32_t lines);
+
 bool isctrl(uint32_t c);
 
 bool isctrlc1(uint32_t c);
@@ -20,6 +25,9 @@ cell_t* cellat(int32_t x, int32_t y);
 
 void setcell(int32_t x, int32_t y, uint32_t codepoint);
 
+// Blanks cells [from, to) of a screen row
+void clearcells(int32_t y, int32_t from, int32_t to);
+
 void togglealtscreen(void);
 
 void handlealtcursor(cursor_action_t action);
@@ -46,14 +54,19 @@ void settermmode(
   int32_t* params, 
   uint32_t nparams);
 
-bool handleescseq(uint32_t c);
-
-void parsecsi(void);
+void handleescseq(uint32_t c);
 
 void handlecsi(void);
 
 void handlectrl(uint32_t c);
 
-void handlechar(uint32_t c);
+void handleprint(uint32_t c);
+
+void handleprintrun(const char* buf, size_t len);
 
 void setdirty(uint32_t rowidx, bool dirty);
+
+// Marks columns [from, to) of a screen row for redrawing
+void damagecells(uint32_t rowidx, int32_t from, int32_t to);
+
+void resizeterm(int32_t w, int32_t h, int32_t cw, int32_t ch);
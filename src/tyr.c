@@ -1,5 +1,6 @@
 #include <GL/glx.h>
 #include <GLFW/glfw3.h>
+#include <X11/keysym.h>
 #include <leif/color.h>
 #include <leif/event.h>
 #include <leif/ez_api.h>
@@ -23,21 +24,50 @@
 #include "tyr.h"
 #include "term.h"
 #include "pty.h"
+#include "config.h"
+#include "coverage.h"
+#include "fallback.h"
+#include "gridgl.h"
+#include "headless.h"
+#include "record.h"
+#include "scrollback.h"
+#include "search.h"
+#include "shapecache.h"
+#include "soft.h"
+#include "style.h"
+
+#define TIMEDIFF(t1, t2) \
+  ((t1.tv_sec-t2.tv_sec)*1E3 + (t1.tv_nsec-t2.tv_nsec)/1E6)
 
 state_t s;
 
-static void resizeterm(int32_t w, int32_t h, int32_t cw, int32_t ch);
-
 void cleanup() {
   if (!s.pty) return;
+  if (getenv("TYR_FRAMESTATS")) {
+    fprintf(stderr, "tyr: %lu frames drawn, %lu frames dropped.\n",
+            (unsigned long)s.framesdrawn, (unsigned long)s.framesdropped);
+    fprintf(stderr, "tyr: shape cache: %lu hits, %lu misses, %zu bytes.\n",
+            (unsigned long)s.shapecache.hits, (unsigned long)s.shapecache.misses,
+            s.shapecache.bytes);
+  }
   kill(s.pty->childpid, SIGTERM);
+  shutdownpty(s.pty);
   close(s.pty->masterfd);
-  free(s.pty->buf);
   free(s.pty);
   s.pty = NULL;
-  free(s.cells);
-  free(s.altcells);
-  free(s.tabs);
+  if (s.recorder) {
+    stoprecording(s.recorder);
+    s.recorder = NULL;
+  }
+  searchshutdown();
+  gridglshutdown();
+  softshutdown();
+  fallbackshutdown();
+  scrollbackclear();
+  shapecacheclear();
+  coveragefree();
+  free(s.arena.mem[0]);
+  free(s.arena.mem[1]);
 }
 
 void siginthandler(int sig) {
@@ -46,19 +76,81 @@ void siginthandler(int sig) {
   exit(0);
 }
 
+// Typing while the search prompt is open edits the query, every edit
+// restarts the search
+static void searchinput(const char* utf8, uint32_t utf8len) {
+  search_t* se = &s.search;
+  size_t len = strlen(se->input);
+  if (utf8[0] == 0x1b) {
+    se->editing = false;
+    searchstop();
+    return;
+  }
+  if (utf8[0] == 0x7f || utf8[0] == 0x08) {
+    while (len > 0 && ((uint8_t)se->input[len - 1] & 0xC0) == 0x80) len--;
+    if (len > 0) len--;
+    se->input[len] = '\0';
+  } else if ((uint8_t)utf8[0] < 0x20) {
+    return;
+  } else {
+    if (len + utf8len >= sizeof(se->input)) return;
+    memcpy(se->input + len, utf8, utf8len);
+    se->input[len + utf8len] = '\0';
+  }
+  searchstart(se->input, se->inputregex);
+  s.fullrerender = true;
+}
+
 void charcb(lf_ui_state_t* ui, lf_window_t win, char* utf8, uint32_t utf8len) {
   (void)ui; (void)win;
+  if (s.search.editing) {
+    searchinput(utf8, utf8len);
+    return;
+  }
   if(
     strcmp(utf8, "\n") == 0 || 
     strcmp(utf8, "\r") == 0  
   ) return;
+  scrollview(-s.viewoffset);
   termwrite(utf8, utf8len, false);
 }
 
 void keycb(lf_ui_state_t* ui, lf_window_t win, int32_t key, int32_t scancode, int32_t action, int32_t mods) {
-  (void)ui; (void)win; (void)scancode; (void)mods;
+  (void)ui; (void)win; (void)scancode;
   if (action != LF_KEY_ACTION_PRESS) return;
+  // Shift+PageUp/PageDown page through the scrollback
+  if ((mods & ShiftMask) && (key == XK_Page_Up || key == XK_Page_Down)) {
+    scrollview(key == XK_Page_Up ? s.rows / 2 : -s.rows / 2);
+    return;
+  }
+  // Ctrl+Shift+F/R open the search prompt for text or a regex,
+  // Ctrl+Shift+N/P step to the older/newer match
+  if ((mods & ControlMask) && (mods & ShiftMask)) {
+    switch (key) {
+      case XK_f: case XK_F:
+      case XK_r: case XK_R:
+        s.search.editing = true;
+        s.search.inputregex = key == XK_r || key == XK_R;
+        s.search.input[0] = '\0';
+        searchstop();
+        s.fullrerender = true;
+        return;
+      case XK_n: case XK_N:
+        searchjump(true);
+        return;
+      case XK_p: case XK_P:
+        searchjump(false);
+        return;
+    }
+  }
+  if (key == KeyEnter && s.search.editing) {
+    s.search.editing = false;
+    searchjump(true);
+    s.fullrerender = true;
+    return;
+  }
   if (key == KeyEnter) {
+    scrollview(-s.viewoffset);
     char cr = '\r';
     termwrite(&cr, 1, false);
   }
@@ -85,16 +177,169 @@ void sendwinsize(int fd, int rows, int cols, int pixelw, int pixelh) {
   ioctl(fd, TIOCSWINSZ, &ws);
 }
 
-cell_t* reallocbuf(cell_t* old, int old_w, int old_h, int new_w, int new_h) {
-  cell_t* new = malloc(sizeof(cell_t) * new_w * new_h);
-  for (int r = 0; r < new_h; ++r) {
-    for (int c = 0; c < new_w; ++c) {
-      size_t idx = r * new_w + c;
-      new[idx] = (r < old_h && c < old_w) ? old[r * old_w + c] : (cell_t){ .codepoint = ' ' };
+static size_t arenaround(size_t size) {
+  return (size + 15) & ~(size_t)15;
+}
+
+// Bytes a resize carves out of the spare half for a geometry: the ring
+// with scrollback, the one without and the buffers sized by the screen
+static size_t geometrysize(int32_t cols, int32_t rows) {
+  size_t size = 0;
+  int32_t ringrows[2] = { rows + SCROLLBACK_HOT_LINES, rows };
+  for (int32_t i = 0; i < 2; i++) 
+    size += arenaround(sizeof(cell_t) * cols * ringrows[i]) + 
+      arenaround(sizeof(cell_t*) * ringrows[i]);
+  return size + arenaround(sizeof(cell_t) * cols * rows) + 
+    arenaround(sizeof(*s.tabs) * cols) + 
+    arenaround(sizeof(char*) * rows) + 
+    arenaround((size_t)rows * (cols * 4 + 1)) + 
+    arenaround(sizeof(damage_t) * rows);
+}
+
+// Makes the spare half hold at least size bytes. What was carved out 
+// of it so far moves along.
+static void arenareserve(size_t size) {
+  grid_arena_t* a = &s.arena;
+  uint32_t spare = !a->cur;
+  if (a->cap[spare] >= size) return;
+  size = MAX(size, a->cap[a->cur]);
+  a->mem[spare] = realloc(a->mem[spare], size);
+  if (!a->mem[spare]) {
+    perror("realloc");
+    exit(1);
+  }
+  a->cap[spare] = size;
+  a->grows++;
+}
+
+static void* arenaalloc(size_t size) {
+  grid_arena_t* a = &s.arena;
+  void* p = a->mem[!a->cur] + a->used;
+  a->used += arenaround(size);
+  return p;
+}
+
+// Copies the screen and as much scrollback as fits into a new ring, 
+// top-aligned and cut at the new width. Ring rows past the screen are 
+// left uninitialized, they are cleared when scrolling reaches them.
+void resizegrid(grid_t* g, int32_t old_cols, int32_t old_rows, 
+                int32_t new_cols, int32_t new_rows, int32_t scrollback) {
+  int32_t nrows = new_rows + scrollback;
+  int32_t histlen = MIN(g->histlen, scrollback);
+  cell_t* cells = arenaalloc(sizeof(cell_t) * new_cols * nrows);
+  cell_t** lines = arenaalloc(sizeof(cell_t*) * nrows);
+  for (int32_t r = 0; r < nrows; r++)
+    lines[r] = &cells[r * new_cols];
+  for (int32_t r = 0; r < histlen + new_rows; r++) {
+    int32_t line = r - histlen;
+    cell_t* src = NULL;
+    if (g->cells && line < old_rows) 
+      src = g->lines[(g->head + line + g->nrows) % g->nrows];
+    for (int32_t c = 0; c < new_cols; c++) 
+      lines[r][c] = (src && c < old_cols) ? src[c] : (cell_t){ .codepoint = ' ' };
+  }
+  *g = (grid_t){ 
+    .cells = cells, .lines = lines, .nrows = nrows, .head = histlen, .histlen = histlen 
+  };
+}
+
+typedef struct {
+  grid_t* g;
+  int32_t cols;
+  int64_t row; // rows started so far, the last one is being filled
+  int32_t col;
+} reflow_t;
+
+static cell_t* reflowrow(reflow_t* r) {
+  return r->g->lines[r->row % r->g->nrows];
+}
+
+// Rows that the new ring cannot hold go to the compact history
+static void reflownewrow(reflow_t* r) {
+  r->row++;
+  r->col = 0;
+  cell_t* row = reflowrow(r);
+  if (r->row >= r->g->nrows) 
+    scrollbackpush(row, r->cols);
+  for (int32_t x = 0; x < r->cols; x++)
+    row[x] = (cell_t){ .codepoint = ' ' };
+}
+
+static void reflowput(reflow_t* r, cell_t c) {
+  // A wide character does not fit into the last column
+  if (r->col == r->cols || (c.wide && r->col == r->cols - 1)) {
+    reflowrow(r)[r->cols - 1].wrapped = 1;
+    reflownewrow(r);
+  }
+  c.wrapped = 0;
+  reflowrow(r)[r->col++] = c;
+}
+
+static bool isblankcell(const cell_t* c) {
+  return c->codepoint == ' ' && !c->style && !c->widedummy;
+}
+
+// Rewraps the screen and its scrollback to new_cols: rows the text 
+// wrapped across are joined again and split at the new width. The 
+// bottom of the text stays at the bottom of the screen and cursor keeps
+// its place in the text, if given. The npulled rows in pulled (newest 
+// first) go before the history of the ring. History that no longer fits
+// into the ring is pushed to the compact history.
+void reflowgrid(grid_t* g, const cell_t* pulled, int32_t npulled, 
+                int32_t old_cols, int32_t old_rows, int32_t new_cols, 
+                int32_t new_rows, int32_t scrollback, cursor_t* cursor) {
+  grid_t ng = { .nrows = new_rows + scrollback };
+  ng.cells = arenaalloc(sizeof(cell_t) * new_cols * ng.nrows);
+  ng.lines = arenaalloc(sizeof(cell_t*) * ng.nrows);
+  for (int32_t r = 0; r < ng.nrows; r++)
+    ng.lines[r] = &ng.cells[r * new_cols];
+
+  reflow_t r = { .g = &ng, .cols = new_cols, .row = -1 };
+  int64_t cursorrow = -1;
+  int32_t cursorcol = 0;
+  if (g->cells) {
+    // Blank rows below the text and the cursor are left out
+    int32_t last = cursor ? cursor->y : -1;
+    for (int32_t y = old_rows - 1; y > last; y--) {
+      cell_t* row = g->lines[(g->head + y) % g->nrows];
+      int32_t x = 0;
+      while (x < old_cols && isblankcell(&row[x])) x++;
+      if (x < old_cols) last = y;
+    }
+    bool wrapped = false;
+    for (int32_t y = -g->histlen - npulled; y <= last; y++) {
+      const cell_t* row = y < -g->histlen 
+        ? &pulled[(size_t)(-g->histlen - y - 1) * old_cols]
+        : g->lines[(g->head + y + g->nrows) % g->nrows];
+      if (!wrapped) reflownewrow(&r);
+      wrapped = row[old_cols - 1].wrapped;
+      int32_t n = old_cols;
+      while (n > 0 && !wrapped && isblankcell(&row[n - 1])) n--;
+      bool hascursor = cursor && y == cursor->y;
+      if (hascursor) n = MAX(n, cursor->x + 1);
+      for (int32_t x = 0; x < n; x++) {
+        reflowput(&r, row[x]);
+        if (hascursor && x == cursor->x) {
+          cursorrow = r.row;
+          cursorcol = r.col - 1;
+        }
+      }
     }
   }
-  free(old);
-  return new;
+
+  int64_t total = r.row + 1;
+  int64_t top = MAX(total - new_rows, 0);
+  for (int64_t t = total; t < top + new_rows; t++) {
+    for (int32_t x = 0; x < new_cols; x++)
+      ng.lines[t][x] = (cell_t){ .codepoint = ' ' };
+  }
+  ng.head = top % ng.nrows;
+  ng.histlen = MIN(top, scrollback);
+  if (cursorrow >= 0) {
+    cursor->x = cursorcol;
+    cursor->y = cursorrow - top;
+  }
+  *g = ng;
 }
 
 void resizeterm(int32_t w, int32_t h, int32_t cw, int32_t ch) {
@@ -103,10 +348,38 @@ void resizeterm(int32_t w, int32_t h, int32_t cw, int32_t ch) {
   if (new_cols <= 0 || new_rows <= 0) return;
   int32_t old_cols = s.cols;
   int32_t old_rows = s.rows;
-  s.cells = reallocbuf(s.cells, old_cols, old_rows, new_cols, new_rows);
-  s.altcells = reallocbuf(s.altcells, old_cols, old_rows, new_cols, new_rows);
-  free(s.tabs);
-  s.tabs = malloc(sizeof(*s.tabs) * new_cols);
+  // The main screen is rewrapped, the alternate screen belongs to a 
+  // program that redraws it on SIGWINCH, it is only cut
+  bool inaltscreen = lf_flag_exists(&s.termmode, TERM_MODE_ALTSCREEN);
+  // The old buffers stay readable in the current half while the new 
+  // ones are carved out of the spare half. A line that wrapped from the 
+  // compact history into the ring goes first, it is rewrapped as a whole.
+  grid_arena_t* a = &s.arena;
+  size_t rowsize = sizeof(cell_t) * old_cols;
+  size_t geometry = geometrysize(new_cols, new_rows);
+  int32_t npulled = 0;
+  a->used = 0;
+  if (new_cols != old_cols) {
+    for (; npulled < SCROLLBACK_HOT_LINES; npulled++) {
+      arenareserve(arenaround(rowsize * (npulled + 1)) + geometry);
+      if (!scrollbackpop((cell_t*)(a->mem[!a->cur] + rowsize * npulled), old_cols)) break;
+    }
+    scrollbackreflow(new_cols);
+  }
+  arenareserve(arenaround(rowsize * npulled) + geometry);
+  cell_t* pulled = arenaalloc(rowsize * npulled);
+  if (inaltscreen) {
+    reflowgrid(&s.altgrid, pulled, npulled, old_cols, old_rows, new_cols, 
+               new_rows, SCROLLBACK_HOT_LINES, NULL);
+    resizegrid(&s.grid, old_cols, old_rows, new_cols, new_rows, 0);
+  } else {
+    reflowgrid(&s.grid, pulled, npulled, old_cols, old_rows, new_cols, 
+               new_rows, SCROLLBACK_HOT_LINES, &s.cursor);
+    resizegrid(&s.altgrid, old_cols, old_rows, new_cols, new_rows, 0);
+  }
+  s.viewoffset = 0;
+  s.scrollback.viewrows = arenaalloc(sizeof(cell_t) * new_cols * new_rows);
+  s.tabs = arenaalloc(sizeof(*s.tabs) * new_cols);
   for (int32_t i = 0; i < new_cols; i++) 
     s.tabs[i] = (i % 8 == 0);
   s.tabs[0] = 0;
@@ -115,20 +388,23 @@ void resizeterm(int32_t w, int32_t h, int32_t cw, int32_t ch) {
   s.rows = new_rows;
   s.cursor.x = s.cursor.x < new_cols ? s.cursor.x : new_cols - 1;
   s.cursor.y = s.cursor.y < new_rows ? s.cursor.y : new_rows - 1;
-  s.scrolltop = 0;
-  s.scrollbottom = new_rows - 1;
-  s.rowsunicode = malloc(sizeof(char*) * s.rows);
-  for (int32_t i = 0; i < s.rows; i++) 
-    s.rowsunicode[i] = malloc((s.cols * 4) + 1);
+  s.scrolltop = s.saved_scrolltop = 0;
+  s.scrollbottom = s.saved_scrollbottom = new_rows - 1;
+  s.rowsunicode = arenaalloc(sizeof(char*) * new_rows);
+  char* text = arenaalloc((size_t)new_rows * (new_cols * 4 + 1));
+  for (int32_t i = 0; i < new_rows; i++) 
+    s.rowsunicode[i] = &text[(size_t)i * (new_cols * 4 + 1)];
+  s.damage = arenaalloc(sizeof(damage_t) * new_rows);
+  a->cur = !a->cur;
   handlealtcursor(CURSOR_ACTION_STORE);
   handlealtcursor(CURSOR_ACTION_RESTORE);
-  s.dirty = realloc(s.dirty, new_rows * sizeof(uint8_t));
-  sendwinsize(s.pty->masterfd, s.rows, s.cols, w, h);
-
-  s.rowsunicode = realloc(s.rowsunicode, sizeof(char*) * s.rows);
-  for(int32_t i = 0; i < s.rows; i++) {
-    s.rowsunicode[i] = realloc(s.rowsunicode[i], (s.cols * 4) + 1);
-  }
+  // Rows of the new geometry are read from here on
+  searchrestart();
+  for (int32_t i = 0; i < new_rows; i++)
+    setdirty(i, true);
+  if (s.pty)
+    sendwinsize(s.pty->masterfd, s.rows, s.cols, w, h);
+  recordresize(s.cols, s.rows);
 }
 
 
@@ -166,22 +442,18 @@ void nextevent(lf_ui_state_t* ui) {
   lf_ui_core_shape_widgets_if_needed(ui, ui->root, false);
 
   vec2s winsize = lf_win_get_size(ui->win);
-  if(s.fullrerender) {
+  if (s.soft) {
+    // A refresh of the window puts all of it again
+    softframe(winsize.x, winsize.y);
+    softpresent(rendered);
+  } else if (s.gridgl) {
+    // The whole screen in one draw call, only changed rows are uploaded
+    gridglframe(winsize.x, winsize.y);
+  } else if(s.fullrerender) {
     for(int32_t i = 0; i < s.rows; i++) {
-      s.dirty[i] = true;
+      setdirty(i, true);
     }
-  }
-  int32_t largest = 0, smallest = -1;
-  for(int32_t i = 0; i < s.rows; i++) {
-    if(s.dirty[i]) {
-      if(smallest == -1) smallest = i;
-      if(i > largest) largest = i;
-    }
-  }
-
-  lf_container_t area;
-  if(s.fullrerender) {
-    area = LF_SCALE_CONTAINER(winsize.x, winsize.y);
+    lf_container_t area = LF_SCALE_CONTAINER(winsize.x, winsize.y);
     ui->render_clear_color_area(
       ui->root->props.color, 
       area, winsize.y);
@@ -189,29 +461,31 @@ void nextevent(lf_ui_state_t* ui) {
     renderterminalrows();
     ui->render_end(ui->render_state);
     s.fullrerender = false;
-  } else if (smallest != -1) {
-    if(smallest > s.last_cursor_row)
-      smallest = s.last_cursor_row;
-    uint32_t renderheight = (largest - smallest + 1) * s.font.font->line_h;
-    uint32_t renderstart = smallest * s.font.font->line_h;
-    printf("Rendering from %i to %i.\n", renderstart, renderstart + renderheight);
-    for(int32_t i = smallest; i <= largest; i++) {
-      s.dirty[i] = 1;
+  } else {
+    // The cursor is drawn along with the cell left of it, where it was
+    // and where it is now
+    int32_t cursorrow = s.cursor.y + s.viewoffset;
+    if (s.last_cursor_row >= 0 && s.last_cursor_row < s.rows)
+      damagecells(s.last_cursor_row, s.last_cursor_col - 1, s.last_cursor_col + 1);
+    if (cursorrow >= 0 && cursorrow < s.rows)
+      damagecells(cursorrow, s.cursor.x - 1, s.cursor.x + 1);
+
+    lf_container_t areas[s.rows];
+    uint32_t nareas = damagedareas(areas, winsize.x);
+    for (uint32_t i = 0; i < nareas; i++) {
+      ui->render_clear_color_area(
+        ui->root->props.color, 
+        areas[i], winsize.y);
+    }
+    if (nareas) {
+      ui->render_begin(ui->render_state);
+      renderterminalrows();
+      ui->render_end(ui->render_state);
     }
-    area = (lf_container_t){
-      .pos = (vec2s){.x = 0, .y = renderstart},
-      .size = (vec2s){.x = winsize.x, .y = renderheight}
-    };
-
-    ui->render_clear_color_area(
-      ui->root->props.color, 
-      area, winsize.y);
-    ui->render_begin(ui->render_state);
-    renderterminalrows();
-    ui->render_end(ui->render_state);
   }
 
-  lf_win_swap_buffers(ui->win);
+  if (!s.soft)
+    lf_win_swap_buffers(ui->win);
   if (!rendered) {
     ui->_idle_delay_func(ui);
   }
@@ -239,28 +513,72 @@ void nextevent(lf_ui_state_t* ui) {
 
 void mainloop(void) {
   const int xfd = ConnectionNumber(lf_win_get_x11_display());
-  const int ttyfd = s.pty->masterfd;
-  const int maxfd = (xfd > ttyfd ? xfd : ttyfd) + 1;
-
-  fd_set rfd;
+  // The reader thread signals new pty output through the notify pipe
+  const int ttyfd = s.pty->notify_pipe[0];
+  const int masterfd = s.pty->masterfd;
+  int maxfd = xfd > ttyfd ? xfd : ttyfd;
+  maxfd = (maxfd > masterfd ? maxfd : masterfd) + 1;
+
+  fd_set rfd, wfd;
+  struct timespec now, trigger, ts, *tv;
+  double timeout = -1;
+  bool drawing = false;
+  uint64_t nupdates = 0;
 
   while (s.ui->running) {
     FD_ZERO(&rfd);
     FD_SET(ttyfd, &rfd);
     FD_SET(xfd, &rfd);
+    int nfds = maxfd;
+    if (s.search.started) {
+      FD_SET(s.search.notify_pipe[0], &rfd);
+      nfds = MAX(nfds, s.search.notify_pipe[0] + 1);
+    }
+    if (s.fallback.started) {
+      FD_SET(s.fallback.notify_pipe[0], &rfd);
+      nfds = MAX(nfds, s.fallback.notify_pipe[0] + 1);
+    }
+    FD_ZERO(&wfd);
+    if (ptywritepending())
+      FD_SET(masterfd, &wfd);
+
+    // Keep parsing without waiting while the pty has a backlog 
+    if (ptypending())
+      timeout = 0;
+
+    tv = NULL;
+    if (timeout >= 0) {
+      ts.tv_sec = timeout / 1E3;
+      ts.tv_nsec = 1E6 * (timeout - 1E3 * ts.tv_sec);
+      tv = &ts;
+    }
 
-    int ret = select(maxfd, &rfd, NULL, NULL, NULL);
+    int ret = pselect(nfds, &rfd, &wfd, NULL, tv, NULL);
     if (ret < 0) {
       if (errno == EINTR) continue;
       perror("select");
       break;
     }
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    bool should_render = false;
+    bool changed = false;
 
-    if (FD_ISSET(ttyfd, &rfd)) {
-      readfrompty();
-      should_render = true;
+    if (FD_ISSET(masterfd, &wfd))
+      flushpty();
+
+    if (FD_ISSET(ttyfd, &rfd) || ptypending()) {
+      if (readfrompty() > 0)
+        changed = true;
+    }
+
+    if (s.search.started && FD_ISSET(s.search.notify_pipe[0], &rfd)) {
+      if (searchpoll())
+        changed = true;
+    }
+
+    if (s.fallback.started && FD_ISSET(s.fallback.notify_pipe[0], &rfd)) {
+      if (fallbackpoll())
+        changed = true;
     }
 
     if (FD_ISSET(xfd, &rfd)) {
@@ -273,13 +591,38 @@ void mainloop(void) {
         e == LF_EVENT_WINDOW_REFRESH ||
         e == LF_EVENT_WINDOW_CLOSE ||
         e == LF_EVENT_WINDOW_RESIZE) {
-        should_render = true;
+        changed = true;
       }
     }
 
-    if (should_render) {
-      nextevent(s.ui);
+    if (changed) {
+      nupdates++;
+      if (!drawing) {
+        trigger = now;
+        drawing = true;
+      }
+    }
+    if (!drawing) {
+      timeout = -1;
+      continue;
     }
+
+    // Wait for the output to go idle, or for the deadline. The idle 
+    // window shrinks the longer the frame has been held back.
+    double elapsed = TIMEDIFF(now, trigger);
+    if (elapsed < maxlatency && (ret > 0 || ptypending())) {
+      timeout = (maxlatency - elapsed) / maxlatency * minlatency;
+      if (timeout > 0) continue;
+    }
+
+    // New output is searched once per frame, not once per read
+    searchupdate();
+    nextevent(s.ui);
+    s.framesdrawn++;
+    s.framesdropped += nupdates > 1 ? nupdates - 1 : 0;
+    nupdates = 0;
+    drawing = false;
+    timeout = -1;
   }
 
   cleanup();
@@ -363,11 +706,97 @@ Window createxwin(uint32_t w, uint32_t h) {
   return win;
 }
 
-int main() {
+static void usage(void) {
+  fprintf(stderr, "usage: tyr [--record <file>] [--renderer runara | grid | soft]\n"
+                  "       tyr --headless --replay <file> [--realtime] [--search <text> | --regex <pattern>]\n"
+                  "                      [--expect <screen hash>]\n"
+                  "       tyr --headless --resizes <count>\n"
+                  "       tyr --headless --fuzz <iterations>\n"
+                  "       tyr --headless --utf8 <file>\n"
+                  "       tyr --headless --coverage <font family>\n"
+                  "       tyr --headless --gl <file> [--snapshot <ppm file>] [--expect <image hash>]\n"
+                  "       tyr --headless --soft <file> [--snapshot <ppm file>] [--expect <image hash>]\n");
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  const char* replayfile = NULL, *recordfile = NULL, *search = NULL, *coverage = NULL;
+  const char* glfile = NULL, *softfile = NULL, *snapshot = NULL, *utf8file = NULL;
+  bool headless = false, realtime = false, regex = false, grid = false, soft = false;
+  int32_t resizes = 0, fuzz = 0;
+  uint64_t expect = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--headless") == 0) 
+      headless = true;
+    else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) 
+      replayfile = argv[++i];
+    else if (strcmp(argv[i], "--realtime") == 0) 
+      realtime = true;
+    else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) 
+      recordfile = argv[++i];
+    else if (strcmp(argv[i], "--search") == 0 && i + 1 < argc) 
+      search = argv[++i];
+    else if (strcmp(argv[i], "--regex") == 0 && i + 1 < argc) {
+      search = argv[++i];
+      regex = true;
+    }
+    else if (strcmp(argv[i], "--resizes") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) 
+      resizes = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--fuzz") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) 
+      fuzz = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--utf8") == 0 && i + 1 < argc) 
+      utf8file = argv[++i];
+    else if (strcmp(argv[i], "--coverage") == 0 && i + 1 < argc) 
+      coverage = argv[++i];
+    else if (strcmp(argv[i], "--gl") == 0 && i + 1 < argc) 
+      glfile = argv[++i];
+    else if (strcmp(argv[i], "--soft") == 0 && i + 1 < argc) 
+      softfile = argv[++i];
+    else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) 
+      snapshot = argv[++i];
+    else if (strcmp(argv[i], "--expect") == 0 && i + 1 < argc) {
+      char* end;
+      expect = strtoull(argv[++i], &end, 16);
+      if (!expect || *end) usage();
+    }
+    else if (strcmp(argv[i], "--renderer") == 0 && i + 1 < argc) {
+      grid = strcmp(argv[++i], "grid") == 0;
+      soft = strcmp(argv[i], "soft") == 0;
+      if (!grid && !soft && strcmp(argv[i], "runara") != 0) usage();
+    }
+    else 
+      usage();
+  }
+  if (headless != (replayfile != NULL || resizes || fuzz || utf8file || coverage || 
+    glfile || softfile)) 
+    usage();
+  if ((replayfile != NULL) + (resizes != 0) + (fuzz != 0) + (utf8file != NULL) + 
+    (coverage != NULL) + (glfile != NULL) + (softfile != NULL) > 1) 
+    usage();
+  if (headless && recordfile) usage();
+  if (realtime && !headless) usage();
+  if (search && !headless) usage();
+  if ((grid || soft) && headless) usage();
+  if (snapshot && !glfile && !softfile) usage();
+  if (expect && !replayfile && !glfile && !softfile) usage();
+
   signal(SIGINT, siginthandler);
   memset(&s, 0, sizeof(s));
+  s.scrollback.spillfd = -1;
   s.cursorstate = CURSOR_STATE_NORMAL;
-  s.rowsunicode = NULL;
+  stylereset();
+  if (headless) {
+    setlocale(LC_CTYPE, "");
+    if (resizes) return headlessresizes(resizes);
+    if (fuzz) return headlessfuzz(fuzz);
+    if (utf8file) return headlessutf8(utf8file);
+    if (coverage) return headlesscoverage(coverage);
+    if (glfile) return headlessgl(glfile, snapshot, expect);
+    if (softfile) return headlesssoft(softfile, snapshot, expect);
+    return headlessreplay(replayfile, realtime, search, regex, expect);
+  }
+  // Before the first resize, so the recording starts with the window size
+  if (recordfile && !(s.recorder = startrecording(recordfile))) return 1;
   s.pty = setuppty();
   setlocale(LC_CTYPE, "");
   if (!s.pty) return 1;
@@ -382,18 +811,26 @@ int main() {
   lf_win_set_resize_cb(win, resizecb);
   s.font = lf_asset_manager_request_font(s.ui, "JetBrains Mono Nerd Font", LF_FONT_STYLE_REGULAR, 28);;
   FT_Face face = s.font.font->face;
+  if (grid && !(s.gridgl = gridglinit(face)))
+    fprintf(stderr, "tyr: drawing with runara instead.\n");
+  if (soft) {
+    softinit(face);
+    if (!(s.soft = softattach(lf_win_get_x11_display(), win)))
+      fprintf(stderr, "tyr: drawing with runara instead.\n");
+  }
   int line_height = face->size->metrics.height >> 6;
   int x_advance = face->size->metrics.max_advance >> 6;
   resizeterm(1280, 720, x_advance, line_height);
   s.scrolltop = 0;
   s.scrollbottom = s.rows - 1;
-  s.escflags = 0;
+  s.parserstate = PARSER_STATE_GROUND;
   s.saved_scrollbottom = s.scrollbottom;
   s.saved_scrolltop = s.scrolltop;
-  s.saved_head = s.head;
   s.fullrerender = true;
   s.fontadvance = 0;
-  s.ui->root->props.color = (lf_color_t){0, 0, 0, 255};
+  s.ui->root->props.color = (lf_color_t){ 
+    TERM_BACKGROUND >> 16, (TERM_BACKGROUND >> 8) & 0xff, TERM_BACKGROUND & 0xff, 255 
+  };
   s.ui->root->container = (lf_container_t){ .pos = {.x = 0, .y = 0}, .size = {.x = 1280, .y = 720} };
 
   mainloop();
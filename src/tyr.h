@@ -6,6 +6,9 @@
 #include <stdint.h>
 #include <termio.h>
 
+#include "ring.h"
+#include "utf8.h"
+
 #define CLAMP(val, min, max) ((val) < (min) ? (min) : ((val) > (max) ? (max) : (val)))
 
 #define BUF_SIZE 65535
@@ -22,19 +25,76 @@
 #define ESC_BUF_SIZE    (128*UTF_SIZE)
 #define ESC_PARAM_SIZE  16
 
-#define MAX_ROWS 4096
+#define PTY_RING_SIZE (8 << 20)
+#define PTY_DRAIN_MAX (256 << 10)
+#define PTY_READS_SIZE (64 << 10)
+#define PTY_PASTE_CHUNK 4096
+
+typedef enum {
+  PTY_SEGMENT_DATA        = 0,
+  PTY_SEGMENT_PASTE_BEGIN = 1,
+  PTY_SEGMENT_PASTE_END   = 2,
+} pty_segment_kind_t;
+
+typedef struct {
+  pty_segment_kind_t kind;
+  char* data; // freed once written
+  size_t len, off;
+} pty_segment_t;
 
+// While recording, the reader thread notes when each read() returned
 typedef struct {
-  char* buf;
-  size_t buflen;
+  uint64_t end;  // ring position after the bytes it read
+  uint64_t time; // recordclock() when it returned
+} pty_read_t;
+
+typedef struct {
+  ringbuf_t ring; // filled by the reader thread, drained by readfrompty()
+  ringbuf_t reads; // pty_read_t of the bytes in ring, only while recording
+  _Atomic bool notified;
+  _Atomic bool eof;
   int32_t masterfd;
   struct termios prevterm;
   pthread_t ptythread;
   pid_t childpid;
   int shutdown_pipe[2];
   int notify_pipe[2];
+
+  // Outgoing data, flushed by the main loop whenever the pty is writable.
+  // Keys and replies (outkeys, a stb_ds array) go before paste segments.
+  char* outkeys;
+  pty_segment_t* outpaste;
+  bool pasteopen, pastesuspended;
 } pty_data_t;
 
+#define RECORD_RING_SIZE (16 << 20)
+#define RECORD_FLUSH_MS 10
+#define RECORD_MAGIC "TYRREC1\n"
+
+typedef enum {
+  RECORD_OUTPUT = 0, // bytes read from the pty
+  RECORD_INPUT  = 1, // bytes written to the pty
+  RECORD_RESIZE = 2, // two uint32_t, columns and rows
+  RECORD_DROPPED = 3, // a uint64_t, bytes of frames left out before it
+} record_kind_t;
+
+// Every frame in a recording starts with this header, in host byte order
+typedef struct {
+  uint64_t time; // nanoseconds since the recording started
+  uint32_t len;
+  uint32_t kind;
+} record_frame_t;
+
+typedef struct {
+  ringbuf_t ring; // filled by the main loop, drained by the writer thread
+  int fd;
+  pthread_t thread;
+  int shutdown_pipe[2];
+  uint64_t start;   // recordclock() when the recording started
+  uint64_t dropped; // bytes left out since the last RECORD_DROPPED
+  uint64_t lost;    // bytes left out in total
+} recorder_t;
+
 typedef struct {
   lf_ui_state_t* ui;
 } task_data_t;
@@ -85,14 +145,22 @@ typedef enum {
 } term_color_16_t;
 
 typedef enum {
-  ESC_STATE_ON_ESC     = 1,
-  ESC_STATE_CSI        = 2,
-  ESC_STATE_STR        = 4,  
-  ESC_STATE_ALTCHARSET = 8,
-  ESC_STATE_STR_END    = 16, 
-  ESC_STATE_TEST       = 32, 
-  ESC_STATE_UTF8       = 64,
-} escape_state_t;
+  PARSER_STATE_GROUND = 0,
+  PARSER_STATE_ESCAPE,
+  PARSER_STATE_ESCAPE_INTERMEDIATE,
+  PARSER_STATE_CSI_ENTRY,
+  PARSER_STATE_CSI_PARAM,
+  PARSER_STATE_CSI_INTERMEDIATE,
+  PARSER_STATE_CSI_IGNORE,
+  PARSER_STATE_DCS_ENTRY,
+  PARSER_STATE_DCS_PARAM,
+  PARSER_STATE_DCS_INTERMEDIATE,
+  PARSER_STATE_DCS_PASSTHROUGH,
+  PARSER_STATE_DCS_IGNORE,
+  PARSER_STATE_OSC_STRING,
+  PARSER_STATE_SOS_PM_APC_STRING,
+  PARSER_STATE_COUNT
+} parser_state_t;
 
 typedef enum {
   CURSOR_STATE_NORMAL   = 0,
@@ -106,57 +174,361 @@ typedef enum {
 } cursor_action_t;
 
 typedef struct {
-  char buf[ESC_BUF_SIZE];
+  char buf[ESC_BUF_SIZE]; // OSC string
   size_t len;            
-  char prefix; // . '?', '>', '!' or '\0' if none
+  char prefix; // . '?', '>', '<', '=' or '\0' if none
+  char intermediate; // . ' ', '!', '$', '(' or '\0' if none
   int params[ESC_PARAM_SIZE];
   uint32_t nparams;
+  uint32_t subparams; // bit i is set if params[i] followed a ':'
   char cmd[2];
 } escape_seq_t;
 
 typedef enum {
   FONT_NORM             = 0,
-  FONT_BOLD             = 1,
-  FONT_DIM              = 2, 
-  FONT_ITALIC           = 3,
-  FONT_UNDERLINED       = 4,
-  FONT_BLINK            = 5,
-  FONT_REVERSE          = 6,
-  FONT_HIDDEN           = 7,
+  FONT_BOLD             = 1 << 0,
+  FONT_DIM              = 1 << 1, 
+  FONT_ITALIC           = 1 << 2,
+  FONT_STRIKETHROUGH    = 1 << 3,
+  FONT_BLINK            = 1 << 4,
+  FONT_REVERSE          = 1 << 5,
+  FONT_HIDDEN           = 1 << 6,
+  FONT_OVERLINED        = 1 << 7,
 } term_font_style_t;
 
+typedef enum {
+  UNDERLINE_NONE        = 0,
+  UNDERLINE_SINGLE      = 1,
+  UNDERLINE_DOUBLE      = 2,
+  UNDERLINE_CURLY       = 3,
+  UNDERLINE_DOTTED      = 4,
+  UNDERLINE_DASHED      = 5,
+} term_underline_t;
+
+// A color in a style is its kind in the top byte and, below it, a 
+// palette index (term_color_16_t for the first 16) or 0xRRGGBB
+typedef enum {
+  COLOR_DEFAULT         = 0,
+  COLOR_PALETTE         = 1 << 24,
+  COLOR_RGB             = 2 << 24,
+} term_color_kind_t;
+
+#define COLOR_KIND(c) ((c) & 0xff000000u)
+#define COLOR_VALUE(c) ((c) & 0x00ffffffu)
+
+// Everything SGR sets for a cell. Each combination in use is stored 
+// once in s.styles, cells only hold its id.
+typedef struct {
+  uint32_t fg, bg, ulcolor; // term_color_kind_t | value
+  uint16_t attrs;           // term_font_style_t bits
+  uint8_t underline;        // term_underline_t
+  uint8_t pad;              // zero, styles are hashed and compared bytewise
+} style_t;
+
+_Static_assert(sizeof(style_t) == 16, "style_t is hashed as four words");
+
+// Style 0 is the default style. Ids are never reused, cells in the 
+// compact history keep theirs.
+typedef struct {
+  style_t* items;     // stb_ds array, indexed by id
+  uint32_t* slots;    // hash table of id + 1, 0 for a free slot
+  uint32_t nslots;    // power of two
+} style_table_t;
+
+// A glyph of shaped text, x is relative to where the text starts
+typedef struct {
+  RnFont* font;
+  RnGlyph glyph;
+  float x;
+} shaped_glyph_t;
+
+// Text shaped with HarfBuzz and split into fallback font ranges, ready
+// to be drawn at any position. An entry, its glyphs and its text are 
+// one allocation of size bytes.
+typedef struct shaped_text_t {
+  uint64_t hash;
+  RnFont* font;
+  const char* text;
+  shaped_glyph_t* glyphs;
+  uint32_t nglyphs;
+  size_t size;
+  struct shaped_text_t *prev, *next; // most recently drawn first
+} shaped_text_t;
+
+// Codepoints a font has glyphs for, 256 to a page. Pages of the BMP 
+// are indexed directly, those of the other planes through a hash map.
+typedef struct {
+  uint32_t bits[8];
+} coverage_page_t;
+
+typedef struct {
+  uint32_t key;   // codepoint >> 8
+  uint16_t value; // index in pages
+} coverage_astral_t;
+
+typedef struct {
+  uint16_t bmp[256];         // index in pages, 0 is the empty page
+  coverage_astral_t* astral; // stb_ds hash map
+  coverage_page_t* pages;    // stb_ds array
+} font_coverage_t;
+
+typedef struct {
+  FT_Face key;
+  font_coverage_t* value;
+} coverage_slot_t;
+
+typedef struct {
+  uint64_t key;
+  shaped_text_t* value;
+} shape_cache_slot_t;
+
+// Recently drawn shaped texts, at most SHAPE_CACHE_MEMORY bytes
+typedef struct {
+  shape_cache_slot_t* map; // stb_ds hash map by hash
+  shaped_text_t *newest, *oldest;
+  size_t bytes;
+  uint64_t hits, misses;
+} shape_cache_t;
+
 typedef enum {
   CHARSET_ASCII = 0,
   CHARSET_ALT   = 1, // DEC Special Graphics
 } charset_mode_t;
 
 
+// One screen cell in 8 bytes. Dirty state is kept per row in s.damage.
 typedef struct {
-  term_color_16_t bg, fg;
-  uint32_t codepoint;
-  term_font_style_t font_style;
-  bool dirty;
+  uint32_t codepoint : 21;
+  uint32_t wide      : 1; // first half of a double width character
+  uint32_t widedummy : 1; // second half, the character is in the cell before
+  uint32_t wrapped   : 1; // last cell of a row the text wrapped from
+  uint32_t           : 8;
+  uint32_t style;         // id in s.styles
 } cell_t;
 
+_Static_assert(sizeof(cell_t) == 8, "cell_t must stay packed");
+
+// Columns [mincol, maxcol] of a row that changed since the last frame,
+// the row is clean while maxcol < mincol
+typedef struct {
+  int32_t mincol, maxcol;
+} damage_t;
+
+// Rows live in a ring, so scrolling the whole screen moves head instead
+// of the cells. The main screen keeps its scrollback above head, the 
+// alternate screen has none. The ring holds pointers into cells, so 
+// scroll regions rotate pointers instead of copying rows.
+typedef struct {
+  cell_t* cells;
+  cell_t** lines;  // ring of row pointers into cells
+  int32_t nrows;   // rows in the ring, screen plus scrollback
+  int32_t head;    // ring row of the top screen line
+  int32_t histlen; // lines of scrollback above head
+} grid_t;
+
+// Everything sized by the geometry: both rings, tab stops, damage and 
+// the row buffers of the renderer and the history view. A resize carves
+// the new buffers out of the spare half while the old ones are still 
+// read, then the halves swap. A half only grows, to the largest size 
+// seen, so resizing to a geometry seen before does not allocate.
+typedef struct {
+  uint8_t* mem[2];
+  size_t cap[2];
+  size_t used;     // of the spare half during a resize
+  uint32_t cur;    // half the current buffers live in
+  uint32_t grows;  // times a half was reallocated
+} grid_arena_t;
+
+#define COLD_BLOCK_LINES 256
+
+// A block of history lines in compact form: per line the cell count, 
+// runs of equal attributes and the text as UTF-8, trailing blanks 
+// trimmed unless the line wrapped. Full blocks are LZ4 compressed when 
+// built with TYR_LZ4.
+typedef struct {
+  uint64_t id;
+  uint8_t* data;    // stb_ds array while the block is filling up
+  uint32_t size;    // bytes in data
+  uint32_t rawsize; // bytes before compression
+  uint32_t nlines;
+  bool sealed;
+  bool spilled;     // data lives at fileoff in the spill file
+  bool spilling;    // queued for the spill writer, data is still here
+  uint64_t fileoff;
+  uint32_t offsets[COLD_BLOCK_LINES]; // start of each line in the raw data
+} cold_block_t;
+
+// A sealed block as seen by another thread
+typedef struct {
+  uint8_t* raw;
+  uint32_t cap, rawsize, nlines;
+  uint64_t firstline;
+  uint32_t offsets[COLD_BLOCK_LINES];
+} scroll_block_copy_t;
+
+// A history row shown rewrapped to the current width
+typedef struct {
+  uint64_t line;   // first line of the wrapped text
+  uint32_t offset; // cells into the text where the row starts
+} scroll_row_t;
+
+// History that fell out of the hot ring, oldest block first
+typedef struct {
+  cold_block_t** blocks; // stb_ds array
+  uint64_t nextid;
+  size_t nlines;
+  uint64_t firstline; // number of the oldest line, counting dropped ones
+  size_t bytes; // resident, spilled blocks only count their header
+  // Oldest blocks beyond SCROLLBACK_MEMORY go to an unlinked temporary
+  // file, mapped back in chunks when they are read
+  int spillfd; // -1 until the first block is spilled
+  uint64_t spillend;
+  size_t spilledbytes;
+  int32_t spillnext;  // index of the oldest block not queued for the file
+  uint8_t** spillmaps; // stb_ds array, one mapping per chunk or NULL
+  // Blocks are written by a thread of their own, they stay in memory
+  // until their write is done
+  bool spillstarted;
+  pthread_t spillthread;
+  ringbuf_t spillqueue; // cold_block_t pointers
+  int spillwake[2];     // closing the write end stops the writer
+  size_t spillpending;  // resident bytes of queued blocks
+  // Raw data of the last block that was decompressed
+  uint64_t cachedid;
+  uint8_t* cache;
+  uint32_t cachecap;
+  // Rows of the view decoded from here, one per screen row
+  cell_t* viewrows;
+  // Lines before reflowend were stored at another width and are shown
+  // rewrapped to reflowcols. Their rows are worked out back from 
+  // reflowend as the view scrolls up: reflowrows holds the rows of
+  // lines [reflowscan, reflowend), newest first.
+  uint64_t reflowend, reflowscan;
+  int32_t reflowcols;
+  scroll_row_t* reflowrows; // stb_ds array
+  cell_t* reflowline;       // one stored line, decoded
+  int32_t reflowlinecap;
+} scrollback_t;
+
+#define SEARCH_QUERY_SIZE 256
+#define SEARCH_RESULT_RING (1 << 20)
+
+typedef enum {
+  SEARCH_MATCH_OLDER = 0, // history, found newest first
+  SEARCH_MATCH_NEWER,     // history sealed since, found oldest first
+  SEARCH_MATCH_LIVE,      // screen and recent history, newest first
+  SEARCH_LIVE_BEGIN,      // the live matches that follow replace the old ones
+  SEARCH_DONE,            // the job finished
+} search_record_kind_t;
+
+typedef struct {
+  uint64_t line; // counting every line ever pushed into the scrollback
+  uint16_t col, len; // in cells
+  uint32_t gen : 24;
+  uint32_t kind : 8;
+} search_match_t;
+
+typedef struct {
+  pthread_t thread;
+  bool started;
+  // The job for the worker, guarded by lock
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool pending, fresh, quit;
+  _Atomic uint32_t gen; // bumped for every new query, stops the old one
+  char query[SEARCH_QUERY_SIZE];
+  bool regex;
+  // Text of the lines not in sealed blocks, oldest first
+  char* livetext;        // stb_ds array
+  uint32_t* liveoffsets; // stb_ds array, start of each line in livetext
+  uint64_t livefirst;    // number of the first live line
+  uint64_t coldend;      // blocks before this id are sealed
+
+  // Matches streamed back to the main loop
+  ringbuf_t results;
+  _Atomic bool notified;
+  int notify_pipe[2];
+
+  // Main loop side
+  bool active, editing, stale, done;
+  char input[SEARCH_QUERY_SIZE];
+  bool inputregex;
+  search_match_t* older; // stb_ds arrays, see search_record_kind_t
+  search_match_t* newer;
+  search_match_t* live;
+  uint64_t current; // line of the match the view was moved to
+  cell_t* row;      // stb_ds array, history lines are decoded into it
+} search_t;
+
+// Fallback fonts are looked up once per Unicode block, and once more 
+// for single codepoints that the font of their block does not have
+#define FALLBACK_BLOCK(cp) ((cp) >> 8)
+#define FALLBACK_CODEPOINT(cp) (0x80000000u | (cp))
+
+typedef enum {
+  FALLBACK_PENDING = 0, // being looked up on the worker
+  FALLBACK_FOUND,
+  FALLBACK_NONE,        // no installed font has it
+} fallback_status_t;
+
+typedef struct {
+  uint32_t key; // FALLBACK_BLOCK or FALLBACK_CODEPOINT
+  fallback_status_t status;
+  char* family;
+  lf_mapped_font_t font; // loaded on first use
+} fallback_entry_t;
+
+typedef struct {
+  uint32_t key;
+  uint32_t codepoint; // looked up for the whole block of key
+} fallback_request_t;
+
+typedef struct {
+  pthread_t thread;
+  bool started;
+  // Shared with the worker, guarded by lock
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bool quit;
+  fallback_request_t* requests; // stb_ds arrays
+  fallback_entry_t* results;
+  int notify_pipe[2];
+
+  // Main loop side
+  fallback_entry_t* table; // stb_ds hash map by key
+  uint64_t configkey;      // of the fontconfig setup the table is for
+  bool dirty;              // has lookups that are not in the cache file
+} fallback_t;
+
 typedef struct {
   lf_ui_state_t* ui;
   pty_data_t* pty;
+  recorder_t* recorder;
   cursor_t cursor, altcursor;
-  cell_t* cells,  *altcells;
+  grid_t grid, altgrid;
+  grid_arena_t arena;
   int32_t rows, cols;
-  int32_t head, linecount;
+  int32_t viewoffset; // lines scrolled back into history, 0 follows output
+  scrollback_t scrollback;
+  search_t search;
   int32_t scrolltop, scrollbottom;
   cursor_t saved_cursor;
+  style_table_t styles;
+  // The SGR state, its id and the style of cells erased with it, which 
+  // only keeps its background
+  style_t pen;
+  uint32_t penid, blankid;
+  uint32_t saved_penid;
   int32_t saved_scrolltop;
   int32_t saved_scrollbottom;
-  int32_t saved_head;
-  int32_t last_cursor_row;
+  int32_t last_cursor_row, last_cursor_col;
   int32_t* tabs;
 
   escape_seq_t csiseq;
   cursor_state_t cursorstate;
   uint32_t termmode;
-  uint32_t escflags;
+  parser_state_t parserstate;
+  utf8_decoder_t utf8;
 
   uint32_t recentcodepoint;
 
@@ -170,10 +542,18 @@ typedef struct {
   _Atomic bool needrender;
 
   char** rowsunicode;
+  shape_cache_t shapecache;
+  coverage_slot_t* coverage; // stb_ds hash map by font face
+  fallback_t fallback;
 
   bool fullrerender;
+  bool gridgl; // drawn by gridgl.c instead of runara
+  bool soft;   // drawn on the CPU by soft.c
+
+  // Frames rendered and updates that were folded into a later frame
+  uint64_t framesdrawn, framesdropped;
 
-  uint8_t* dirty;
+  damage_t* damage;
 
 } state_t;
 
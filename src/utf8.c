@@ -0,0 +1,330 @@
+#include "utf8.h"
+
+#include <stdbool.h>
+
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
+void
+utf8reset(utf8_decoder_t* dec) {
+  dec->codepoint = 0;
+  dec->needed = dec->seen = 0;
+  dec->lower = 0x80;
+  dec->upper = 0xBF;
+}
+
+size_t
+utf8decodescalar(utf8_decoder_t* dec, const uint8_t* buf, size_t len, uint32_t* out) {
+  uint32_t* start = out;
+  size_t i = 0;
+  while (i < len) {
+    uint8_t b = buf[i];
+
+    if (dec->needed == 0) {
+      // Complete and well formed two and three byte sequences skip the
+      // state machine. ASCII rarely gets here, termparse() draws runs of
+      // it directly.
+      if (b >= 0xC2 && b <= 0xDF && i + 1 < len &&
+        (buf[i + 1] & 0xC0) == 0x80) {
+        *out++ = ((b & 0x1F) << 6) | (buf[i + 1] & 0x3F);
+        i += 2;
+        continue;
+      }
+      if (b >= 0xE1 && b <= 0xEC && i + 2 < len &&
+        (buf[i + 1] & 0xC0) == 0x80 && (buf[i + 2] & 0xC0) == 0x80) {
+        *out++ = ((b & 0x0F) << 12) | ((buf[i + 1] & 0x3F) << 6) | (buf[i + 2] & 0x3F);
+        i += 3;
+        continue;
+      }
+
+      i++;
+      dec->lower = 0x80;
+      dec->upper = 0xBF;
+      if (b < 0x80) {
+        *out++ = b;
+      } else if (b >= 0xC2 && b <= 0xDF) {
+        dec->needed = 1;
+        dec->codepoint = b & 0x1F;
+      } else if (b >= 0xE0 && b <= 0xEF) {
+        if (b == 0xE0) dec->lower = 0xA0;
+        if (b == 0xED) dec->upper = 0x9F;
+        dec->needed = 2;
+        dec->codepoint = b & 0x0F;
+      } else if (b >= 0xF0 && b <= 0xF4) {
+        if (b == 0xF0) dec->lower = 0x90;
+        if (b == 0xF4) dec->upper = 0x8F;
+        dec->needed = 3;
+        dec->codepoint = b & 0x07;
+      } else {
+        *out++ = UTF8_REPLACEMENT_CHAR;
+      }
+      continue;
+    }
+
+    if (b < dec->lower || b > dec->upper) {
+      // The sequence ends early. The byte is not consumed, 
+      // it starts over in the next iteration.
+      utf8reset(dec);
+      *out++ = UTF8_REPLACEMENT_CHAR;
+      continue;
+    }
+
+    i++;
+    dec->lower = 0x80;
+    dec->upper = 0xBF;
+    dec->codepoint = (dec->codepoint << 6) | (b & 0x3F);
+    if (++dec->seen == dec->needed) {
+      *out++ = dec->codepoint;
+      utf8reset(dec);
+    }
+  }
+  return out - start;
+}
+
+#ifdef __x86_64__
+// How the four codepoints at the start of a window are laid out, for
+// each of the 256 ways to combine sequences of one to four bytes. Each
+// codepoint is shuffled into a 32 bit lane with its last byte lowest.
+typedef struct {
+  uint8_t shuffle[16];
+  uint8_t payload[16]; // bits of each byte that belong to the codepoint
+  uint8_t marker[16];  // what the other bits of each byte have to be
+  uint32_t min[4];     // smaller codepoints are overlong
+} utf8_pattern_t;
+
+static utf8_pattern_t patterns[256];
+
+// The pattern and length of the window for the first 13 bits of a lead
+// mask, end << 8 | pattern. Zero where patternat() has to work it out,
+// when the four sequences are longer than 12 bytes or malformed.
+static uint16_t windows[1 << 13];
+
+// Finds the four sequences from bit start of lead, which is set for
+// bytes that are not continuation bytes and has one more bit than the
+// window. Fails unless start is a lead byte and each sequence is one to
+// four bytes long, the lead bytes themselves are checked later.
+static bool
+patternat(uint64_t lead, uint32_t start, uint32_t* idx, uint32_t* end) {
+  // The top bits stand in for lead bytes past the window, so missing
+  // ones make sequences too long instead of counting zeros in nothing
+  uint64_t m = (lead >> start) | 0x1FULL << 59;
+  uint32_t e0 = m & 1 ? 0 : 63;
+  m &= m - 1;
+  uint32_t e1 = __builtin_ctzll(m);
+  m &= m - 1;
+  uint32_t e2 = __builtin_ctzll(m);
+  m &= m - 1;
+  uint32_t e3 = __builtin_ctzll(m);
+  m &= m - 1;
+  uint32_t e4 = __builtin_ctzll(m);
+  uint32_t l0 = e1 - e0 - 1, l1 = e2 - e1 - 1, l2 = e3 - e2 - 1, l3 = e4 - e3 - 1;
+  *idx = l0 | l1 << 2 | l2 << 4 | l3 << 6;
+  *end = start + e4;
+  return (l0 | l1 | l2 | l3) < 4;
+}
+
+static void
+buildpatterns(void) {
+  static const uint8_t leadpayload[5] = { 0, 0x7F, 0x1F, 0x0F, 0x07 };
+  static const uint8_t leadmarker[5] = { 0, 0x00, 0xC0, 0xE0, 0xF0 };
+  static const uint32_t min[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+  for (uint32_t idx = 0; idx < 256; idx++) {
+    utf8_pattern_t* p = &patterns[idx];
+    uint32_t pos = 0;
+    for (uint32_t k = 0; k < 4; k++) {
+      uint32_t l = (idx >> 2 * k & 3) + 1;
+      for (uint32_t j = 0; j < 4; j++) {
+        uint32_t lane = 4 * k + j;
+        bool lead = j == l - 1;
+        p->shuffle[lane] = j < l ? pos + l - 1 - j : 0x80;
+        p->payload[lane] = j < l ? (lead ? leadpayload[l] : 0x3F) : 0;
+        p->marker[lane] = j < l ? (lead ? leadmarker[l] : 0x80) : 0;
+      }
+      p->min[k] = min[l];
+      pos += l;
+    }
+  }
+  for (uint32_t lead = 0; lead < 1 << 13; lead++) {
+    uint32_t idx, end;
+    windows[lead] = patternat(lead, 0, &idx, &end) ? end << 8 | idx : 0;
+  }
+}
+
+static inline bool
+windowat(uint64_t lead, uint32_t start, uint32_t* idx, uint32_t* end) {
+  uint32_t w = windows[lead >> start & ((1 << 13) - 1)];
+  if (!w) return patternat(lead, start, idx, end);
+  *idx = w & 0xFF;
+  *end = start + (w >> 8);
+  return true;
+}
+
+static inline bool
+iscontinuation(uint8_t b) {
+  return (b & 0xC0) == 0x80;
+}
+
+// Decodes windows of four codepoints while they are well formed.
+// Returns the bytes consumed, the codepoints written go to *written.
+__attribute__((target("ssse3")))
+static size_t
+decodessse3(const uint8_t* buf, size_t len, uint32_t* out, size_t* written) {
+  // Continuation bytes 0x80 to 0xBF are the signed chars below -64
+  const __m128i cont = _mm_set1_epi8(-64);
+  size_t i = 0, n = 0;
+  // The byte after the window tells where its last sequence ends
+  while (i + 17 <= len) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+    uint64_t lead = ~_mm_movemask_epi8(_mm_cmplt_epi8(v, cont)) & 0xFFFF;
+    lead |= (uint64_t)!iscontinuation(buf[i + 16]) << 16;
+    uint32_t idx, end;
+    if (!windowat(lead, 0, &idx, &end)) break;
+    const utf8_pattern_t* p = &patterns[idx];
+
+    __m128i lanes = _mm_shuffle_epi8(v, _mm_loadu_si128((const __m128i*)p->shuffle));
+    __m128i payload = _mm_loadu_si128((const __m128i*)p->payload);
+    __m128i marked = _mm_cmpeq_epi8(_mm_andnot_si128(payload, lanes),
+                                    _mm_loadu_si128((const __m128i*)p->marker));
+    __m128i bits = _mm_and_si128(lanes, payload);
+    __m128i cp = _mm_or_si128(
+      _mm_or_si128(_mm_and_si128(bits, _mm_set1_epi32(0xFF)),
+                   _mm_srli_epi32(_mm_and_si128(bits, _mm_set1_epi32(0xFF00)), 2)),
+      _mm_or_si128(_mm_srli_epi32(_mm_and_si128(bits, _mm_set1_epi32(0xFF0000)), 4),
+                   _mm_srli_epi32(_mm_and_si128(bits, _mm_set1_epi32(0xFF000000)), 6)));
+    __m128i bad = _mm_or_si128(
+      _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*)p->min), cp),
+      _mm_or_si128(_mm_cmpgt_epi32(cp, _mm_set1_epi32(0x10FFFF)),
+                   _mm_cmpeq_epi32(_mm_and_si128(cp, _mm_set1_epi32(0xFFFFF800)),
+                                   _mm_set1_epi32(0xD800))));
+    if (_mm_movemask_epi8(marked) != 0xFFFF || _mm_movemask_epi8(bad)) break;
+
+    _mm_storeu_si128((__m128i*)(out + n), cp);
+    n += 4;
+    i += end;
+  }
+  *written = n;
+  return i;
+}
+
+// Like decodessse3(), two windows at a time: the second one starts where
+// the first one ends.
+__attribute__((target("avx2")))
+static size_t
+decodeavx2(const uint8_t* buf, size_t len, uint32_t* out, size_t* written) {
+  enum { BLOCK = 1024 };
+  const __m256i cont = _mm256_set1_epi8(-64);
+  size_t i = 0, n = 0;
+  bool ok = true;
+  // A block of 64 bytes holds a window at least
+  while (ok && i + 64 <= len) {
+    // The lead bits of a block up front, finding a window then waits on
+    // the table lookups of the one before it and not on its loads
+    uint32_t leads[BLOCK / 32];
+    size_t blocklen = len - i < BLOCK ? (len - i) & ~(size_t)31 : BLOCK;
+    for (size_t j = 0; j < blocklen; j += 32) {
+      __m256i v = _mm256_loadu_si256((const __m256i*)(buf + i + j));
+      leads[j / 32] = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpgt_epi8(cont, v));
+    }
+    size_t base = i;
+    while (i + 33 <= base + blocklen) {
+      size_t pos = i - base;
+      uint64_t lead = (leads[pos / 32] | (uint64_t)leads[pos / 32 + 1] << 32) >> pos % 32;
+      uint32_t idx0, idx1, mid, end;
+      if (!windowat(lead, 0, &idx0, &mid) || !windowat(lead, mid, &idx1, &end)) {
+        ok = false;
+        break;
+      }
+      const utf8_pattern_t* p0 = &patterns[idx0], *p1 = &patterns[idx1];
+#define BOTH(field) _mm256_inserti128_si256( \
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)p0->field)), \
+        _mm_loadu_si128((const __m128i*)p1->field), 1)
+
+      __m256i w = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(buf + i))),
+        _mm_loadu_si128((const __m128i*)(buf + i + mid)), 1);
+      __m256i lanes = _mm256_shuffle_epi8(w, BOTH(shuffle));
+      __m256i payload = BOTH(payload);
+      __m256i marked = _mm256_cmpeq_epi8(_mm256_andnot_si256(payload, lanes), BOTH(marker));
+      __m256i bits = _mm256_and_si256(lanes, payload);
+      __m256i cp = _mm256_or_si256(
+        _mm256_or_si256(_mm256_and_si256(bits, _mm256_set1_epi32(0xFF)),
+                        _mm256_srli_epi32(_mm256_and_si256(bits, _mm256_set1_epi32(0xFF00)), 2)),
+        _mm256_or_si256(_mm256_srli_epi32(_mm256_and_si256(bits, _mm256_set1_epi32(0xFF0000)), 4),
+                        _mm256_srli_epi32(_mm256_and_si256(bits, _mm256_set1_epi32(0xFF000000)), 6)));
+      __m256i bad = _mm256_or_si256(
+        _mm256_cmpgt_epi32(BOTH(min), cp),
+        _mm256_or_si256(_mm256_cmpgt_epi32(cp, _mm256_set1_epi32(0x10FFFF)),
+                        _mm256_cmpeq_epi32(_mm256_and_si256(cp, _mm256_set1_epi32(0xFFFFF800)),
+                                           _mm256_set1_epi32(0xD800))));
+#undef BOTH
+      if ((uint32_t)_mm256_movemask_epi8(marked) != 0xFFFFFFFF || _mm256_movemask_epi8(bad)) {
+        ok = false;
+        break;
+      }
+
+      _mm256_storeu_si256((__m256i*)(out + n), cp);
+      n += 8;
+      i += end;
+    }
+  }
+  size_t rest;
+  i += decodessse3(buf + i, len - i, out + n, &rest);
+  *written = n + rest;
+  return i;
+}
+#endif
+
+static size_t
+decodenone(const uint8_t* buf, size_t len, uint32_t* out, size_t* written) {
+  (void)buf; (void)len; (void)out;
+  *written = 0;
+  return 0;
+}
+
+static size_t (*decodevector)(const uint8_t* buf, size_t len, uint32_t* out,
+                              size_t* written) = NULL;
+static const char* decodepath = "scalar";
+
+static void
+selectdecoder(void) {
+#ifdef __x86_64__
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2") || __builtin_cpu_supports("ssse3")) {
+    buildpatterns();
+    bool avx2 = __builtin_cpu_supports("avx2");
+    decodepath = avx2 ? "avx2" : "ssse3";
+    decodevector = avx2 ? decodeavx2 : decodessse3;
+    return;
+  }
+#endif
+  decodevector = decodenone;
+}
+
+const char*
+utf8decodepath(void) {
+  if (!decodevector) selectdecoder();
+  return decodepath;
+}
+
+size_t
+utf8decodechunk(utf8_decoder_t* dec, const uint8_t* buf, size_t len, uint32_t* out) {
+  if (!decodevector) selectdecoder();
+  if (decodevector == decodenone) return utf8decodescalar(dec, buf, len, out);
+  uint32_t* start = out;
+  size_t i = 0;
+  while (i < len) {
+    // Well formed text goes through the vector code. The state machine
+    // takes over where it stops, for the rest of a window at least, and
+    // for sequences left open by the previous chunk.
+    if (dec->needed == 0) {
+      size_t written;
+      i += decodevector(buf + i, len - i, out, &written);
+      out += written;
+    }
+    size_t n = len - i < 16 ? len - i : 16;
+    out += utf8decodescalar(dec, buf + i, n, out);
+    i += n;
+  }
+  return out - start;
+}
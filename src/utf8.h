@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UTF8_REPLACEMENT_CHAR 0xFFFD
+
+typedef struct {
+  uint32_t codepoint;       // bits of the sequence decoded so far
+  uint8_t needed, seen;     // continuation bytes expected and already read
+  uint8_t lower, upper;     // valid range of the next continuation byte
+} utf8_decoder_t;
+
+void utf8reset(utf8_decoder_t* dec);
+
+// Decodes len bytes into out, which must have room for len + 1
+// codepoints (a pending sequence may be flushed as U+FFFD).
+// Malformed input is replaced by U+FFFD following the WHATWG encoding
+// standard. An incomplete sequence at the end of buf is kept in dec and
+// completed by the next call. Returns the number of codepoints written.
+// Well formed text is decoded four or eight codepoints at a time with
+// SSSE3 or AVX2, whichever the CPU has.
+size_t utf8decodechunk(utf8_decoder_t* dec, const uint8_t* buf, size_t len, uint32_t* out);
+
+// Like utf8decodechunk() with the state machine alone, which the vector
+// code is compared against
+size_t utf8decodescalar(utf8_decoder_t* dec, const uint8_t* buf, size_t len, uint32_t* out);
+
+// "avx2", "ssse3" or "scalar", the code utf8decodechunk() uses
+const char* utf8decodepath(void);